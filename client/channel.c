@@ -20,37 +20,217 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifdef __linux__
+#define _GNU_SOURCE
+#define HAVE_SPLICE
+#endif
+
 #include "r2tcli.h"
 #include "msgparser.h"
+#include "compress.h"
+#include "lathist.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 extern int debug_level;
 
+#ifdef HAVE_SPLICE
+/** maximal payload spliced from a tunnel socket in one pass */
+#define CHANNEL_SPLICE_MAXLEN 65536
+#endif
+
+/** payload quantum one tunnel may forward per scheduler pass */
+#define CHANNEL_SCHED_QUANTUM NETBUF_MAX_SIZE
+/** channel output backlog above which tunnel reads are staged
+ * and scheduled instead of being forwarded straight away */
+#define CHANNEL_SCHED_HIWAT (2*NETBUF_MAX_SIZE)
+
+/** scheduler class serviced while the other one waits */
+#define SCHED_PRIO 0 /**< interactive / default tunnels */
+#define SCHED_BULK 1 /**< tunnels created with the bulk profile */
+
+/** map a tunnel to its scheduler class */
+#define sched_class(ns) \
+		(((ns)->profile == NETPROF_BULK) ? SCHED_BULK : SCHED_PRIO)
+
+/** minimal payload size worth compressing */
+#define CHANNEL_ZDATA_MINLEN 64
+/** consecutive incompressible payloads before a tunnel opts out */
+#define CHANNEL_ZDATA_MAXFAIL 8
+
+/** check whether payloads of a tunnel should be compressed */
+#define channel_zdata_active(ns) \
+		((vc.caps & vc.peer_caps & R2TCAP_ZDATA) \
+		 && ((ns)->zfail < CHANNEL_ZDATA_MAXFAIL))
+
+/** per-tunnel flow-control window size (0 disables flow control) */
+unsigned int channel_window = RDP2TCP_WINDOW_SIZE;
+
+/** configured window, RTT scaling never shrinks channel_window below it */
+static unsigned int window_base = RDP2TCP_WINDOW_SIZE;
+
+/** check whether flow control was negotiated */
+#define channel_wndup_active() \
+		(channel_window && (vc.caps & vc.peer_caps & R2TCAP_WNDUP))
+
+/** check whether the server echoes timestamped ping probes */
+#define channel_rtt_active() (vc.caps & vc.peer_caps & R2TCAP_RTT)
+
+/** latency tracing sample rate (1-in-N messages, 0 disables tracing) */
+static unsigned int lat_sample_rate;
+/** messages enqueued since the last latency sample */
+static unsigned int lat_sample_count;
+/** enqueue timestamp of the in-flight sample (usecs, 0 when idle) */
+static unsigned long long lat_mark_us;
+/** local channel queue delay (message enqueue --> buffer drained) */
+static lathist_t lat_queue;
+/** last server-side queue delay histogram (R2TCMD_LATSTAT) */
+static lathist_t lat_server;
+
+/** incremental framing state of one channel input pipe */
+typedef struct _vcframe {
+	unsigned int got;     /**< addin wrapper bytes collected */
+	unsigned int left;    /**< wrapper payload bytes still expected */
+	unsigned char len[4]; /**< addin wrapper length (host order) */
+} vcframe_t;
+
 /** TS virtual channel singleton  */
 typedef struct _vchannel {
 	time_t ts;      /**< timestamp of last channel activity */
 	int last_state; /**< virtual channel previous state */
+	int corked;     /**< 1 while coalescing messages for one batch */
+	unsigned char caps;      /**< local capabilities (R2TCAP_xxx) */
+	unsigned char peer_caps; /**< negotiated server capabilities */
+	unsigned int srtt;       /**< smoothed channel RTT (msecs, 0=unknown) */
+	unsigned int rttvar;     /**< smoothed RTT jitter (msecs) */
+	unsigned long long next_probe; /**< next keepalive probe (msecs) */
+	evtimer_t timer;         /**< keepalive / liveness deadline timer */
 	iobuf_t ibuf;   /**< input buffer */
 	iobuf_t obuf;   /**< output buffer */
+	iobuf_t zbuf;   /**< compression scratch buffer */
+	vcframe_t frm;  /**< input framing state */
+#ifdef HAVE_SPLICE
+	int splfd[2];           /**< staging pipe holding spliced payload */
+	unsigned int spl_len;   /**< payload bytes pending in the staging pipe */
+	unsigned int hdr_off;   /**< header bytes already written out */
+	unsigned int hdr_len;   /**< framing header size */
+	unsigned char hdr[7];   /**< framing header of the spliced message */
+#endif
 } vchannel_t;
 
 static vchannel_t vc;
 
+/** extra virtual channel stripe
+ * stripes only carry per-tunnel messages so a bulk transfer queued on
+ * one stripe cannot head-of-line-block interactive tunnels pinned to
+ * another; every other message stays on the main channel */
+typedef struct _vcstripe {
+	int fd_in;    /**< addin --> client pipe */
+	int fd_out;   /**< client --> addin pipe */
+	iobuf_t ibuf; /**< input buffer */
+	iobuf_t obuf; /**< output buffer */
+	vcframe_t frm; /**< input framing state */
+} vcstripe_t;
+
+static vcstripe_t stripes[RDP2TCP_MAX_STRIPES];
+static unsigned int nstripes = 1;
+
+/** payload quantum, tunable with RDP2TCP_QUANTUM */
+static unsigned int sched_quantum = CHANNEL_SCHED_QUANTUM;
+/** round-robin rings of tunnels with staged payload, one per class */
+static netsock_t *sched_head[2], *sched_tail[2];
+
+static void channel_sched_enqueue(netsock_t *);
+static int channel_forward_chunk(netsock_t *, iobuf_t *, unsigned int);
+
 /**
  * initialize TS virtual channel
  */
 int channel_init(void)
 {
+	const char *env;
+	unsigned int i, n;
+	int fd_in, fd_out;
+
 	trace_chan("");
 
+	env = getenv("RDP2TCP_WINDOW");
+	if (env)
+		channel_window = (unsigned int) atoi(env);
+
+	window_base = channel_window;
+
+	env = getenv("RDP2TCP_TRACE_LAT");
+	if (env)
+		lat_sample_rate = (unsigned int) atoi(env);
+
+	env = getenv("RDP2TCP_QUANTUM");
+	if (env && (atoi(env) > 0))
+		sched_quantum = (unsigned int) atoi(env);
+
 	vc.ts = 0;
 	vc.last_state = -1;
+	vc.caps = R2TCAP_ZDATA | R2TCAP_UDP | R2TCAP_TID16 | R2TCAP_RTT
+					| R2TCAP_LATSTAT
+					| (channel_window ? R2TCAP_WNDUP : 0)
+					| (tunnel_resume_enabled() ? R2TCAP_RESUME : 0);
 	iobuf_init2(&vc.ibuf, &vc.obuf, "chan");
+	iobuf_init(&vc.zbuf, 'r', "zdata");
+
+	// input framing is incremental, never block on a partial message
+	fcntl(RDP_FD_IN, F_SETFL, fcntl(RDP_FD_IN, F_GETFL) | O_NONBLOCK);
+	// eager writes must queue their unsent tail on EAGAIN instead of
+	// stalling the whole event loop on a full rdesktop pipe
+	fcntl(RDP_FD_OUT, F_SETFL, fcntl(RDP_FD_OUT, F_GETFL) | O_NONBLOCK);
+
+#ifdef HAVE_SPLICE
+	// zero-copy forwarding is optional, fall back on the iobuf path
+	if (pipe2(vc.splfd, O_NONBLOCK) < 0) {
+		warn("failed to create splice pipe (%s)", strerror(errno));
+		vc.splfd[0] = -1;
+		vc.splfd[1] = -1;
+	}
+	vc.spl_len = 0;
+#endif
+
+	// optional striping: the rdesktop addin registers extra channels
+	// (RDP2TCP_CHAN_NAME plus the stripe index) and passes their pipes
+	// as inherited descriptors after stderr, one in/out pair per stripe
+	env = getenv("RDP2TCP_STRIPES");
+	if (env) {
+		n = (unsigned int) atoi(env);
+		if (n > RDP2TCP_MAX_STRIPES)
+			n = RDP2TCP_MAX_STRIPES;
+
+		for (i=1; i<n; ++i) {
+			fd_in  = 1 + 2*i;
+			fd_out = 2 + 2*i;
+			if ((fcntl(fd_in, F_GETFL) < 0) || (fcntl(fd_out, F_GETFL) < 0)) {
+				warn("channel stripe %u pipes not inherited", i);
+				break;
+			}
+			fcntl(fd_in, F_SETFL, fcntl(fd_in, F_GETFL) | O_NONBLOCK);
+			fcntl(fd_out, F_SETFL, fcntl(fd_out, F_GETFL) | O_NONBLOCK);
+			stripes[i].fd_in  = fd_in;
+			stripes[i].fd_out = fd_out;
+			iobuf_init2(&stripes[i].ibuf, &stripes[i].obuf, "stripe");
+			if (event_watch_stripe(i, fd_in)) {
+				iobuf_kill2(&stripes[i].ibuf, &stripes[i].obuf);
+				break;
+			}
+			nstripes = i + 1;
+		}
+
+		if (nstripes > 1)
+			info(0, "striping tunnel payloads across %u channels", nstripes);
+	}
 
 	return 0;
 }
@@ -60,11 +240,40 @@ int channel_init(void)
  */
 void channel_kill(void)
 {
+	unsigned int i;
+
 	trace_chan("");
 
+	for (i=1; i<nstripes; ++i)
+		iobuf_kill2(&stripes[i].ibuf, &stripes[i].obuf);
+	nstripes = 1;
+
+#ifdef HAVE_SPLICE
+	if (vc.splfd[0] != -1) {
+		close(vc.splfd[0]);
+		close(vc.splfd[1]);
+	}
+#endif
+	iobuf_kill(&vc.zbuf);
 	iobuf_kill2(&vc.ibuf, &vc.obuf);
 }
 
+/**
+ * compute the liveness deadline slack past the ping period
+ * @return slack in seconds
+ * @note a high-latency channel gets a proportionally larger deadline
+ */
+static time_t channel_deadline_slack(void)
+{
+	time_t slack;
+
+	slack = 4;
+	if (vc.srtt)
+		slack += (vc.srtt + 4 * vc.rttvar + 999) / 1000;
+
+	return slack;
+}
+
 /**
  * check whether virtual channel is currently connected
  * @return 0 if rcp2tcp.exe is not started on TS server
@@ -76,49 +285,75 @@ int channel_is_connected(void)
 
 	time(&now);
 
-	connected = (vc.ts && (vc.ts + RDP2TCP_PING_DELAY + 4 > now));
+	connected = (vc.ts
+			&& (vc.ts + RDP2TCP_PING_DELAY + channel_deadline_slack() > now));
 	//trace_chan(connected ? "yes" : "no");
 
 	if (vc.last_state != connected) {
 		vc.last_state = connected;
 		info(0, "virtual channel %s", connected?"connected":"disconnected");
+		if (!connected) {
+			// capabilities and framing are renegotiated on reconnect
+			vc.peer_caps = 0;
+			r2t_tid16_in  = 0;
+			r2t_tid16_out = 0;
+			vc.srtt       = 0;
+			vc.rttvar     = 0;
+			vc.next_probe = 0;
+			lat_mark_us   = 0;
+			channel_window = window_base;
+			evtimer_cancel(&vc.timer);
+		}
 	}
 
 	return connected;
 }
 
 /**
- * handle virtual channel read-event
+ * drain a channel pipe without blocking and parse complete messages
+ * @param[in] fd channel input descriptor
+ * @param[in] ibuf channel input buffer
+ * @param[in] frm input framing state
  * @return 0 on success
+ * @note messages delivered in dribbles are accumulated across
+ *       event-loop iterations, a partial read never stalls the loop
  */
-int channel_read_event(void)
+static int chan_read(int fd, iobuf_t *ibuf, vcframe_t *frm)
 {
 	ssize_t r;
 	char *ptr;
-	unsigned int msglen, avail;
-	
+	unsigned int msglen, avail, committed;
+
 	//trace_chan("");
 
-	ptr = (char *)&msglen;
-	avail = 4;
-	do {
-		r = read(RDP_FD_IN, ptr, avail);
-		if (r <= 0)
-			goto chan_read_err;
-		ptr += r;
-		avail -= r;
-	} while (avail > 0);
+	committed = 0;
 
-	ptr = iobuf_reserve(&vc.ibuf, msglen, &avail);
-	if (!ptr)
-		return error("failed to reserve channel memory");
+	for (;;) {
+
+		// collect the 4-byte addin wrapper header
+		while (frm->got < 4) {
+			r = read(fd, frm->len + frm->got, 4 - frm->got);
+			if (r <= 0)
+				goto chan_read_done;
+			frm->got += (unsigned int) r;
+		}
+
+		if (!frm->left) {
+			memcpy(&msglen, frm->len, 4);
+			// corked batches may pack several messages in one wrapper
+			if (!msglen || (msglen > 2*RDP2TCP_MAX_MSGLEN))
+				return error("invalid channel frame size 0x%08x", msglen);
+			frm->left = msglen;
+		}
 
-  avail = msglen;
-	do {
-		r = read(RDP_FD_IN, ptr, avail);
-		//trace_chan("r=%u/%u", r, avail);
-		if (r < 0)
-			goto chan_read_err;
+		ptr = iobuf_reserve(ibuf, frm->left, &avail);
+		if (!ptr)
+			return error("failed to reserve channel memory");
+
+		r = read(fd, ptr, frm->left);
+		//trace_chan("r=%u/%u", r, frm->left);
+		if (r <= 0)
+			goto chan_read_done;
 
 #ifdef DEBUG
 		if (debug_level > 2) {
@@ -127,25 +362,52 @@ int channel_read_event(void)
 			fputc('\n', stderr);
 		}
 #endif
-		
-		print_xfer("chan", 'r', (unsigned int)r);
 
-		ptr += r;
-		avail -= r;
-	} while (avail > 0);
+		print_xfer("chan", 'r', (unsigned int)r);
 
-	iobuf_commit(&vc.ibuf, msglen);
-	commands_parse(&vc.ibuf);
-	time(&vc.ts);
+		iobuf_commit(ibuf, (unsigned int) r);
+		committed = 1;
+		frm->left -= (unsigned int) r;
+		if (!frm->left)
+			frm->got = 0; // wrapper done, expect a new header
+	}
 
-	return 0;
+chan_read_done:
+	if ((r < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+		// pipe drained, parse whatever complete messages arrived
+		if (committed) {
+			commands_parse(ibuf);
+			time(&vc.ts);
+		}
+		return 0;
+	}
 
-chan_read_err:
 	if (r < 0)
 		error("failed to read from channel pipe (%s)", strerror(errno));
-	else if (r == 0)
+	else
 		error("channel closed");
-	return -1;	
+	return -1;
+}
+
+/**
+ * handle virtual channel read-event
+ * @return 0 on success
+ */
+int channel_read_event(void)
+{
+	return chan_read(RDP_FD_IN, &vc.ibuf, &vc.frm);
+}
+
+/**
+ * handle read-event on an extra channel stripe
+ * @param[in] idx stripe index
+ * @return 0 on success
+ */
+int channel_stripe_read_event(unsigned int idx)
+{
+	assert((idx > 0) && (idx < nstripes));
+	return chan_read(stripes[idx].fd_in, &stripes[idx].ibuf,
+							&stripes[idx].frm);
 }
 
 /**
@@ -155,9 +417,44 @@ chan_read_err:
 int channel_want_write(void)
 {
 	//trace_chan(iobuf_datalen(&vc.obuf) > 0 ? "yes" : "no");
+#ifdef HAVE_SPLICE
+	if (vc.spl_len)
+		return 1;
+#endif
 	return iobuf_datalen(&vc.obuf) > 0;
 }
 
+#ifdef HAVE_SPLICE
+/**
+ * flush the pending spliced message to the RDP channel
+ * @return -1 on error, 0 on success or if the pipe would block
+ */
+static int channel_splice_flush(void)
+{
+	ssize_t w;
+
+	// the framing header is sent before the payload left in the pipe
+	while (vc.hdr_off < vc.hdr_len) {
+		w = write(RDP_FD_OUT, &vc.hdr[vc.hdr_off], vc.hdr_len-vc.hdr_off);
+		if (w <= 0)
+			return ((w < 0) && ((errno == EAGAIN) || (errno == EINTR))) ? 0 : -1;
+		vc.hdr_off += w;
+		print_xfer("chan", 'w', (unsigned int) w);
+	}
+
+	while (vc.spl_len) {
+		w = splice(vc.splfd[0], NULL, RDP_FD_OUT, NULL, vc.spl_len,
+						SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (w <= 0)
+			return ((w < 0) && ((errno == EAGAIN) || (errno == EINTR))) ? 0 : -1;
+		vc.spl_len -= w;
+		print_xfer("chan", 'w', (unsigned int) w);
+	}
+
+	return 0;
+}
+#endif
+
 /**
  * handle virtual channel write-event
  * @return 0 on success
@@ -172,14 +469,39 @@ void channel_write_event(void)
 	if (debug_level > 2) iobuf_dump(&vc.obuf);
 #endif
 
+#ifdef HAVE_SPLICE
+	if (vc.spl_len) {
+		if (channel_splice_flush() < 0) {
+			error("failed to splice to rdesktop pipe (%s)", strerror(errno));
+			bye();
+			return;
+		}
+		// queued messages wait until the spliced payload is fully out
+		if (vc.spl_len)
+			return;
+	}
+
+	if (!iobuf_datalen(&vc.obuf))
+		return;
+#endif
+
 	fd = RDP_FD_OUT;
 	ret = net_write(&fd, &vc.obuf, NULL, 0, &w);
 	if (ret >= 0) {
 		if (w > 0)
 			print_xfer("chan", 'w', (unsigned int) w);
 
-	} else { 
-		if (ret == NETERR_CLOSED) 
+		// the sampled message left the queue with this drain
+		if (lat_mark_us && !iobuf_datalen(&vc.obuf)) {
+			lathist_add(&lat_queue, lathist_now_us() - lat_mark_us);
+			lat_mark_us = 0;
+		}
+
+		// the drain freed channel credit for staged tunnels
+		channel_sched_run();
+
+	} else {
+		if (ret == NETERR_CLOSED)
 			error("rdesktop pipe closed");
 		else
 			error("failed to write to rdesktop pipe (%s)", strerror(errno));
@@ -188,12 +510,101 @@ void channel_write_event(void)
 }
 
 /**
- * reserve memory into virtual channel ouput buffer
+ * handle write-event on an extra channel stripe
+ * @param[in] idx stripe index
+ */
+void channel_stripe_write_event(unsigned int idx)
+{
+	int ret, fd;
+	unsigned int w;
+
+	assert((idx > 0) && (idx < nstripes));
+	trace_chan("idx=%u", idx);
+
+	fd = stripes[idx].fd_out;
+	ret = net_write(&fd, &stripes[idx].obuf, NULL, 0, &w);
+	if (ret >= 0) {
+		if (w > 0)
+			print_xfer("chan", 'w', (unsigned int) w);
+
+		channel_sched_run();
+
+	} else {
+		if (ret == NETERR_CLOSED)
+			error("rdesktop stripe pipe closed");
+		else
+			error("failed to write to rdesktop pipe (%s)", strerror(errno));
+		bye();
+	}
+}
+
+/**
+ * synchronize write interest of the extra channel stripes
+ * @note called once per main loop iteration, like event_watch_channel
+ */
+void channel_arm_stripes(void)
+{
+	unsigned int i;
+
+	for (i=1; i<nstripes; ++i)
+		event_watch_stripe_out(i, stripes[i].fd_out,
+						iobuf_datalen(&stripes[i].obuf) > 0);
+}
+
+/**
+ * start coalescing queued messages for the current event batch
+ * @note while corked, messages pile up in the output buffer
+ *       instead of being written out one by one
+ */
+void channel_cork(void)
+{
+	vc.corked = 1;
+}
+
+/**
+ * stop coalescing and flush everything queued during the batch
+ * in a single channel write
+ */
+void channel_uncork(void)
+{
+	unsigned int i;
+
+	vc.corked = 0;
+	if (channel_want_write())
+		channel_write_event();
+
+	for (i=1; i<nstripes; ++i) {
+		if (iobuf_datalen(&stripes[i].obuf))
+			channel_stripe_write_event(i);
+	}
+}
+
+/**
+ * select the output buffer carrying the messages of a tunnel
+ * @param[in] tid tunnel identifier
+ * @return the main channel buffer or a stripe buffer
+ * @note a tunnel sticks to one stripe so its messages stay ordered
+ */
+static iobuf_t *stripe_obuf(unsigned int tid)
+{
+	unsigned int i;
+
+	if ((nstripes < 2) || (tid == R2T_TID_NONE))
+		return &vc.obuf;
+
+	i = tid % nstripes;
+	return (i ? &stripes[i].obuf : &vc.obuf);
+}
+
+/**
+ * reserve memory into a virtual channel ouput buffer
+ * @param[in] obuf channel output buffer
  * @param[in] size requested minimal buffer size
  * @param[out] out_avail allocated size
  * @return NULL on memory allocation error
  */
-static void *write_reserve(unsigned int size, unsigned int *out_avail)
+static void *write_reserve(iobuf_t *obuf, unsigned int size,
+									unsigned int *out_avail)
 {
 	char *ptr;
 	unsigned int avail;
@@ -202,7 +613,7 @@ static void *write_reserve(unsigned int size, unsigned int *out_avail)
 	//trace_chan("");
 
 	// need extra space for size header
-	ptr = iobuf_reserve(&vc.obuf, size+4, &avail);
+	ptr = iobuf_reserve(obuf, size+4, &avail);
 	if (!ptr) {
 		error("failed to allocate channel memory");
 		return NULL;
@@ -215,31 +626,326 @@ static void *write_reserve(unsigned int size, unsigned int *out_avail)
 }
 
 /**
- * commit memory into virtual channel output buffer
+ * commit memory into a virtual channel output buffer
+ * @param[in] obuf channel output buffer
  * @param[in] size commited buffer size
  */
-static void write_commit(unsigned int size)
+/**
+ * maybe stamp the enqueue time of a message for latency tracing
+ * @param[in] obuf destination channel output buffer
+ * @note one sampled message at a time, only on the main channel so the
+ *       sample completes when vc.obuf drains; costs one comparison per
+ *       message while tracing is off
+ */
+static void channel_lat_enqueue(iobuf_t *obuf)
+{
+	if (!lat_sample_rate || lat_mark_us || (obuf != &vc.obuf))
+		return;
+
+	if (++lat_sample_count < lat_sample_rate)
+		return;
+
+	lat_sample_count = 0;
+	lat_mark_us = lathist_now_us();
+}
+
+static void write_commit(iobuf_t *obuf, unsigned int size)
 {
 	assert(size);
 	//trace_chan("size=%u", size);
 
-	*(unsigned int *)(iobuf_allocptr(&vc.obuf)) = htonl(size);
-	iobuf_commit(&vc.obuf, size+4);
+	*(unsigned int *)(iobuf_allocptr(obuf)) = htonl(size);
+	iobuf_commit(obuf, size+4);
+	channel_lat_enqueue(obuf);
 }
 
 /**
- * send a ping message to rdp2tcp server
- * @return 0 if message cannot be queued
+ * send a ping probe to the rdp2tcp server
+ * @return 0 on success
+ * @note the probe carries the local clock when the server echoes it
  */
 int channel_ping(void)
 {
-	r2tmsg_t msg;
+	unsigned char *msg;
+	unsigned int len;
 
 	trace_chan("");
-	msg.cmd = R2TCMD_PING;
-	msg.id  = 0;
 
-	return !iobuf_append(&vc.obuf, &msg, 2);
+	len = r2t_hdr_len();
+	if (channel_rtt_active())
+		len += 4;
+
+	msg = write_reserve(&vc.obuf, len, NULL);
+	if (!msg)
+		return -1;
+
+	r2t_hdr_write(msg, R2TCMD_PING, 0);
+	if (channel_rtt_active())
+		*(unsigned int *)(msg + len - 4) =
+				htonl((unsigned int) net_now_ms());
+
+	write_commit(&vc.obuf, len);
+	return 0;
+}
+
+/** timer callback waking the main loop at the next channel deadline */
+static void channel_timer_event(void *unused)
+{
+	(void) unused;
+	channel_keepalive();
+}
+
+/**
+ * send a keepalive probe when one is due and arm the channel timer
+ * for the next deadline
+ * @note called once per main loop iteration while the channel is up;
+ *       the probe interval tracks the RTT estimate so a snappy channel
+ *       is checked often and a slow one is not hammered
+ */
+void channel_keepalive(void)
+{
+	unsigned long long now;
+	unsigned int delay;
+	time_t now_s, deadline;
+
+	now = net_now_ms();
+
+	if (channel_rtt_active()) {
+
+		if (!vc.next_probe || (now >= vc.next_probe)) {
+			channel_ping();
+
+			delay = RDP2TCP_PING_DELAY * 1000;
+			if (vc.srtt) {
+				delay = 4 * (vc.srtt + 4 * vc.rttvar);
+				if (delay < RDP2TCP_PING_MINDELAY * 1000)
+					delay = RDP2TCP_PING_MINDELAY * 1000;
+				else if (delay > RDP2TCP_PING_DELAY * 1000)
+					delay = RDP2TCP_PING_DELAY * 1000;
+			}
+			vc.next_probe = now + delay;
+		}
+		delay = (unsigned int)(vc.next_probe - now);
+
+	} else {
+		// no probes to send, wake at the liveness deadline checked
+		// by channel_is_connected
+		time(&now_s);
+		deadline = vc.ts + RDP2TCP_PING_DELAY + channel_deadline_slack();
+		delay = (deadline > now_s
+					? (unsigned int)(deadline - now_s) * 1000 : 1000);
+	}
+
+	evtimer_arm(&vc.timer, delay, channel_timer_event, NULL);
+}
+
+/**
+ * handle the echo of a timestamped keepalive probe
+ * @param[in] ts_ms probe transmit clock (truncated milliseconds)
+ * @note smoothing follows the TCP estimator (RFC 6298); the
+ *       flow-control window grows with the RTT so a long fat channel
+ *       is not capped below its bandwidth-delay product
+ */
+void channel_rtt_event(unsigned int ts_ms)
+{
+	unsigned int rtt, delta;
+	unsigned long long wnd;
+
+	rtt = (unsigned int) net_now_ms() - ts_ms;
+
+	if (!vc.srtt && !vc.rttvar) {
+		vc.srtt   = (rtt ? rtt : 1);
+		vc.rttvar = rtt / 2;
+	} else {
+		delta = (rtt > vc.srtt ? rtt - vc.srtt : vc.srtt - rtt);
+		vc.rttvar = (3 * vc.rttvar + delta) / 4;
+		vc.srtt   = (7 * vc.srtt + rtt) / 8;
+		if (!vc.srtt)
+			vc.srtt = 1;
+	}
+	debug(1, "channel rtt=%ums srtt=%ums jitter=%ums",
+			rtt, vc.srtt, vc.rttvar);
+
+	if (window_base) {
+		wnd = ((unsigned long long) window_base * vc.srtt)
+				/ RDP2TCP_RTT_NOMINAL;
+		if (wnd < window_base)
+			wnd = window_base;
+		else if (wnd > (unsigned long long)
+							RDP2TCP_WINDOW_MAXSCALE * window_base)
+			wnd = (unsigned long long) RDP2TCP_WINDOW_MAXSCALE * window_base;
+		channel_window = (unsigned int) wnd;
+	}
+}
+
+/**
+ * report the current channel RTT estimate
+ * @param[out] out_jitter smoothed RTT jitter (msecs) or NULL
+ * @return the smoothed RTT in msecs, 0 when not measured yet
+ */
+unsigned int channel_rtt(unsigned int *out_jitter)
+{
+	if (out_jitter)
+		*out_jitter = vc.rttvar;
+	return vc.srtt;
+}
+
+/**
+ * handle a R2TCMD_LATSTAT histogram pushed by the rdp2tcp server
+ * @param[in] body histogram counters (4 bytes each, network order)
+ * @param[in] len body size
+ */
+void channel_latstat_event(const void *body, unsigned int len)
+{
+	unsigned int i;
+
+	if (len < LATHIST_BUCKETS * 4)
+		return;
+
+	for (i=0; i<LATHIST_BUCKETS; ++i)
+		lat_server.count[i] = ntohl(((const unsigned int *)body)[i]);
+}
+
+/**
+ * format the latency tracing histograms for the controller
+ * @param[out] cli_buf local queue-delay histogram output buffer
+ * @param[out] srv_buf server queue-delay histogram output buffer
+ * @param[in] size size of each output buffer
+ * @return 0 when latency tracing never produced a sample
+ */
+int channel_latstat(char *cli_buf, char *srv_buf, unsigned int size)
+{
+	int len;
+
+	len  = lathist_format(&lat_queue, cli_buf, size);
+	len += lathist_format(&lat_server, srv_buf, size);
+
+	return (lat_sample_rate || len) ? 1 : 0;
+}
+
+/**
+ * advertise client capabilities to the rdp2tcp server
+ * @param[in] ack 1 for the framing acknowledgment
+ * @note hello messages always keep the 1-byte identifier framing,
+ *       they drive the negotiation itself
+ */
+static void channel_send_hello(unsigned char ack)
+{
+	unsigned char *msg;
+
+	trace_chan("caps=0x%02x, ack=%u", vc.caps, ack);
+
+	msg = write_reserve(&vc.obuf, 3, NULL);
+	if (msg) {
+		msg[0] = R2TCMD_HELLO;
+		msg[1] = ack;
+		msg[2] = vc.caps;
+		write_commit(&vc.obuf, 3);
+	}
+}
+
+/**
+ * check whether the server supports UDP relay tunnels
+ * @return 0 if R2TCMD_UDATA must not be used
+ */
+int channel_udp_active(void)
+{
+	return vc.caps & vc.peer_caps & R2TCAP_UDP;
+}
+
+/**
+ * queue a generic message on the virtual channel
+ * @param[in] cmd R2TCMD_xxx
+ * @param[in] tid tunnel identifier
+ * @param[in] data message payload following the header
+ * @param[in] len payload size
+ * @return 0 on success
+ */
+int channel_write_msg(
+			unsigned char cmd,
+			unsigned int tid,
+			const void *data,
+			unsigned int len)
+{
+	unsigned char *msg;
+	unsigned int hlen;
+	iobuf_t *ob;
+
+	assert(data || !len);
+
+	// per-tunnel payloads follow their tunnel stripe, anything else
+	// stays on the main channel
+	ob = (((cmd == R2TCMD_DATA) || (cmd == R2TCMD_ZDATA)
+			|| (cmd == R2TCMD_UDATA) || (cmd == R2TCMD_CLOSE))
+			? stripe_obuf(tid) : &vc.obuf);
+
+	hlen = r2t_hdr_len();
+	msg = write_reserve(ob, hlen + len, NULL);
+	if (!msg)
+		return -1;
+
+	r2t_hdr_write(msg, cmd, tid);
+	if (len)
+		memcpy(msg + hlen, data, len);
+
+	write_commit(ob, hlen + len);
+	return 0;
+}
+
+/**
+ * drop messages queued for a dead channel and reset input framing
+ * @note called when tunnels freeze on channel loss; the replay rings
+ *       re-send lost tunnel payload after the resync
+ */
+void channel_drop_queued(void)
+{
+	unsigned int i, n;
+
+	n = iobuf_datalen(&vc.obuf);
+	if (n)
+		iobuf_consume(&vc.obuf, n);
+	n = iobuf_datalen(&vc.ibuf);
+	if (n)
+		iobuf_consume(&vc.ibuf, n);
+	vc.frm.got  = 0;
+	vc.frm.left = 0;
+
+	for (i=1; i<nstripes; ++i) {
+		n = iobuf_datalen(&stripes[i].obuf);
+		if (n)
+			iobuf_consume(&stripes[i].obuf, n);
+		n = iobuf_datalen(&stripes[i].ibuf);
+		if (n)
+			iobuf_consume(&stripes[i].ibuf, n);
+		stripes[i].frm.got  = 0;
+		stripes[i].frm.left = 0;
+	}
+}
+
+/**
+ * handle the server capability announcement
+ * @param[in] caps server capabilities (R2TCAP_xxx)
+ */
+void channel_hello_event(unsigned char caps)
+{
+	trace_chan("caps=0x%02x", caps);
+
+	vc.peer_caps = caps;
+	if (vc.caps & caps & R2TCAP_ZDATA)
+		info(0, "virtual channel compression enabled");
+
+	// switch both directions to 16-bit tunnel identifiers and tell
+	// the server; the server writes v2 frames right after its hello
+	// and parses them from the client once the acknowledgment arrives
+	if ((vc.caps & caps & R2TCAP_TID16) && !r2t_tid16_out) {
+		channel_send_hello(1);
+		r2t_tid16_in  = 1;
+		r2t_tid16_out = 1;
+		info(0, "16-bit tunnel identifiers enabled");
+	}
+
+	// frozen tunnels resync once capabilities are known
+	tunnels_resume(vc.caps & caps & R2TCAP_RESUME);
 }
 
 /**
@@ -252,6 +958,7 @@ void channel_pong(void)
 	if (vc.last_state != 1) {
 		vc.last_state = 1;
 		info(0, "virtual channel connected");
+		channel_send_hello(0);
 	}
 	time(&vc.ts);
 }
@@ -273,37 +980,40 @@ static unsigned int purify_strlen(const char *x)
  * @param[in] rhost remote tunnel hostname
  * @param[in] rport remote tunnel port
  * @param[in] reverse_connect 0 for tcp-connect or 1 for tcp-bind
- * @return the tunnel ID or 0xff on error
+ * @return the tunnel ID or R2T_TID_NONE on error
  */
-unsigned char channel_request_tunnel(
+unsigned int channel_request_tunnel(
 							unsigned char tunaf,
 							const char *rhost,
 							unsigned short rport,
 							int reverse_connect)
 {
-	unsigned char tid;
-	unsigned int hlen;
-	r2tmsg_connreq_t *msg;
+	unsigned int tid, hlen, hdr_len;
+	unsigned char *msg;
+	r2tmsg_connreq_t *req;
 
-	assert((tunaf <= TUNAF_IPV6) && rhost && *rhost);
+	assert((tunaf <= TUNAF_UDP) && rhost && *rhost);
 	trace_chan("tunaf=0x%02x, rhost=%s, rport=%hu", tunaf, rhost, rport);
 
 	tid = tunnel_generate_id();
-	if (tid == 0xff)
-		return 0xff;
+	if (tid == R2T_TID_NONE)
+		return R2T_TID_NONE;
 
 	hlen = 1 + strlen(rhost);
-	msg = write_reserve(5 + hlen, NULL);
-	if (!msg)
-		return 0xff;
+	hdr_len = r2t_hdr_len();
+	msg = write_reserve(&vc.obuf, hdr_len + 3 + hlen, NULL);
+	if (!msg) {
+		tunnel_release_id(tid);
+		return R2T_TID_NONE;
+	}
 
-	msg->cmd  = (!reverse_connect ? R2TCMD_CONN : R2TCMD_BIND);
-	msg->id   = tid;
-	msg->port = htons(rport);
-	msg->af   = tunaf;
-	memcpy(msg->hostname, rhost, hlen);
+	r2t_hdr_write(msg, (!reverse_connect ? R2TCMD_CONN : R2TCMD_BIND), tid);
+	req = (r2tmsg_connreq_t *)(msg + hdr_len);
+	req->port = htons(rport);
+	req->af   = tunaf;
+	memcpy(req->hostname, rhost, hlen);
 
-	write_commit(5 + hlen);
+	write_commit(&vc.obuf, hdr_len + 3 + hlen);
 
 	return tid;
 }
@@ -312,20 +1022,68 @@ unsigned char channel_request_tunnel(
  * notify the server a tunnel has been closed
  * @param[in] tid the tunnel ID
  */
-void channel_close_tunnel(unsigned char tid)
+void channel_close_tunnel(unsigned int tid)
 {
-	r2tmsg_t *msg;
+	unsigned char *msg;
+	iobuf_t *ob;
 
-	assert(tid != 0xff);
+	assert(tid != R2T_TID_NONE);
 	trace_chan("tid=0x%02x", tid);
 
-	msg = write_reserve(2, NULL);
-	if (msg) {
-		msg->cmd = R2TCMD_CLOSE;
-		msg->id  = tid;
-		write_commit(2);
+	// the close notification rides the tunnel stripe so it cannot
+	// overtake payload still queued behind it
+	ob = stripe_obuf(tid);
+	msg = write_reserve(ob, r2t_hdr_len(), NULL);
+	if (msg)
+		write_commit(ob, r2t_hdr_write(msg, R2TCMD_CLOSE, tid));
+}
+
+#ifdef HAVE_SPLICE
+/**
+ * splice data from tcp tunnel to the staging pipe (zero-copy)
+ * @param[in] ns tunnel socket
+ * @return 1 if the iobuf path must be used instead
+ */
+static int channel_splice_recv(netsock_t *ns)
+{
+	ssize_t r;
+	char host[NETADDRSTR_MAXSIZE];
+
+	r = splice(ns->fd, NULL, vc.splfd[1], NULL, CHANNEL_SPLICE_MAXLEN,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (r < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		// not splice-able, use the copy path
+		if ((errno == EINVAL) || (errno == ENOSYS))
+			return 1;
+		error("failed to recv data from %s (%s)",
+				netaddr_print(&ns->addr, host), strerror(errno));
+		tunnel_close(ns, 1);
+		return 0;
+	}
+
+	if (r == 0) {
+		info(0, "connection %s closed", netaddr_print(&ns->addr, host));
+		tunnel_close(ns, 1);
+		return 0;
 	}
+
+	print_xfer("tcp", 'r', (unsigned int) r);
+
+	vc.hdr_len = 4 + r2t_hdr_write(&vc.hdr[4], R2TCMD_DATA, ns->tid);
+	*(unsigned int *)vc.hdr = htonl(r + vc.hdr_len - 4);
+	vc.hdr_off = 0;
+	vc.spl_len = (unsigned int) r;
+
+	if (channel_wndup_active())
+		ns->wnd_used += (unsigned int) r;
+	ns->stats.bytes_in += (unsigned int) r;
+	++ns->stats.msgs_out;
+
+	return 0;
 }
+#endif
 
 /**
  * receive data from tcp tunnel and forward it to the RDP channel
@@ -335,56 +1093,392 @@ void channel_close_tunnel(unsigned char tid)
 int channel_forward_recv(netsock_t *ns)
 {
 	int ret;
-	unsigned int r, off;
-	unsigned char *msg;
+	unsigned int r;
 
 	assert(valid_netsock(ns) && ((ns->type == NETSOCK_TUNCLI)
 			|| (ns->type == NETSOCK_RTUNCLI) || (ns->type == NETSOCK_S5CLI)));
 	trace_chan("id=0x%02x", ns->tid);
 
-	off = iobuf_datalen(&vc.obuf);
-	ret = netsock_read(ns, &vc.obuf, 6, &r);
-	if (!ret) {
-		msg = iobuf_dataptr(&vc.obuf) + off;
-		*(unsigned int*)msg = htonl(r + 2);
-		msg[4] = R2TCMD_DATA;
-		msg[5] = ns->tid;
-	}
+#ifdef HAVE_SPLICE
+	// zero-copy bulk path, only for tunnels pinned to the main channel,
+	// when no queued data would be reordered and no staged tunnel is
+	// waiting for channel credit (a spliced burst cannot be preempted)
+	if (!tunnel_resume_enabled() && !channel_zdata_active(ns)
+			&& (stripe_obuf(ns->tid) == &vc.obuf)
+			&& (vc.splfd[0] != -1) && !vc.spl_len && !iobuf_datalen(&vc.obuf)
+			&& !sched_head[SCHED_PRIO] && !sched_head[SCHED_BULK]
+			&& (!ns->txq_on || !iobuf_datalen(&ns->txq))
+			&& !channel_splice_recv(ns))
+		return 0;
+#endif
 
-	if (ret < 0)
+	// payload is staged per tunnel and the scheduler interleaves
+	// bounded quanta, so one tunnel never queues a whole socket
+	// buffer in front of the others
+	if (!ns->txq_on) {
+		iobuf_init(&ns->txq, 'r', "txq");
+		ns->txq_on = 1;
+	}
+	ret = netsock_read(ns, &ns->txq, 0, &r);
+	if (ret < 0) {
+		// flush the staged tail so a graceful close right after
+		// a burst does not drop payload the peer already sent
+		channel_sched_unlink(ns);
+		if (iobuf_datalen(&ns->txq))
+			channel_forward_chunk(ns, &ns->txq, iobuf_datalen(&ns->txq));
 		tunnel_close(ns, 1);
+		return 0;
+	}
+	if (iobuf_datalen(&ns->txq))
+		channel_sched_enqueue(ns);
+	channel_sched_run();
 
 	return 0;
 }
 
 /**
- * forward data from I/O buffer to the RDP channel
+ * try to forward an I/O buffer as a compressed R2TCMD_ZDATA message
+ * @param[in] ns tunnel socket
  * @param[in] ibuf input buffer
- * @param[in] tid tunnel identifier
- * @return 0 or 1 on success
+ * @param[in] len payload size
+ * @return 1 if the payload did not compress and must be sent plain
  */
-int channel_forward_iobuf(iobuf_t *ibuf, unsigned char tid)
+static int channel_forward_zdata(netsock_t *ns, iobuf_t *ibuf, unsigned int len)
 {
-	r2tmsg_t *msg;
-	unsigned int len;
+	unsigned char *msg;
+	unsigned int zlen, hlen;
+	iobuf_t *ob;
+
+	ob = stripe_obuf(ns->tid);
+	hlen = r2t_hdr_len();
+	msg = write_reserve(ob, len + hlen + 4, NULL);
+	if (!msg)
+		return -1;
+
+	// only worth it when the 4-byte raw size header is amortized
+	zlen = r2t_compress(iobuf_dataptr(ibuf), len, msg + hlen + 4, len - 5);
+	if (!zlen) {
+		if (ns->zfail < 0xff)
+			++ns->zfail;
+		return 1; // reserved bytes are simply not committed
+	}
+	ns->zfail = 0;
 
-	assert(valid_iobuf(ibuf) && (tid != 0xff));
+	trace_chan("tid=0x%02x, len=%u->%u", ns->tid, len, zlen);
+
+	r2t_hdr_write(msg, R2TCMD_ZDATA, ns->tid);
+	*(unsigned int *)(msg + hlen) = htonl(len);
+	write_commit(ob, zlen + hlen + 4);
+
+	// the caller still captures the raw payload, consuming here would
+	// let the drain shrink or rewrite the buffer under it
+	return 0;
+}
+
+/**
+ * forward the head of an I/O buffer to the RDP channel
+ * @param[in] ns tunnel socket
+ * @param[in] ibuf input buffer
+ * @param[in] len payload size to forward
+ * @return 0 or 1 on success
+ */
+static int channel_forward_chunk(netsock_t *ns, iobuf_t *ibuf,
+											unsigned int len)
+{
+	unsigned char *msg;
+	ssize_t w;
+	int ret;
+	unsigned int off, tid, hdr_len, hlen;
+	unsigned char hdr[8];
+	struct iovec iov[2];
+	iobuf_t *ob;
+
+	assert(valid_iobuf(ibuf) && valid_netsock(ns)
+			&& (ns->tid != R2T_TID_NONE));
+	tid = ns->tid;
 	trace_chan("tid=0x%02x", tid);
 
-	len = iobuf_datalen(ibuf);
-	assert(len > 0);
+	assert(len && (len <= iobuf_datalen(ibuf)));
+
+	if ((len >= CHANNEL_ZDATA_MINLEN) && channel_zdata_active(ns)) {
+		ret = channel_forward_zdata(ns, ibuf, len);
+		if (ret != 1) {
+			if (!ret) {
+				tunnel_resume_capture(ns, iobuf_dataptr(ibuf), len);
+				iobuf_consume(ibuf, len);
+				if (channel_wndup_active())
+					ns->wnd_used += len;
+				ns->stats.bytes_in += len;
+				++ns->stats.msgs_out;
+			}
+			return ret;
+		}
+	}
+
+	ob = stripe_obuf(tid);
+
+	// gather-write header and payload without coalescing them
+	// in the channel output buffer, only for tunnels pinned to the
+	// main channel and when nothing is queued
+	if ((ob == &vc.obuf) && !vc.corked && !iobuf_datalen(&vc.obuf)
+#ifdef HAVE_SPLICE
+			&& !vc.spl_len
+#endif
+		) {
 
-	msg = write_reserve(len+2, NULL);
+		hdr_len = 4 + r2t_hdr_write(hdr + 4, R2TCMD_DATA, tid);
+		*(unsigned int *)hdr = htonl(len + hdr_len - 4);
+
+		iov[0].iov_base = hdr;
+		iov[0].iov_len  = hdr_len;
+		iov[1].iov_base = iobuf_dataptr(ibuf);
+		iov[1].iov_len  = len;
+
+		w = writev(RDP_FD_OUT, iov, 2);
+		if (w < 0) {
+			if ((errno != EAGAIN) && (errno != EINTR))
+				error("failed to write to rdesktop pipe (%s)", strerror(errno));
+			w = 0;
+		}
+
+		if (w > 0)
+			print_xfer("chan", 'w', (unsigned int) w);
+
+		// queue whatever was not sent, copying only the short-write tail
+		off = (unsigned int) w;
+		if (off < hdr_len) {
+			if (!iobuf_append(&vc.obuf, &hdr[off], hdr_len-off)
+					|| !iobuf_append(&vc.obuf, iobuf_dataptr(ibuf), len))
+				return -1;
+		} else {
+			off -= hdr_len;
+			if ((off < len)
+					&& !iobuf_append(&vc.obuf,
+							(char *)iobuf_dataptr(ibuf) + off, len - off))
+				return -1;
+		}
+
+		tunnel_resume_capture(ns, iobuf_dataptr(ibuf), len);
+		iobuf_consume(ibuf, len);
+		if (channel_wndup_active())
+			ns->wnd_used += len;
+		ns->stats.bytes_in += len;
+		++ns->stats.msgs_out;
+		return 0;
+	}
+
+	hlen = r2t_hdr_len();
+	msg = write_reserve(ob, len + hlen, NULL);
 	if (!msg)
 		return -1;
 
-	msg->cmd = R2TCMD_DATA;
-	msg->id  = tid;
-	memcpy(((char *)msg)+2, iobuf_dataptr(ibuf), len);
-	write_commit(len + 2);
+	r2t_hdr_write(msg, R2TCMD_DATA, tid);
+	memcpy(msg + hlen, iobuf_dataptr(ibuf), len);
+	write_commit(ob, len + hlen);
 
+	tunnel_resume_capture(ns, iobuf_dataptr(ibuf), len);
 	iobuf_consume(ibuf, len);
+	if (channel_wndup_active())
+		ns->wnd_used += len;
+	ns->stats.bytes_in += len;
+	++ns->stats.msgs_out;
 
 	return 0;
 }
 
+/**
+ * forward data from I/O buffer to the RDP channel
+ * @param[in] ns tunnel socket
+ * @param[in] ibuf input buffer
+ * @return 0 or 1 on success
+ */
+int channel_forward_iobuf(netsock_t *ns, iobuf_t *ibuf)
+{
+	return channel_forward_chunk(ns, ibuf, iobuf_datalen(ibuf));
+}
+
+/**
+ * append a tunnel to the back of its scheduler ring
+ * @param[in] ns tunnel socket with staged payload
+ */
+static void channel_sched_enqueue(netsock_t *ns)
+{
+	unsigned int cls;
+
+	if (ns->txq_queued)
+		return;
+
+	cls = sched_class(ns);
+	ns->txq_queued = 1;
+	ns->txq_next = NULL;
+	if (sched_tail[cls])
+		sched_tail[cls]->txq_next = ns;
+	else
+		sched_head[cls] = ns;
+	sched_tail[cls] = ns;
+}
+
+/**
+ * remove a closing tunnel from its scheduler ring
+ * @param[in] ns tunnel socket
+ */
+void channel_sched_unlink(netsock_t *ns)
+{
+	unsigned int cls;
+	netsock_t *cur, *prev;
+
+	if (!ns->txq_queued)
+		return;
+	ns->txq_queued = 0;
+
+	for (cls=0; cls<2; ++cls) {
+		prev = NULL;
+		for (cur=sched_head[cls]; cur; prev=cur, cur=cur->txq_next) {
+			if (cur != ns)
+				continue;
+			if (prev)
+				prev->txq_next = ns->txq_next;
+			else
+				sched_head[cls] = ns->txq_next;
+			if (sched_tail[cls] == ns)
+				sched_tail[cls] = prev;
+			return;
+		}
+	}
+}
+
+/**
+ * interleave staged tunnel payload into the channel buffers
+ * @note strict priority between the classes, round-robin quanta
+ *       within one; a ring is serviced until its tunnels drain or
+ *       every stripe they are pinned to reaches the backlog mark,
+ *       so one bulk transfer only ever queues a bounded burst in
+ *       front of an interactive message
+ */
+void channel_sched_run(void)
+{
+	static int running;
+	netsock_t *ns, *wait_head, *wait_tail;
+	unsigned int cls, len;
+
+	// forwarding staged data while frozen would lose it, the replay
+	// rings only cover payload already pushed to the channel
+	if (running || tunnels_frozen)
+		return;
+	running = 1;
+
+	for (cls=0; cls<2; ++cls) {
+
+		// tunnels parked here keep their service order for the next run
+		wait_head = NULL;
+		wait_tail = NULL;
+
+		while ((ns = sched_head[cls]) != NULL) {
+			sched_head[cls] = ns->txq_next;
+			if (!sched_head[cls])
+				sched_tail[cls] = NULL;
+			ns->txq_queued = 0;
+			ns->txq_next = NULL;
+
+			if (ns->rsm_wait
+					|| (iobuf_datalen(stripe_obuf(ns->tid))
+							>= CHANNEL_SCHED_HIWAT)) {
+				// no credit on this stripe, other stripes may still go
+				ns->txq_queued = 1;
+				if (wait_tail)
+					wait_tail->txq_next = ns;
+				else
+					wait_head = ns;
+				wait_tail = ns;
+				continue;
+			}
+
+			len = iobuf_datalen(&ns->txq);
+			if (len > sched_quantum)
+				len = sched_quantum;
+
+			if (channel_forward_chunk(ns, &ns->txq, len) < 0) {
+				tunnel_close(ns, 1);
+				continue;
+			}
+
+			if (iobuf_datalen(&ns->txq))
+				channel_sched_enqueue(ns);
+		}
+
+		if (wait_head) {
+			wait_tail->txq_next = sched_head[cls];
+			sched_head[cls] = wait_head;
+			if (!sched_tail[cls])
+				sched_tail[cls] = wait_tail;
+		}
+	}
+
+	running = 0;
+}
+
+/**
+ * decompress a R2TCMD_ZDATA payload and forward it to the tunnel
+ * @param[in] ns tunnel socket
+ * @param[in] zdata compressed payload
+ * @param[in] zlen compressed payload size
+ * @param[in] raw_len expected decompressed size
+ * @return -1 on error
+ */
+int channel_zdata_recv(
+			netsock_t *ns,
+			const void *zdata,
+			unsigned int zlen,
+			unsigned int raw_len)
+{
+	void *ptr;
+
+	assert(valid_netsock(ns) && zdata && zlen && raw_len);
+	trace_chan("tid=0x%02x, len=%u->%u", ns->tid, zlen, raw_len);
+
+	ptr = iobuf_reserve(&vc.zbuf, raw_len, NULL);
+	if (!ptr)
+		return error("failed to allocate decompression memory");
+
+	if (r2t_decompress(zdata, zlen, ptr, raw_len) != (int)raw_len) {
+		error("corrupted compressed payload on tunnel 0x%02x", ns->tid);
+		tunnel_close(ns, 1);
+		return 0;
+	}
+
+	return tunnel_write(ns, ptr, raw_len);
+}
+
+/**
+ * account payload bytes flushed to the local tunnel endpoint
+ * and acknowledge them to the rdp2tcp server
+ * @param[in] ns tunnel socket
+ * @param[in] len flushed payload size
+ */
+void channel_wndup_consumed(netsock_t *ns, unsigned int len)
+{
+	unsigned char *msg;
+	unsigned int hlen;
+
+	assert(valid_netsock(ns));
+
+	if (!len || (ns->tid == R2T_TID_NONE) || !channel_wndup_active())
+		return;
+
+	// coalesce acknowledgments until they are worth a message
+	ns->wnd_ack += len;
+	if (ns->wnd_ack < RDP2TCP_WINDOW_ACKMIN)
+		return;
+
+	trace_chan("tid=0x%02x, acked=%u", ns->tid, ns->wnd_ack);
+
+	hlen = r2t_hdr_len();
+	msg = write_reserve(&vc.obuf, hlen + 4, NULL);
+	if (msg) {
+		r2t_hdr_write(msg, R2TCMD_WNDUP, ns->tid);
+		*(unsigned int *)(msg + hlen) = htonl(ns->wnd_ack);
+		write_commit(&vc.obuf, hlen + 4);
+		ns->wnd_ack = 0;
+	}
+}
+
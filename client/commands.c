@@ -35,14 +35,14 @@ static int badproto(netsock_t *cli)
 	return error("bad server protocol");
 }
 
-static netsock_t *check_tunnel_id(const r2tmsg_t *msg)
+static netsock_t *check_tunnel_id(unsigned int tid)
 {
 	netsock_t *ns;
 
-	ns = tunnel_lookup(msg->id);
+	ns = tunnel_lookup(tid);
 	if (!ns) {
-		warn("unknown tunnel 0x%02x", msg->id);
-		channel_close_tunnel(msg->id);
+		warn("unknown tunnel 0x%02x", tid);
+		channel_close_tunnel(tid);
 	}
 
 	return ns;
@@ -50,45 +50,47 @@ static netsock_t *check_tunnel_id(const r2tmsg_t *msg)
 
 static int check_binding_answer(
 					int mode,
-					const r2tmsg_connans_t *msg,
+					unsigned int tid,
+					unsigned int err,
+					const r2tmsg_connans_t *body,
 					unsigned int len)
 {
 	netsock_t *cli;
 	int af;
 	unsigned short port;
 
-	assert(msg && (len >= 3));
-	trace_chan("len=%u, tid=%u, err=%u", len, msg->id, msg->err);
+	assert(body || !len);
+	trace_chan("len=%u, tid=%u, err=%u", len, tid, err);
 
-	cli = check_tunnel_id((const r2tmsg_t*)msg);
+	cli = check_tunnel_id(tid);
 	if (!cli)
 		return 0;
 
-	if ((mode == 2) || (msg->err == 0)) {
-		if (len < 8)
+	if ((mode == 2) || (err == 0)) {
+		if (len < 5)
 			return badproto(cli);
 
-		port = ntohs(msg->port);
+		port = ntohs(body->port);
 
-		switch (msg->af) {
+		switch (body->af) {
 
 			case TUNAF_ANY:
 				if (mode)
 					return badproto(cli);
 				// process tunnel
-				if (len != 10)
+				if (len != 7)
 					return badproto(cli);
 				af = AF_UNSPEC;
 				break;
 
 			case TUNAF_IPV4:
-				if (len != 10)
+				if (len != 7)
 					return badproto(cli);
 				af = AF_INET;
 				break;
 
 			case TUNAF_IPV6:
-				if (len != 22)
+				if (len != 19)
 					return badproto(cli);
 				af = AF_INET6;
 				break;
@@ -98,19 +100,21 @@ static int check_binding_answer(
 
 		if (mode != 2) {
 			if (cli->type == NETSOCK_TUNCLI)
-				tunnel_connect_event(cli, af, &msg->addr[0], port);
+				tunnel_connect_event(cli, af, &body->addr[0], port);
 			else if (cli->type == NETSOCK_S5CLI)
-				socks5_connect_event(cli, af, &msg->addr[0], port);
+				socks5_connect_event(cli, af, &body->addr[0], port);
+			else if (cli->type == NETSOCK_UDPRELAY)
+				socks5_associate_event(cli);
 			else
-				tunnel_bind_event(cli, af, &msg->addr[0], port);
+				tunnel_bind_event(cli, af, &body->addr[0], port);
 
 		} else {
 
-			if (!tunnel_lookup(msg->err)) {
-				tunnel_revconnect_event(cli, msg->err, af, &msg->addr[0], port);
+			if (!tunnel_lookup(err)) {
+				tunnel_revconnect_event(cli, err, af, &body->addr[0], port);
 			} else {
 				// server allocated an already used tunnel ID
-				channel_close_tunnel(msg->err);
+				channel_close_tunnel(err);
 			}
 		}
 
@@ -118,63 +122,185 @@ static int check_binding_answer(
 		error("failed to %s tunnel 0x%02x (%s)",
 			(mode ? "bind" : "connect"),
 			cli->tid,
-			(msg->err >= R2TERR_MAX ? "???" : r2t_errors[msg->err]));
+			(err >= R2TERR_MAX ? "???" : r2t_errors[err]));
 		tunnel_close(cli, 0);
 	}
 
 	return 0;
 }
 
-static int cmd_conn(const r2tmsg_t *msg, unsigned int len)
+static int cmd_conn(unsigned int tid, const void *body, unsigned int len)
 {
-	return check_binding_answer(0, (const r2tmsg_connans_t *)msg, len);
+	const unsigned char *data = body;
+
+	return check_binding_answer(0, tid, data[0],
+					(const r2tmsg_connans_t *)(data+1), len-1);
 }
 
-static int cmd_bind(const r2tmsg_t *msg, unsigned int len)
+static int cmd_bind(unsigned int tid, const void *body, unsigned int len)
 {
-	return check_binding_answer(1, (const r2tmsg_connans_t *)msg, len);
+	const unsigned char *data = body;
+
+	return check_binding_answer(1, tid, data[0],
+					(const r2tmsg_connans_t *)(data+1), len-1);
 }
 
-static int cmd_close(const r2tmsg_t *msg, unsigned int len)
+static int cmd_close(unsigned int tid, const void *body, unsigned int len)
 {
 	netsock_t *tun;
 
-	assert(msg && (len >= 2));
 	trace_chan("len=%u", len);
 
-	tun = check_tunnel_id(msg);
+	tun = check_tunnel_id(tid);
 	if (tun)
 		netsock_cancel(tun);
 
 	return 0;
 }
 
-static int cmd_data(const r2tmsg_t *msg, unsigned int len)
+static int cmd_data(unsigned int tid, const void *body, unsigned int len)
 {
 	netsock_t *clitun;
 
-	assert(msg && (len >= 3));
+	assert(body || !len);
 	trace_chan("len=%u", len);
 
-	clitun = check_tunnel_id(msg);
+	clitun = check_tunnel_id(tid);
 	if (!clitun)
 		return 0;
 
-	return tunnel_write(clitun, ((const char *)msg)+2, len-2);
+	// a blocked client socket is not a parse error: the payload is
+	// queued on the tunnel obuf (and spills to disk past its ceiling);
+	// aborting the parse would leave the batch unconsumed and replay it
+	if (tunnel_write(clitun, body, len) < 0)
+		tunnel_close(clitun, 1);
+
+	return 0;
 }
 
-static int cmd_ping(const r2tmsg_t *msg, unsigned int len)
+static int cmd_ping(unsigned int tid, const void *body, unsigned int len)
 {
-	assert(msg && (len >= 2));
 	//trace_chan("len=%u", len);
 
+	if (len >= 4) {
+		if (tid == 1) // echo of a local probe
+			channel_rtt_event(ntohl(*(const unsigned int *)body));
+		else // server probe, echo its timestamp back
+			channel_write_msg(R2TCMD_PING, 1, body, 4);
+	}
+
 	channel_pong();
 	return 0;
 }
 
-static int cmd_rconn(const r2tmsg_t *msg, unsigned int len)
+static int cmd_rconn(unsigned int tid, const void *body, unsigned int len)
+{
+	const unsigned char *data = body;
+	unsigned int rid, off;
+
+	// the remote tunnel ID follows the negotiated framing
+	off = (r2t_tid16_in ? 2 : 1);
+	if (len < off)
+		return error("bad server protocol");
+	rid = data[0];
+	if (off == 2)
+		rid = (rid << 8) | data[1];
+
+	return check_binding_answer(2, tid, rid,
+					(const r2tmsg_connans_t *)(data+off), len-off);
+}
+
+static int cmd_hello(unsigned int tid, const void *body, unsigned int len)
+{
+	assert(body && (len >= 1));
+	trace_chan("len=%u", len);
+
+	channel_hello_event(((const r2tmsg_hello_t *)body)->caps);
+	return 0;
+}
+
+static int cmd_zdata(unsigned int tid, const void *body, unsigned int len)
 {
-	return check_binding_answer(2, (const r2tmsg_connans_t *)msg, len);
+	netsock_t *clitun;
+	unsigned int raw_len;
+
+	assert(body && (len >= 5));
+	trace_chan("len=%u", len);
+
+	clitun = check_tunnel_id(tid);
+	if (!clitun)
+		return 0;
+
+	raw_len = ntohl(((const r2tmsg_zdata_t *)body)->raw_len);
+	if (!raw_len || (raw_len > RDP2TCP_MAX_MSGLEN)) {
+		tunnel_close(clitun, 0);
+		return error("bad server protocol");
+	}
+
+	return channel_zdata_recv(clitun, ((const char *)body)+4, len-4, raw_len);
+}
+
+static int cmd_wndup(unsigned int tid, const void *body, unsigned int len)
+{
+	netsock_t *clitun;
+	unsigned int acked;
+
+	assert(body && (len >= 4));
+	trace_chan("len=%u", len);
+
+	// window updates may cross a R2TCMD_CLOSE in flight, ignore them
+	clitun = tunnel_lookup(tid);
+	if (!clitun)
+		return 0;
+
+	acked = ntohl(((const r2tmsg_wndup_t *)body)->len);
+	if (acked < clitun->wnd_used)
+		clitun->wnd_used -= acked;
+	else
+		clitun->wnd_used = 0;
+
+	return 0;
+}
+
+static int cmd_udata(unsigned int tid, const void *body, unsigned int len)
+{
+	netsock_t *relay;
+
+	assert(body && (len >= 9));
+	trace_chan("len=%u", len);
+
+	// datagrams may cross a R2TCMD_CLOSE in flight, ignore them
+	relay = tunnel_lookup(tid);
+	if (!relay || (relay->type != NETSOCK_UDPRELAY))
+		return 0;
+
+	return socks5_udp_deliver(relay, body, len);
+}
+
+static int cmd_latstat(unsigned int tid, const void *body, unsigned int len)
+{
+	assert(body && len);
+	trace_chan("len=%u", len);
+
+	channel_latstat_event(body, len);
+	return 0;
+}
+
+static int cmd_resume(unsigned int tid, const void *body, unsigned int len)
+{
+	const r2tmsg_resumeans_t *msg = body;
+	unsigned long long seq;
+
+	assert(msg && (len >= 8));
+	trace_chan("len=%u, tid=0x%02x, err=%u", len, tid, msg->err);
+
+	if (len < sizeof(*msg))
+		return error("truncated resume answer");
+
+	seq = ((unsigned long long) ntohl(msg->seq_hi) << 32)
+			| ntohl(msg->seq_lo);
+	tunnel_resume_event(tid, msg->err, seq);
+	return 0;
 }
 
 /**
@@ -186,6 +312,12 @@ const cmdhandler_t cmd_handlers[R2TCMD_MAX] = {
 	cmd_data,  // R2TCMD_DATA
 	cmd_ping,  // R2TCMD_PING
 	cmd_bind,  // R2TCMD_BIND
-	cmd_rconn  // R2TCMD_RCONN
+	cmd_rconn, // R2TCMD_RCONN
+	cmd_hello, // R2TCMD_HELLO
+	cmd_zdata, // R2TCMD_ZDATA
+	cmd_wndup,  // R2TCMD_WNDUP
+	cmd_udata,  // R2TCMD_UDATA
+	cmd_latstat, // R2TCMD_LATSTAT
+	cmd_resume // R2TCMD_RESUME
 };
 
@@ -100,7 +100,7 @@ void controller_accept_event(netsock_t *ns)
 	cli = netsock_accept(ns);
 	if (cli) {
 		cli->type = NETSOCK_CTRLCLI;
-		cli->tid  = 0xff;
+		cli->tid  = R2T_TID_NONE;
 		iobuf_init2(&cli->u.ctrlcli.ibuf, &cli->u.ctrlcli.obuf, "ctrl");
 		info(1, "accepted controller %s", netaddr_print(&cli->addr, buf));
 	}
@@ -200,6 +200,190 @@ static int dump_sockets(netsock_t *cli)
 	return ret;
 }
 
+/**
+ * dump per-tunnel I/O counters in machine-readable form
+ * @param[in] cli controller client socket
+ * @return -1 on error
+ */
+static int dump_stats(netsock_t *cli)
+{
+	int ret;
+	netsock_t *ns;
+	const char *type;
+	unsigned int rtt, jitter;
+	char host[NETADDRSTR_MAXSIZE];
+	char lat_cli[192], lat_srv[192];
+
+	assert(valid_netsock(cli));
+
+	rtt = channel_rtt(&jitter);
+	ret = controller_answer(cli, "stat chan rtt=%u jit=%u wnd=%u",
+				rtt, jitter, channel_window);
+
+	// queue-delay histograms, buckets print as <bound-usecs>=<count>
+	if (!ret && channel_latstat(lat_cli, lat_srv, sizeof(lat_cli))) {
+		ret = controller_answer(cli, "stat lat cli%s", lat_cli);
+		if (!ret)
+			ret = controller_answer(cli, "stat lat srv%s", lat_srv);
+	}
+
+	list_for_each(ns, &all_sockets) {
+
+		if (ret)
+			break;
+
+		switch (ns->type) {
+			case NETSOCK_TUNCLI:  type = "tuncli";  break;
+			case NETSOCK_S5CLI:   type = "s5cli";   break;
+			case NETSOCK_RTUNCLI: type = "rtuncli"; break;
+			default:
+				continue;
+		}
+
+		ret = controller_answer(cli,
+				"stat %s 0x%02x %s in=%llu out=%llu mi=%llu mo=%llu "
+				"q=%u hi=%u wnd=%u cms=%u",
+				type, ns->tid, netaddr_print(&ns->addr, host),
+				ns->stats.bytes_in, ns->stats.bytes_out,
+				ns->stats.msgs_in, ns->stats.msgs_out,
+				iobuf_datalen(&ns->u.tuncli.obuf), ns->stats.obuf_hiwat,
+				ns->wnd_used, ns->stats.connect_ms);
+		if (ret)
+			break;
+	}
+
+	if (ret >= 0)
+		ret = controller_answer(cli, "\n");
+
+	return ret;
+}
+
+/** marker starting a binary controller batch */
+#define CTRL_BATCH_MAGIC 0x02
+/** binary batch record header size (op, lport, rport, 2 name sizes) */
+#define CTRL_REC_HDRLEN  7
+
+/**
+ * handle one binary controller batch
+ *
+ * orchestration tools registering many tunnels at session start use a
+ * batched binary form instead of one text line per round trip:
+ *   request: 0x02, record count (2 bytes), records back to back
+ *   record:  op, lport (2), rport (2), lhost size, rhost size,
+ *            lhost, rhost (all numbers big-endian, names not
+ *            NUL-terminated)
+ *   answer:  0x02, record count (2 bytes), 1 status byte per record
+ *            (0 on success)
+ * ops match the text commands: 't', 'r', 'x' (rhost is the command
+ * line, rport ignored), 's' (no rhost) and '-' (no rhost); batches
+ * can be pipelined back to back in a single submission
+ *
+ * @param[in] cli controller client socket
+ * @param[in] data batch data starting at the magic byte
+ * @param[in] avail buffered size
+ * @param[out] out_parsed will hold the consumed size
+ * @return 1 if the batch is incomplete, -1 on protocol error
+ */
+static int controller_batch(
+				netsock_t *cli,
+				unsigned char *data,
+				unsigned int avail,
+				unsigned int *out_parsed)
+{
+	netsock_t *ns;
+	unsigned int count, i, off, rec;
+	unsigned short lport, rport;
+	unsigned char op, hdr[3], status;
+	int ret;
+	char lhost[256], rhost[256];
+
+	assert(valid_netsock(cli) && data && avail && out_parsed);
+
+	*out_parsed = 0;
+	if (avail < 3)
+		return 1;
+
+	count = ((unsigned int)data[1] << 8) | data[2];
+	if (!count)
+		return error("empty controller batch");
+
+	// wait until the whole batch is buffered so the answer aggregates
+	off = 3;
+	for (i=0; i<count; ++i) {
+		if (off + CTRL_REC_HDRLEN > avail)
+			return 1;
+		if (!data[off+5] || !memchr("trxs-", data[off], 5))
+			return error("invalid controller batch record");
+		off += CTRL_REC_HDRLEN + data[off+5] + data[off+6];
+		if (off > avail)
+			return 1;
+	}
+
+	trace_ctrl("count=%u, len=%u", count, off);
+
+	hdr[0] = CTRL_BATCH_MAGIC;
+	hdr[1] = (unsigned char)(count >> 8);
+	hdr[2] = (unsigned char) count;
+	ret = netsock_write(cli, hdr, 3);
+	if (ret < 0)
+		return ret;
+
+	for (i=0, rec=3; i<count; ++i) {
+
+		op    = data[rec];
+		lport = ((unsigned short)data[rec+1] << 8) | data[rec+2];
+		rport = ((unsigned short)data[rec+3] << 8) | data[rec+4];
+		memcpy(lhost, &data[rec+CTRL_REC_HDRLEN], data[rec+5]);
+		lhost[data[rec+5]] = 0;
+		memcpy(rhost, &data[rec+CTRL_REC_HDRLEN+data[rec+5]], data[rec+6]);
+		rhost[data[rec+6]] = 0;
+		rec += CTRL_REC_HDRLEN + data[rec+5] + data[rec+6];
+
+		status = 1;
+		if (!lport || ((op == 't' || op == 'r' || op == 'x') && !*rhost)) {
+			// malformed record, only fail its status byte
+
+		} else if (op == 't') {
+			if (rport && tunnel_create(NULL, lhost, lport, AF_UNSPEC,
+											rhost, rport, NETPROF_INTERACTIVE))
+				status = 0;
+
+		} else if (op == 'r') {
+			if (rport && tunnel_create_reverse(NULL, lhost, lport, AF_UNSPEC,
+											rhost, rport, NETPROF_INTERACTIVE))
+				status = 0;
+
+		} else if (op == 'x') {
+			if (tunnel_create(NULL, lhost, lport, AF_UNSPEC, rhost, 0,
+											NETPROF_INTERACTIVE))
+				status = 0;
+
+		} else if (op == 's') {
+			ns = netsock_bind(NULL, lhost, lport, 0);
+			if (ns) {
+				ns->type = NETSOCK_S5SRV;
+				info(0, "SOCKS5 server listening on %s:%hu", lhost, lport);
+				status = 0;
+			}
+
+		} else { // op == '-'
+			ns = tunnel_find(lhost, lport);
+			if (ns) {
+				tunnel_close(ns, 1);
+				info(0, "tunnel [%s]:%hu removed", lhost, lport);
+				status = 0;
+			}
+		}
+
+		ret = netsock_write(cli, &status, 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	*out_parsed = off;
+	return 0;
+}
+
 static char *extract_port(char *data, unsigned short *out_port)
 {
 	char *ptr, *end;
@@ -230,10 +414,10 @@ static char *extract_port(char *data, unsigned short *out_port)
 int controller_read_event(netsock_t *cli)
 {
 	char cmd, *data, *end, *lhost, *rhost;
-	int ret;
-	unsigned int avail, parsed;
+	int ret, profile;
+	unsigned int avail, parsed, batched;
 	unsigned short lport, rport;
-	const char valid_commands[] = "ltrxs-";
+	const char valid_commands[] = "litrxs-";
 	char host[NETADDRSTR_MAXSIZE];
 
 	assert(valid_netsock(cli) && (cli->type == NETSOCK_CTRLCLI));
@@ -248,9 +432,17 @@ int controller_read_event(netsock_t *cli)
 	assert(avail);
 	parsed = 0;
 
-	// for each line
+	// for each line or binary batch
 	do {
 
+		if (*data == CTRL_BATCH_MAGIC) {
+			ret = controller_batch(cli, (unsigned char *) data,
+											avail-parsed, &batched);
+			parsed += batched;
+			data   += batched;
+			continue;
+		}
+
 		end = memchr(data, '\n', avail-parsed);
 		if (!end) {
 			ret = 1;
@@ -273,6 +465,9 @@ int controller_read_event(netsock_t *cli)
 		if (cmd == 'l') { // list sockets
 			ret = dump_sockets(cli);
 
+		} else if (cmd == 'i') { // dump tunnel statistics
+			ret = dump_stats(cli);
+
 		} else {
 			// commands with argc >= 2
 
@@ -296,22 +491,36 @@ int controller_read_event(netsock_t *cli)
 				if (!*data) goto badproto;
 
 				if (cmd == 'x') { // exec & forward stdin/stdout
-					ret = tunnel_add(cli, lhost, lport, AF_UNSPEC, data, 0);
+					ret = tunnel_add(cli, lhost, lport, AF_UNSPEC, data, 0,
+											NETPROF_INTERACTIVE);
 
 				} else {
-					// commands with argc == 4
+					// commands with argc == 4 or 5
 
 					rhost = data;
-					if (!extract_port(data, &rport))
+					data = extract_port(data, &rport);
+					if (!data)
 						return -1;
 
+					// optional socket tuning profile, nagle-free default
+					profile = NETPROF_INTERACTIVE;
+					if (*data == ' ') {
+						profile = net_profile(data+1);
+						if (profile < 0) {
+							ret = controller_answer(cli,
+										"error: unknown profile %s", data+1);
+							data = end + 1;
+							continue;
+						}
+					}
+
 					if (cmd == 't') { // add TCP tunnel
 						ret = tunnel_add(cli, lhost, lport,
-												AF_UNSPEC, rhost, rport);
+												AF_UNSPEC, rhost, rport, profile);
 
 					} else { // cmd == 'r' reverse TCP connect
 						ret = tunnel_add_reverse(cli, lhost, lport,
-														AF_UNSPEC, rhost, rport);
+												AF_UNSPEC, rhost, rport, profile);
 					}
 				}
 			}
@@ -0,0 +1,528 @@
+/**
+ * @file events.c
+ * client event engine (epoll backend with select fallback)
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#define HAVE_EPOLL
+#endif
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#else
+#include <sys/select.h>
+#include <sys/time.h>
+#endif
+
+extern struct list_head all_sockets;
+
+/** markers used to distinguish virtual channel fds from netsock pointers */
+static char chan_in_tag, chan_out_tag, resolver_tag;
+
+/** markers for extra channel stripes, indexed by stripe */
+static char stripe_in_tags[RDP2TCP_MAX_STRIPES];
+static char stripe_out_tags[RDP2TCP_MAX_STRIPES];
+
+/** extra channel stripe descriptors (-1 when the stripe is unused) */
+static int stripe_in_fds[RDP2TCP_MAX_STRIPES]  = { -1, -1, -1, -1 };
+static int stripe_out_fds[RDP2TCP_MAX_STRIPES] = { -1, -1, -1, -1 };
+static int stripe_out_watched[RDP2TCP_MAX_STRIPES];
+
+/** resolver self-pipe read end or -1 */
+static int resolver_fd = -1;
+
+#ifdef HAVE_EPOLL
+
+#define EVENTS_MAX_BATCH 64
+
+static int epfd = -1;
+static int chan_out_watched = 0;
+
+/** events returned by the last epoll_wait, kept so that event_unwatch
+ * can invalidate entries of sockets closed while dispatching */
+static struct epoll_event batch[EVENTS_MAX_BATCH];
+static int batch_count = 0;
+static int batch_index = 0;
+
+/**
+ * initialize the event engine and register the virtual channel input fd
+ * @return 0 on success
+ */
+int events_init(void)
+{
+	struct epoll_event ev;
+
+	trace_evt("");
+
+	epfd = epoll_create(0x100);
+	if (epfd == -1)
+		return error("failed to create epoll instance (%s)", strerror(errno));
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = &chan_in_tag;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, RDP_FD_IN, &ev)) {
+		close(epfd);
+		epfd = -1;
+		return error("failed to watch channel input (%s)", strerror(errno));
+	}
+
+	return 0;
+}
+
+/**
+ * destroy the event engine
+ */
+void events_kill(void)
+{
+	trace_evt("");
+
+	if (epfd != -1) {
+		close(epfd);
+		epfd = -1;
+	}
+}
+
+/**
+ * synchronize socket registration with netsock_want_read/netsock_want_write
+ * @param[in] ns netsock socket
+ * @note only issues an epoll_ctl syscall when the interest set changed
+ */
+void event_watch(netsock_t *ns)
+{
+	int mask;
+	struct epoll_event ev;
+
+	if (ns->state == NETSTATE_RESOLVING)
+		return; // no descriptor to watch yet
+
+	assert(valid_netsock(ns) && (ns->fd != -1));
+
+	mask = 0;
+	if (ns->state != NETSTATE_CANCELLED) {
+		if (netsock_want_read(ns))
+			mask |= EVENT_READ;
+		if (netsock_want_write(ns))
+			mask |= EVENT_WRITE;
+	}
+
+	if (mask == ns->ev_mask)
+		return;
+
+	trace_evt("fd=%i, mask=%i->%i", ns->fd, ns->ev_mask, mask);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((mask & EVENT_READ) ? EPOLLIN : 0)
+					| ((mask & EVENT_WRITE) ? EPOLLOUT : 0);
+	ev.data.ptr = ns;
+
+	if (!mask)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, ns->fd, &ev);
+	else if (!ns->ev_mask)
+		epoll_ctl(epfd, EPOLL_CTL_ADD, ns->fd, &ev);
+	else
+		epoll_ctl(epfd, EPOLL_CTL_MOD, ns->fd, &ev);
+
+	ns->ev_mask = mask;
+}
+
+/**
+ * unregister a socket before it is closed
+ * @param[in] ns netsock socket
+ */
+void event_unwatch(netsock_t *ns)
+{
+	int i;
+	struct epoll_event ev;
+
+	assert(ns);
+
+	if ((ns->fd != -1) && ns->ev_mask) {
+		memset(&ev, 0, sizeof(ev));
+		epoll_ctl(epfd, EPOLL_CTL_DEL, ns->fd, &ev);
+		ns->ev_mask = 0;
+	}
+
+	// invalidate pending events referencing the socket
+	for (i=batch_index; i<batch_count; ++i) {
+		if (batch[i].data.ptr == ns)
+			batch[i].data.ptr = NULL;
+	}
+}
+
+/**
+ * watch or unwatch the virtual channel output fd
+ * @param[in] want_write 0 if the channel output buffer is empty
+ */
+void event_watch_channel(int want_write)
+{
+	struct epoll_event ev;
+
+	want_write = !!want_write;
+	if (want_write == chan_out_watched)
+		return;
+
+	trace_evt("want_write=%i", want_write);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLOUT;
+	ev.data.ptr = &chan_out_tag;
+	epoll_ctl(epfd, (want_write ? EPOLL_CTL_ADD : EPOLL_CTL_DEL),
+				RDP_FD_OUT, &ev);
+
+	chan_out_watched = want_write;
+}
+
+/**
+ * watch the input descriptor of an extra channel stripe
+ * @param[in] idx stripe index
+ * @param[in] fd stripe input descriptor
+ * @return 0 on success
+ */
+int event_watch_stripe(unsigned int idx, int fd)
+{
+	struct epoll_event ev;
+
+	assert((idx > 0) && (idx < RDP2TCP_MAX_STRIPES));
+	trace_evt("idx=%u, fd=%i", idx, fd);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = &stripe_in_tags[idx];
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+		return error("failed to watch channel stripe (%s)", strerror(errno));
+
+	stripe_in_fds[idx] = fd;
+	return 0;
+}
+
+/**
+ * watch or unwatch the output descriptor of an extra channel stripe
+ * @param[in] idx stripe index
+ * @param[in] fd stripe output descriptor
+ * @param[in] want_write 0 if the stripe output buffer is empty
+ */
+void event_watch_stripe_out(unsigned int idx, int fd, int want_write)
+{
+	struct epoll_event ev;
+
+	assert((idx > 0) && (idx < RDP2TCP_MAX_STRIPES));
+
+	want_write = !!want_write;
+	if (want_write == stripe_out_watched[idx])
+		return;
+
+	trace_evt("idx=%u, want_write=%i", idx, want_write);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLOUT;
+	ev.data.ptr = &stripe_out_tags[idx];
+	epoll_ctl(epfd, (want_write ? EPOLL_CTL_ADD : EPOLL_CTL_DEL), fd, &ev);
+
+	stripe_out_fds[idx]     = fd;
+	stripe_out_watched[idx] = want_write;
+}
+
+/**
+ * watch the resolver self-pipe
+ * @param[in] fd self-pipe read end
+ * @return 0 on success
+ */
+int event_watch_resolver(int fd)
+{
+	struct epoll_event ev;
+
+	trace_evt("fd=%i", fd);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = &resolver_tag;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+		return error("failed to watch resolver pipe (%s)", strerror(errno));
+
+	resolver_fd = fd;
+	return 0;
+}
+
+/**
+ * wait for I/O events and dispatch them
+ * @param[in] timeout_msec wait timeout or -1 to block
+ * @return -1 on fatal error, 0 on timeout, 1 if events were dispatched
+ */
+int events_wait(int timeout_msec)
+{
+	int ret, revents;
+	unsigned int events;
+	void *ptr;
+	netsock_t *ns;
+
+	ret = epoll_wait(epfd, batch, EVENTS_MAX_BATCH, timeout_msec);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		return error("epoll error (%s)", strerror(errno));
+	}
+
+	if (!ret)
+		return 0;
+
+	batch_count = ret;
+
+	// coalesce messages queued by all handlers of this batch
+	channel_cork();
+
+	for (batch_index=0; batch_index<batch_count; ++batch_index) {
+
+		ptr    = batch[batch_index].data.ptr;
+		events = batch[batch_index].events;
+
+		if (!ptr) // socket closed while dispatching
+			continue;
+
+		if (ptr == &resolver_tag) {
+			resolver_dispatch();
+			continue;
+		}
+
+		if (ptr == &chan_out_tag) {
+			channel_write_event();
+			continue;
+		}
+
+		if (ptr == &chan_in_tag) {
+			if (channel_read_event() < 0) {
+				batch_count = 0;
+				channel_uncork();
+				return -1;
+			}
+			continue;
+		}
+
+		if ((ptr >= (void *)&stripe_in_tags[0])
+				&& (ptr < (void *)&stripe_in_tags[RDP2TCP_MAX_STRIPES])) {
+			if (channel_stripe_read_event(
+						(char *)ptr - stripe_in_tags) < 0) {
+				batch_count = 0;
+				channel_uncork();
+				return -1;
+			}
+			continue;
+		}
+
+		if ((ptr >= (void *)&stripe_out_tags[0])
+				&& (ptr < (void *)&stripe_out_tags[RDP2TCP_MAX_STRIPES])) {
+			channel_stripe_write_event((char *)ptr - stripe_out_tags);
+			continue;
+		}
+
+		ns = ptr;
+		assert(valid_netsock(ns));
+
+		revents = 0;
+		if (events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+			revents |= EVENT_READ;
+		if (events & EPOLLOUT)
+			revents |= EVENT_WRITE;
+
+		netsock_dispatch(ns, revents);
+	}
+
+	batch_count = 0;
+	channel_uncork();
+	return 1;
+}
+
+#else /* !HAVE_EPOLL */
+
+static int chan_out_watched = 0;
+
+int events_init(void)
+{
+	trace_evt("");
+	return 0;
+}
+
+void events_kill(void)
+{
+	trace_evt("");
+}
+
+void event_watch(netsock_t *ns)
+{
+	assert(valid_netsock(ns));
+	// interest sets are rebuilt on each events_wait call
+	ns->ev_mask = 0;
+}
+
+void event_unwatch(netsock_t *ns)
+{
+	assert(ns);
+	ns->ev_mask = 0;
+}
+
+void event_watch_channel(int want_write)
+{
+	chan_out_watched = !!want_write;
+}
+
+int event_watch_stripe(unsigned int idx, int fd)
+{
+	assert((idx > 0) && (idx < RDP2TCP_MAX_STRIPES));
+	stripe_in_fds[idx] = fd;
+	return 0;
+}
+
+void event_watch_stripe_out(unsigned int idx, int fd, int want_write)
+{
+	assert((idx > 0) && (idx < RDP2TCP_MAX_STRIPES));
+	stripe_out_fds[idx]     = fd;
+	stripe_out_watched[idx] = !!want_write;
+}
+
+int event_watch_resolver(int fd)
+{
+	resolver_fd = fd;
+	return 0;
+}
+
+int events_wait(int timeout_msec)
+{
+	int ret, fd, max_fd, revents;
+	unsigned int i;
+	netsock_t *ns, *bak;
+	fd_set rfd, wfd;
+	struct timeval tv, *ptv;
+
+	FD_ZERO(&rfd);
+	FD_ZERO(&wfd);
+	FD_SET(RDP_FD_IN, &rfd);
+	max_fd = RDP_FD_IN;
+
+	if (chan_out_watched) {
+		FD_SET(RDP_FD_OUT, &wfd);
+		max_fd = RDP_FD_OUT;
+	}
+
+	for (i=1; i<RDP2TCP_MAX_STRIPES; ++i) {
+		if (stripe_in_fds[i] != -1) {
+			FD_SET(stripe_in_fds[i], &rfd);
+			if (stripe_in_fds[i] > max_fd) max_fd = stripe_in_fds[i];
+		}
+		if (stripe_out_watched[i] && (stripe_out_fds[i] != -1)) {
+			FD_SET(stripe_out_fds[i], &wfd);
+			if (stripe_out_fds[i] > max_fd) max_fd = stripe_out_fds[i];
+		}
+	}
+
+	if (resolver_fd != -1) {
+		FD_SET(resolver_fd, &rfd);
+		if (resolver_fd > max_fd) max_fd = resolver_fd;
+	}
+
+	list_for_each(ns, &all_sockets) {
+
+		assert(valid_netsock(ns));
+
+		if ((ns->state == NETSTATE_CANCELLED) || (ns->fd == -1))
+			continue;
+
+		if (netsock_want_read(ns)) {
+			FD_SET(ns->fd, &rfd);
+			if (ns->fd > max_fd) max_fd = ns->fd;
+		}
+
+		if (netsock_want_write(ns)) {
+			FD_SET(ns->fd, &wfd);
+			if (ns->fd > max_fd) max_fd = ns->fd;
+		}
+	}
+
+	ptv = NULL;
+	if (timeout_msec >= 0) {
+		tv.tv_sec  = timeout_msec / 1000;
+		tv.tv_usec = (timeout_msec % 1000) * 1000;
+		ptv = &tv;
+	}
+
+	ret = select(max_fd+1, &rfd, &wfd, NULL, ptv);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		return error("select error (%s)", strerror(errno));
+	}
+
+	if (!ret)
+		return 0;
+
+	// coalesce messages queued by all handlers of this batch
+	channel_cork();
+
+	if ((resolver_fd != -1) && FD_ISSET(resolver_fd, &rfd))
+		resolver_dispatch();
+
+	if (FD_ISSET(RDP_FD_OUT, &wfd))
+		channel_write_event();
+
+	if (FD_ISSET(RDP_FD_IN, &rfd)) {
+		if (channel_read_event() < 0) {
+			channel_uncork();
+			return -1;
+		}
+	}
+
+	for (i=1; i<RDP2TCP_MAX_STRIPES; ++i) {
+		if (stripe_out_watched[i] && (stripe_out_fds[i] != -1)
+				&& FD_ISSET(stripe_out_fds[i], &wfd))
+			channel_stripe_write_event(i);
+		if ((stripe_in_fds[i] != -1) && FD_ISSET(stripe_in_fds[i], &rfd)) {
+			if (channel_stripe_read_event(i) < 0) {
+				channel_uncork();
+				return -1;
+			}
+		}
+	}
+
+	list_for_each_safe(ns, bak, &all_sockets) {
+
+		if ((ns->state == NETSTATE_CANCELLED) || (ns->fd == -1))
+			continue;
+
+		fd = ns->fd;
+		revents = 0;
+		if (FD_ISSET(fd, &rfd))
+			revents |= EVENT_READ;
+		if (FD_ISSET(fd, &wfd))
+			revents |= EVENT_WRITE;
+
+		if (revents)
+			netsock_dispatch(ns, revents);
+	}
+
+	channel_uncork();
+	return 1;
+}
+
+#endif /* HAVE_EPOLL */
@@ -35,8 +35,6 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
-#include <sys/select.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -56,6 +54,9 @@ void bye(void)
 		netsock_close(ns);
 
 	channel_kill();
+	resolver_kill();
+	events_kill();
+	print_flush();
 	exit(0);
 }
 
@@ -91,18 +92,75 @@ static void setup(int argc, char **argv)
 		host = "127.0.0.1";
 	}
 
+	if (events_init())
+		exit(0);
+
+	timers_init();
+	netsocks_init();
+	resolver_init();
+
 	if (controller_start(host, port))
 		exit(0);
 
 	channel_init();
 }
 
+/**
+ * dispatch I/O events on a network socket
+ * @param[in] ns netsock socket
+ * @param[in] revents EVENT_READ/EVENT_WRITE event mask
+ */
+void netsock_dispatch(netsock_t *ns, int revents)
+{
+	int ret;
+
+	assert(valid_netsock(ns));
+
+	if (ns->state == NETSTATE_CANCELLED)
+		return;
+
+	if (ns->type == NETSOCK_RTUNSRV)
+		return;
+
+	if (netsock_is_server(ns)) {
+		// server socket
+		if (revents & EVENT_READ) {
+			if (ns->type == NETSOCK_TUNSRV)
+				tunnel_accept_event(ns);
+			else if (ns->type == NETSOCK_S5SRV)
+				socks5_accept_event(ns);
+			else
+				controller_accept_event(ns);
+		}
+
+	} else {
+		// client socket
+		ret = 0;
+
+		if (revents & EVENT_WRITE)
+			ret = tunnel_write_event(ns);
+
+		if ((ret >= 0) && (revents & EVENT_READ)) {
+
+			if (ns->type == NETSOCK_S5CLI)
+				ret = socks5_read_event(ns);
+			else if (ns->type == NETSOCK_UDPRELAY)
+				ret = socks5_udp_read_event(ns);
+			else if (ns->type == NETSOCK_CTRLCLI)
+				ret = controller_read_event(ns);
+			else
+				ret = channel_forward_recv(ns);
+		}
+
+		if (ret < 0)
+			netsock_close(ns);
+	}
+}
+
 int main(int argc, char **argv)
 {
-	int ret, fd, max_fd, last_state, state;
+	int last_state, state;
 	netsock_t *ns, *bak;
-	fd_set rfd, wfd, *pwfd;
-	struct timeval tv, *ptv;
 
 	setup(argc, argv);
 
@@ -114,78 +172,32 @@ int main(int argc, char **argv)
 
 	while (!killme) {
 
-		FD_ZERO(&rfd);
-		FD_SET(RDP_FD_IN, &rfd);
-		max_fd = RDP_FD_IN;
-
-		FD_ZERO(&wfd);
-		pwfd = NULL;
-		ptv = NULL;
 		state = channel_is_connected();
 		if (state != last_state) {
 
-			if (!state) // connected --> disconnected
-				tunnels_kill_clients();
-			else // disconnected --> connected
-				tunnels_restart();
-			
-			last_state = state;
-		}
-
-		if (state) {
-			// channel is connected
-			if (channel_want_write()) {
-				FD_SET(RDP_FD_OUT, &wfd);
-				max_fd = RDP_FD_OUT;
-				pwfd = &wfd;
+			if (!state) { // connected --> disconnected
+				if (tunnels_freeze())
+					tunnels_kill_clients();
+			} else { // disconnected --> connected
+				// frozen tunnels resync from the hello answer instead
+				if (!tunnels_frozen)
+					tunnels_restart();
 			}
-			tv.tv_sec  = 1;
-			tv.tv_usec = 0;
-			ptv = &tv;
-		}
-
-		list_for_each(ns, &all_sockets) {
-
-			assert(valid_netsock(ns));
-
-			if (ns->state != NETSTATE_CANCELLED) {
-				fd = ns->fd;
-
-				if (netsock_want_read(ns)) {
-					FD_SET(fd, &rfd);
-					if (fd > max_fd) max_fd = fd;
-				}
 
-				if (netsock_want_write(ns)) {
-					FD_SET(fd, &wfd);
-					pwfd = &wfd;
-					if (fd > max_fd) max_fd = fd;
-				}
-			}
+			last_state = state;
 		}
 
-		//debug(1, "channel connected: %i", channel_is_connected());
-
-		ret = select(max_fd+1, &rfd, pwfd, NULL, ptv);
-		if (ret == -1) {
-			error("select error (%s)", strerror(errno));
-			break;
-		}
-		
-		if (ret == 0) {
-			// channel ping timeout
-			//info(0, "channel timeout");
-			continue;
-		}
+		if (state)
+			channel_keepalive();
 
-		if (FD_ISSET(RDP_FD_OUT, &wfd))
-			channel_write_event();
+		// forward staged tunnel payload before arming write interest
+		channel_sched_run();
 
-		if (FD_ISSET(RDP_FD_IN, &rfd)) {
-			if (channel_read_event() < 0)
-				break;
-		}
+		event_watch_channel(state && channel_want_write());
+		channel_arm_stripes();
 
+		// close cancelled sockets and re-arm those whose
+		// interest set changed since the last iteration
 		list_for_each_safe(ns, bak, &all_sockets) {
 
 			assert(valid_netsock(ns));
@@ -196,42 +208,18 @@ int main(int argc, char **argv)
 				continue;
 			}
 
-			if (ns->type == NETSOCK_RTUNSRV)
-				continue;
-
-			fd = ns->fd;
-			if (netsock_is_server(ns)) {
-				// server socket
-				if (FD_ISSET(fd, &rfd)) {
-					if (ns->type == NETSOCK_TUNSRV)
-						tunnel_accept_event(ns);
-					else if (ns->type == NETSOCK_S5SRV)
-						socks5_accept_event(ns);
-					else
-						controller_accept_event(ns);
-				}
-
-			} else {
-				// client socket
-				ret = 0;
-
-				if (FD_ISSET(fd, &wfd))
-					ret = tunnel_write_event(ns);
-
-				if ((ret >= 0) && FD_ISSET(fd, &rfd)) {
-
-					if (ns->type == NETSOCK_S5CLI)
-						ret = socks5_read_event(ns);
-					else if (ns->type == NETSOCK_CTRLCLI)
-						ret = controller_read_event(ns);
-					else
-						ret = channel_forward_recv(ns);
-				}
-
-				if (ret < 0)
-					netsock_close(ns);
-			}
+			if (ns->type != NETSOCK_RTUNSRV)
+				event_watch(ns);
 		}
+
+		//debug(1, "channel connected: %i", channel_is_connected());
+
+		// sleep exactly until the earliest timer deadline
+		if (events_wait(timers_next_delay()) < 0)
+			break;
+
+		timers_dispatch();
+		print_flush();
 	}
 
 	bye();
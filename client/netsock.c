@@ -34,6 +34,96 @@
  */
 LIST_HEAD_INIT(all_sockets);
 
+/** maximal number of pooled netsock_t structures */
+#define NETSOCK_POOL_SIZE 64
+
+/** recycled fixed-size netsock_t structures */
+static LIST_HEAD_INIT(free_sockets);
+static unsigned int free_sockets_count;
+
+/** pending connection timeout (secs), 0 disables it */
+static unsigned int connect_timeout = 30;
+
+/** idle tunnel reaping timeout (secs), disabled by default */
+static unsigned int idle_timeout;
+
+/**
+ * parse the socket timeout environment overrides
+ */
+void netsocks_init(void)
+{
+	const char *env;
+
+	env = getenv("RDP2TCP_CONNECT_TIMEOUT");
+	if (env)
+		connect_timeout = (unsigned int) atoi(env);
+
+	env = getenv("RDP2TCP_IDLE_TIMEOUT");
+	if (env)
+		idle_timeout = (unsigned int) atoi(env);
+}
+
+/**
+ * handle the expiry of a socket timer
+ * @param[in] arg netsock socket
+ * @note kills connections stuck before NETSTATE_CONNECTED and reaps
+ *       established tunnels whose I/O counters stopped moving
+ */
+static void netsock_timeout_event(void *arg)
+{
+	netsock_t *ns = arg;
+
+	assert(valid_netsock(ns));
+
+	if (ns->state < NETSTATE_CONNECTED) {
+		error("tunnel 0x%02x connection timeout", ns->tid);
+		if (ns->tid != R2T_TID_NONE)
+			channel_close_tunnel(ns->tid);
+		netsock_close(ns);
+		return;
+	}
+
+	if (ns->stats.bytes_in + ns->stats.bytes_out != ns->idle_mark) {
+		// some traffic moved, re-arm for a full idle period
+		netsock_watch_idle(ns);
+		return;
+	}
+
+	info(0, "closing idle tunnel 0x%02x", ns->tid);
+	tunnel_close(ns, 1);
+}
+
+/**
+ * arm the connect timeout of a socket entering connection setup
+ * @param[in] ns netsock socket
+ */
+void netsock_watch_connect(netsock_t *ns)
+{
+	assert(valid_netsock(ns));
+
+	if (connect_timeout)
+		evtimer_arm(&ns->timer, connect_timeout * 1000,
+						netsock_timeout_event, ns);
+}
+
+/**
+ * arm the idle reaper of an established tunnel
+ * @param[in] ns netsock socket
+ * @note cancels the pending connect timeout when reaping is disabled
+ */
+void netsock_watch_idle(netsock_t *ns)
+{
+	assert(valid_netsock(ns));
+
+	if (idle_timeout) {
+		ns->idle_mark = ns->stats.bytes_in + ns->stats.bytes_out;
+		evtimer_arm(&ns->timer, idle_timeout * 1000,
+						netsock_timeout_event, ns);
+	} else {
+		evtimer_cancel(&ns->timer);
+	}
+}
+
 /**
  * check if main loop must wait for network-write event
  * @param[in] ns netsock socket
@@ -56,6 +146,9 @@ int netsock_want_write(netsock_t *ns)
 			return iobuf_datalen(&ns->u.sockscli.obuf) > 0;
 			//return (ns->u.sockscli.state < S5STATE_CONNECTED)
 			//		|| (iobuf_datalen(&ns->u.sockscli.obuf) > 0);
+
+		case NETSOCK_UDPRELAY:
+			return 0; // datagrams are sent inline or dropped
 	}
 
 	return 0;
@@ -80,9 +173,25 @@ void netsock_close(netsock_t *ns)
 	assert(ns && (((ns->type == NETSOCK_UNDEF) || valid_netsock(ns))));
 
 	list_del(&ns->list);
+	evtimer_cancel(&ns->timer);
+	tunnel_detach(ns);
+	resolver_cancel(ns);
+
+	if (ns->rsm_on) {
+		iobuf_kill(&ns->rsm_buf);
+		ns->rsm_on = 0;
+	}
 
-	if (ns->type != NETSOCK_RTUNSRV)
+	channel_sched_unlink(ns);
+	if (ns->txq_on) {
+		iobuf_kill(&ns->txq);
+		ns->txq_on = 0;
+	}
+
+	if ((ns->type != NETSOCK_RTUNSRV) && (ns->fd != -1)) {
+		event_unwatch(ns);
 		close(ns->fd);
+	}
 
 	switch (ns->type) {
 
@@ -96,10 +205,32 @@ void netsock_close(netsock_t *ns)
 
 		case NETSOCK_S5CLI:
 			iobuf_kill2(&ns->u.sockscli.ibuf, &ns->u.sockscli.obuf);
+			if (ns->u.sockscli.udp) {
+				// the UDP association dies with its control connection
+				ns->u.sockscli.udp->u.udprelay.ctrl = NULL;
+				if (ns->u.sockscli.udp->state != NETSTATE_CANCELLED)
+					tunnel_close(ns->u.sockscli.udp, 1);
+			}
+			break;
+
+		case NETSOCK_UDPRELAY:
+			if (ns->u.udprelay.ctrl) {
+				ns->u.udprelay.ctrl->u.sockscli.udp = NULL;
+				if (ns->u.udprelay.ctrl->state != NETSTATE_CANCELLED)
+					netsock_cancel(ns->u.udprelay.ctrl);
+			}
 			break;
 	}
 
-	free(ns);
+	// pool fixed-size structures, clients are churned on every connection
+	if ((ns->type >= NETSOCK_CTRLCLI) && (ns->type <= NETSOCK_UDPRELAY)
+			&& (ns->type != NETSOCK_RTUNSRV)
+			&& (free_sockets_count < NETSOCK_POOL_SIZE)) {
+		list_add_tail(&ns->list, &free_sockets);
+		++free_sockets_count;
+	} else {
+		free(ns);
+	}
 }
 
 /**
@@ -118,11 +249,18 @@ netsock_t *netsock_alloc(
 {
 	netsock_t *ns;
 
-	ns = calloc(1, sizeof(*ns)+extra_size);
+	if (!extra_size && !list_empty(&free_sockets)) {
+		ns = (netsock_t *) free_sockets.next;
+		list_del(&ns->list);
+		--free_sockets_count;
+		memset(ns, 0, sizeof(*ns));
+	} else {
+		ns = calloc(1, sizeof(*ns)+extra_size);
+	}
 	if (ns) {
 		ns->type = NETSOCK_UNDEF;
 		ns->type = NETSTATE_INIT;
-		ns->tid  = 0xff;
+		ns->tid  = R2T_TID_NONE;
 		ns->fd = fd;
 		if (addr)
 			memcpy(&ns->addr, addr, sizeof(*addr));
@@ -29,6 +29,24 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+// timer.c
+/** timer expiry callback, runs on the event loop */
+typedef void (*timercb_t)(void *);
+
+/** one-shot event loop timer, hashed on the timer wheel while armed */
+typedef struct _evtimer {
+	struct list_head list;       /**< wheel slot anchor, NULL when idle */
+	unsigned long long deadline; /**< absolute deadline (msecs) */
+	timercb_t cb;                /**< expiry callback */
+	void *arg;                   /**< callback argument */
+} evtimer_t;
+
+void timers_init(void);
+void evtimer_arm(evtimer_t *, unsigned int, timercb_t, void *);
+void evtimer_cancel(evtimer_t *);
+int  timers_next_delay(void);
+void timers_dispatch(void);
+
 // netsock.c
 #define NETSOCK_CTRLSRV 0
 #define NETSOCK_TUNSRV  1
@@ -38,14 +56,16 @@
 #define NETSOCK_S5CLI   5
 #define NETSOCK_RTUNSRV 6
 #define NETSOCK_RTUNCLI 7
+#define NETSOCK_UDPRELAY 8
 #define NETSOCK_UNDEF   0xff
 
 #define NETSTATE_INIT           0
 #define NETSTATE_CANCELLED      1
-#define NETSTATE_CONNECTING     2
-#define NETSTATE_CONNECTED      3
-#define NETSTATE_AUTHENTICATING 4
-#define NETSTATE_AUTHENTICATED  5
+#define NETSTATE_RESOLVING      2
+#define NETSTATE_CONNECTING     3
+#define NETSTATE_CONNECTED      4
+#define NETSTATE_AUTHENTICATING 5
+#define NETSTATE_AUTHENTICATED  6
 
 /** network socket (tunnel, client or server) */
 typedef struct _netsock {
@@ -53,8 +73,23 @@ typedef struct _netsock {
 	int fd;                    /**< socket descriptor */
 	unsigned char type;        /**< socket type */
 	unsigned char state;       /**< tunnel state */
-	unsigned char tid;         /**< tunnel identifier */
+	unsigned short tid;        /**< tunnel identifier */
+	unsigned char zfail;       /**< consecutive incompressible payloads */
+	unsigned char profile;     /**< socket tuning profile (NETPROF_xxx) */
+	unsigned char rsm_on;      /**< 1 once the replay ring is initialized */
+	unsigned char rsm_wait;    /**< 1 while a R2TCMD_RESUME answer is due */
+	iobuf_t rsm_buf;           /**< replay ring (recently forwarded bytes) */
+	unsigned char txq_on;      /**< 1 once the staging buffer is initialized */
+	unsigned char txq_queued;  /**< 1 while queued on a scheduler ring */
+	struct _netsock *txq_next; /**< next tunnel on the scheduler ring */
+	iobuf_t txq;               /**< staged payload awaiting channel credit */
+	unsigned int wnd_used;     /**< sent payload bytes not yet acknowledged */
+	unsigned int wnd_ack;      /**< consumed payload bytes not yet reported */
+	int ev_mask;               /**< registered event engine interest set */
 	unsigned int min_io_size;  /**< minimal input buffer size */
+	evtimer_t timer;           /**< connect timeout / idle reaper */
+	unsigned long long idle_mark; /**< I/O counter snapshot for reaping */
+	netstats_t stats;          /**< hot-path I/O counters */
 	netaddr_t addr;            /**< socket address */
 	union {
 		struct {
@@ -74,7 +109,13 @@ typedef struct _netsock {
 		struct {
 			iobuf_t obuf; /**< output buffer */
 			iobuf_t ibuf; /**< input buffer */
+			struct _netsock *udp; /**< associated UDP relay or NULL */
 		} sockscli;
+		struct {
+			struct _netsock *ctrl; /**< SOCKS5 control connection or NULL */
+			netaddr_t peer;        /**< SOCKS5 client datagram endpoint */
+			unsigned char locked;  /**< 1 once the peer endpoint is known */
+		} udprelay;
 		struct {
 			unsigned short lport;     /**< local port */
 			unsigned short rport;     /**< remote port */
@@ -85,23 +126,50 @@ typedef struct _netsock {
 	} u;
 } netsock_t;
 
+/* a socket parked in NETSTATE_RESOLVING has no descriptor and no
+ * address until the resolver thread hands back an answer; it keeps
+ * neither when it is cancelled before the answer arrives */
+#define netsock_no_fd(ns) (((ns)->type == NETSOCK_RTUNSRV) \
+				|| ((ns)->state == NETSTATE_RESOLVING) \
+				|| ((ns)->state == NETSTATE_CANCELLED))
+
 #define valid_netsock(ns) \
 				((ns) && (ns)->list.next && (ns)->list.prev \
-				 && (((ns)->fd != -1) || ((ns)->type == NETSOCK_RTUNSRV)) \
-				 && ((ns)->type <= NETSOCK_RTUNCLI) \
+				 && (((ns)->fd != -1) || netsock_no_fd(ns)) \
+				 && ((ns)->type <= NETSOCK_UDPRELAY) \
 				 && (((ns)->addr.ip4.sin_family == AF_INET) \
 					 || ((ns)->addr.ip4.sin_family == AF_INET6) \
-					 || ((ns)->type == NETSOCK_RTUNSRV)))
+					 || netsock_no_fd(ns)))
 
 #define netsock_is_server(ns) ((ns)->type <= NETSOCK_S5SRV)
 
+/** maximal staged payload per tunnel before its socket stops
+ * being read (fair-queuing backpressure) */
+#define CHANNEL_TXQ_MAX (256*1024)
+
+/** default in-memory ceiling of tunnel output buffers, overflow
+ * spills to a disk ring (see tunnel_spill_max) */
+#define TUNNEL_SPILL_MAX (4*1024*1024)
+
 /**
  * check if main loop must wait for network-read event
  * @param[in] ns netsock socket
+ * @note a tunnel with a full flow-control window or a full staging
+ *       buffer is not read until the peer acknowledges or the
+ *       scheduler drains it; frozen tunnels are not read until the
+ *       channel resyncs after a blip
  */
-#define netsock_want_read(ns) ((ns)->state >= NETSTATE_CONNECTED)
+#define netsock_want_read(ns) (((ns)->state >= NETSTATE_CONNECTED) \
+			&& (!channel_window || ((ns)->wnd_used < channel_window)) \
+			&& (!(ns)->txq_on \
+				 || (iobuf_datalen(&(ns)->txq) < CHANNEL_TXQ_MAX)) \
+			&& (((ns)->type < NETSOCK_TUNCLI) \
+				 || (!tunnels_frozen && !(ns)->rsm_wait)))
 
+void netsocks_init(void);
 netsock_t *netsock_alloc(netsock_t *, int, netaddr_t *, unsigned int);
+void netsock_watch_connect(netsock_t *);
+void netsock_watch_idle(netsock_t *);
 netsock_t *netsock_bind(netsock_t *, const char*,unsigned short,unsigned int);
 netsock_t *netsock_accept(netsock_t *);
 netsock_t *netsock_connect(const char *, unsigned short);
@@ -111,22 +179,67 @@ int  netsock_want_write(netsock_t *);
 void netsock_cancel(netsock_t *);
 void netsock_close(netsock_t *);
 
+// events.c
+#define EVENT_READ  1
+#define EVENT_WRITE 2
+
+int  events_init(void);
+void events_kill(void);
+void event_watch(netsock_t *);
+void event_unwatch(netsock_t *);
+void event_watch_channel(int);
+int  event_watch_stripe(unsigned int, int);
+void event_watch_stripe_out(unsigned int, int, int);
+int  event_watch_resolver(int);
+int  events_wait(int);
+
+// resolver.c
+/** hostname resolution callback, runs on the event loop */
+typedef void (*resolvcb_t)(netsock_t *, int, const netaddr_t *, int);
+
+int  resolver_init(void);
+void resolver_kill(void);
+int  resolver_post(netsock_t *, const char *, unsigned short, resolvcb_t);
+void resolver_cancel(netsock_t *);
+void resolver_dispatch(void);
+
 // channel.c
 #define RDP_FD_IN  0
 #define RDP_FD_OUT 1
 
+extern unsigned int channel_window;
+
 int  channel_init(void);
 void channel_kill(void);
 int  channel_is_connected(void);
 int  channel_read_event(void);
 int  channel_want_write(void);
 void channel_write_event(void);
+int  channel_stripe_read_event(unsigned int);
+void channel_stripe_write_event(unsigned int);
+void channel_arm_stripes(void);
+void channel_cork(void);
+void channel_uncork(void);
 int  channel_ping(void);
+void channel_keepalive(void);
+void channel_rtt_event(unsigned int);
+unsigned int channel_rtt(unsigned int *);
+void channel_latstat_event(const void *, unsigned int);
+int channel_latstat(char *, char *, unsigned int);
 void channel_pong(void);
-unsigned char channel_request_tunnel(unsigned char, const char *, unsigned short, int);
+int  channel_udp_active(void);
+int  channel_write_msg(unsigned char, unsigned int,
+								const void *, unsigned int);
+void channel_hello_event(unsigned char);
+unsigned int channel_request_tunnel(unsigned char, const char *, unsigned short, int);
 int channel_forward_recv(netsock_t *);
-int channel_forward_iobuf(iobuf_t *, unsigned char);
-void channel_close_tunnel(unsigned char);
+int channel_forward_iobuf(netsock_t *, iobuf_t *);
+int channel_zdata_recv(netsock_t *, const void *, unsigned int, unsigned int);
+void channel_wndup_consumed(netsock_t *, unsigned int);
+void channel_close_tunnel(unsigned int);
+void channel_drop_queued(void);
+void channel_sched_run(void);
+void channel_sched_unlink(netsock_t *);
 
 // controller.c
 int  controller_start(const char *, unsigned short);
@@ -135,29 +248,51 @@ int  controller_read_event(netsock_t *);
 int  controller_answer(netsock_t *, const char *, ...);
 
 // tunnel.c
-int tunnel_add(netsock_t *, char *, unsigned short, int, char *, unsigned short);
-int tunnel_add_reverse(netsock_t *, char *, unsigned short, int, char *, unsigned short);
+netsock_t *tunnel_create(netsock_t *, char *, unsigned short, int,
+									char *, unsigned short, int);
+netsock_t *tunnel_create_reverse(netsock_t *, char *, unsigned short, int,
+									char *, unsigned short, int);
+netsock_t *tunnel_find(const char *, unsigned short);
+int tunnel_add(netsock_t *, char *, unsigned short, int, char *,
+									unsigned short, int);
+int tunnel_add_reverse(netsock_t *, char *, unsigned short, int, char *,
+									unsigned short, int);
 int tunnel_del(netsock_t *, char *, unsigned short);
 void tunnel_accept_event(netsock_t *);
 void tunnel_connect_event(netsock_t *, int, const void *, unsigned short);
-void tunnel_revconnect_event(netsock_t *, unsigned char, int,
+void tunnel_revconnect_event(netsock_t *, unsigned int, int,
 										const void *, unsigned short);
 void tunnel_bind_event(netsock_t *, int, const void *, unsigned short);
 int  tunnel_write_event(netsock_t *);
 int  tunnel_write(netsock_t *, const void *, unsigned int);
 void tunnel_close(netsock_t *, int);
-unsigned char tunnel_generate_id(void);
-netsock_t *tunnel_lookup(unsigned char);
+unsigned int tunnel_generate_id(void);
+void tunnel_release_id(unsigned int);
+void tunnel_attach(netsock_t *, unsigned int);
+void tunnel_detach(netsock_t *);
+netsock_t *tunnel_lookup(unsigned int);
 void tunnels_kill_clients(void);
 void tunnels_restart(void);
+unsigned int tunnel_spill_max(void);
+
+extern int tunnels_frozen;
+int  tunnel_resume_enabled(void);
+void tunnel_resume_capture(netsock_t *, const void *, unsigned int);
+int  tunnels_freeze(void);
+void tunnels_resume(int);
+void tunnel_resume_event(unsigned int, int, unsigned long long);
 
 // socks5.c
 int socks5_bind(netsock_t *, const char *, unsigned short);
 void socks5_connect_event(netsock_t *, int, const void *, unsigned short);
 void socks5_accept_event(netsock_t *);
 int  socks5_read_event(netsock_t *);
+void socks5_associate_event(netsock_t *);
+int  socks5_udp_read_event(netsock_t *);
+int  socks5_udp_deliver(netsock_t *, const void *, unsigned int);
 
 // main.c
 void bye(void);
+void netsock_dispatch(netsock_t *, int);
 
 #endif
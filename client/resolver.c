@@ -0,0 +1,278 @@
+/**
+ * @file resolver.c
+ * asynchronous hostname resolution
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+/*
+ * getaddrinfo is synchronous and a slow or broken resolver can block
+ * for several seconds. Lookups are shipped to a small thread pool and
+ * the requesting socket is parked in NETSTATE_RESOLVING; answers come
+ * back to the event loop through a self-pipe so that every other
+ * tunnel keeps flowing while the resolver thinks.
+ */
+
+/** number of resolver threads */
+#define RESOLVER_POOL_SIZE 2
+
+/** pending hostname lookup */
+typedef struct _resolvjob {
+	struct list_head list; /**< pending or completed jobs queue */
+	netsock_t *ns;         /**< requesting socket, NULL once cancelled */
+	resolvcb_t cb;         /**< completion callback */
+	int ret;               /**< net_resolve return value */
+	int err;               /**< resolver error code */
+	netaddr_t addr;        /**< resolved address */
+	unsigned short port;   /**< port to resolve */
+	char host[1];          /**< hostname to resolve */
+} resolvjob_t;
+
+static LIST_HEAD_INIT(pending_jobs);
+static LIST_HEAD_INIT(done_jobs);
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jobs_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t resolver_threads[RESOLVER_POOL_SIZE];
+
+/** jobs being resolved right now, indexed by thread */
+static resolvjob_t *active_jobs[RESOLVER_POOL_SIZE];
+
+/** self-pipe waking up the event loop on job completion */
+static int resolver_pipe[2] = { -1, -1 };
+static int resolver_running = 0;
+
+static void *resolver_main(void *arg)
+{
+	unsigned int self;
+	resolvjob_t *job;
+	ssize_t w;
+
+	self = (unsigned int)(unsigned long) arg;
+
+	pthread_mutex_lock(&jobs_lock);
+	while (resolver_running) {
+
+		if (list_empty(&pending_jobs)) {
+			pthread_cond_wait(&jobs_cond, &jobs_lock);
+			continue;
+		}
+
+		job = (resolvjob_t *) pending_jobs.next;
+		list_del(&job->list);
+		active_jobs[self] = job;
+		pthread_mutex_unlock(&jobs_lock);
+
+		job->ret = net_resolve(AF_UNSPEC, job->host, job->port,
+										&job->addr, &job->err);
+
+		pthread_mutex_lock(&jobs_lock);
+		active_jobs[self] = NULL;
+		list_add_tail(&job->list, &done_jobs);
+
+		w = write(resolver_pipe[1], "", 1);
+		(void) w; // the loop also drains completions on the next wakeup
+	}
+	pthread_mutex_unlock(&jobs_lock);
+
+	return NULL;
+}
+
+/**
+ * start the resolver thread pool
+ * @return 0 on success
+ * @note without a pool lookups fall back to blocking net_resolve calls
+ */
+int resolver_init(void)
+{
+	unsigned int i;
+
+	trace_sock("");
+
+	if (pipe(resolver_pipe) < 0)
+		return error("failed to create resolver pipe (%s)", strerror(errno));
+
+	fcntl(resolver_pipe[0], F_SETFL,
+			fcntl(resolver_pipe[0], F_GETFL)|O_NONBLOCK);
+
+	if (event_watch_resolver(resolver_pipe[0])) {
+		close(resolver_pipe[0]);
+		close(resolver_pipe[1]);
+		resolver_pipe[0] = resolver_pipe[1] = -1;
+		return -1;
+	}
+
+	resolver_running = 1;
+	for (i=0; i<RESOLVER_POOL_SIZE; ++i) {
+		if (pthread_create(&resolver_threads[i], NULL, resolver_main,
+									(void *)(unsigned long)i)) {
+			resolver_kill();
+			return error("failed to start resolver thread (%s)",
+								strerror(errno));
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * stop the resolver thread pool
+ */
+void resolver_kill(void)
+{
+	unsigned int i;
+
+	if (!resolver_running)
+		return;
+
+	pthread_mutex_lock(&jobs_lock);
+	resolver_running = 0;
+	pthread_cond_broadcast(&jobs_cond);
+	pthread_mutex_unlock(&jobs_lock);
+
+	for (i=0; i<RESOLVER_POOL_SIZE; ++i) {
+		if (resolver_threads[i]) {
+			pthread_join(resolver_threads[i], NULL);
+			resolver_threads[i] = 0;
+		}
+	}
+
+	close(resolver_pipe[0]);
+	close(resolver_pipe[1]);
+	resolver_pipe[0] = resolver_pipe[1] = -1;
+}
+
+/**
+ * queue a hostname lookup and park the socket
+ * @param[in] ns requesting socket
+ * @param[in] host hostname to resolve
+ * @param[in] port TCP port
+ * @param[in] cb completion callback, invoked on the event loop
+ * @return 0 on success (the callback runs exactly once)
+ */
+int resolver_post(
+			netsock_t *ns,
+			const char *host,
+			unsigned short port,
+			resolvcb_t cb)
+{
+	resolvjob_t *job;
+	netaddr_t addr;
+	int ret, err;
+
+	assert(ns && host && *host && port && cb);
+	trace_sock("host=%s, port=%hu", host, port);
+
+	ns->state = NETSTATE_RESOLVING;
+
+	if (!resolver_running) {
+		// no pool, resolve synchronously
+		ret = net_resolve(AF_UNSPEC, host, port, &addr, &err);
+		cb(ns, ret, &addr, err);
+		return 0;
+	}
+
+	job = malloc(sizeof(*job) + strlen(host));
+	if (!job)
+		return error("failed to allocate resolver job");
+
+	job->ns   = ns;
+	job->cb   = cb;
+	job->port = port;
+	strcpy(job->host, host);
+
+	pthread_mutex_lock(&jobs_lock);
+	list_add_tail(&job->list, &pending_jobs);
+	pthread_cond_signal(&jobs_cond);
+	pthread_mutex_unlock(&jobs_lock);
+
+	return 0;
+}
+
+/**
+ * detach a socket from its in-flight lookup / called on netsock_close
+ * @param[in] ns closing socket
+ */
+void resolver_cancel(netsock_t *ns)
+{
+	unsigned int i;
+	resolvjob_t *job;
+
+	assert(ns);
+
+	if (!resolver_running)
+		return;
+
+	pthread_mutex_lock(&jobs_lock);
+
+	list_for_each(job, &pending_jobs) {
+		if (job->ns == ns)
+			job->ns = NULL;
+	}
+	list_for_each(job, &done_jobs) {
+		if (job->ns == ns)
+			job->ns = NULL;
+	}
+	for (i=0; i<RESOLVER_POOL_SIZE; ++i) {
+		if (active_jobs[i] && (active_jobs[i]->ns == ns))
+			active_jobs[i]->ns = NULL;
+	}
+
+	pthread_mutex_unlock(&jobs_lock);
+}
+
+/**
+ * run completion callbacks of finished lookups on the event loop
+ */
+void resolver_dispatch(void)
+{
+	resolvjob_t *job;
+	netsock_t *ns;
+	char buf[64];
+
+	// drain self-pipe wakeup bytes
+	while (read(resolver_pipe[0], buf, sizeof(buf)) == sizeof(buf));
+
+	for (;;) {
+
+		pthread_mutex_lock(&jobs_lock);
+		job = NULL;
+		if (!list_empty(&done_jobs)) {
+			job = (resolvjob_t *) done_jobs.next;
+			list_del(&job->list);
+		}
+		pthread_mutex_unlock(&jobs_lock);
+
+		if (!job)
+			break;
+
+		ns = job->ns;
+		if (ns && (ns->state == NETSTATE_RESOLVING))
+			job->cb(ns, job->ret, &job->addr, job->err);
+
+		free(job);
+	}
+}
@@ -27,6 +27,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -34,6 +36,9 @@
 extern int debug_level;
 #endif
 
+/** batched datagram records pending on the virtual channel */
+static unsigned char udp_batch[NETBUF_MAX_SIZE];
+
 static int socks_error(netsock_t *cli, unsigned char ret)
 {
 	unsigned char out[2];
@@ -88,12 +93,15 @@ void socks5_connect_event(
 	ans[5+addr_len] = (unsigned char) (port & 0xff);
 
 	cli->state = NETSTATE_CONNECTED;
+	if (cli->stats.t0)
+		cli->stats.connect_ms = (unsigned int)(net_now_ms() - cli->stats.t0);
+	netsock_watch_idle(cli);
 
 	if (netsock_write(cli, ans, addr_len+6) >= 0) {
 
 		if (iobuf_datalen(&cli->u.sockscli.ibuf) > 0) {
-			if (channel_forward_iobuf(&cli->u.sockscli.ibuf,
-												cli->tid) < 0) {
+			if (channel_forward_iobuf(cli,
+												&cli->u.sockscli.ibuf) < 0) {
 				tunnel_close(cli, 1);
 			}
 		}
@@ -103,11 +111,85 @@ void socks5_connect_event(
 	}
 }
 
+/**
+ * setup a UDP relay after a SOCKS5 UDP-associate request
+ * @param[in] cli client control connection
+ * @return 0 on success
+ * @note the relay address is only answered once the rdp2tcp server
+ *       has confirmed the tunnel (see socks5_associate_event)
+ */
+static int socks5_associate_setup(netsock_t *cli)
+{
+	int fd;
+	unsigned int tid;
+	socklen_t alen;
+	netaddr_t addr;
+	netsock_t *relay;
+
+	if (!channel_udp_active()) {
+		warn("UDP relaying not supported by rdp2tcp server");
+		return socks_error(cli, SOCKS5_UNKCOMMAND);
+	}
+
+	// bind the relay on the address the SOCKS5 server answered from
+	memset(&addr, 0, sizeof(addr));
+	alen = sizeof(addr);
+	if (getsockname(cli->fd, (struct sockaddr *)&addr, &alen) < 0) {
+		error("failed to get SOCKS5 local address (%s)", strerror(errno));
+		return socks_error(cli, SOCKS5_ERROR);
+	}
+	if (netaddr_af(&addr) == AF_INET)
+		addr.ip4.sin_port = 0;
+	else
+		addr.ip6.sin6_port = 0;
+
+	fd = socket(netaddr_af(&addr), SOCK_DGRAM, 0);
+	if (fd < 0) {
+		error("failed to create UDP relay socket (%s)", strerror(errno));
+		return socks_error(cli, SOCKS5_ERROR);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	alen = (netaddr_af(&addr) == AF_INET
+				? sizeof(addr.ip4) : sizeof(addr.ip6));
+	if ((bind(fd, (struct sockaddr *)&addr, alen) < 0)
+			|| (getsockname(fd, (struct sockaddr *)&addr, &alen) < 0)) {
+		error("failed to bind UDP relay socket (%s)", strerror(errno));
+		close(fd);
+		return socks_error(cli, SOCKS5_ERROR);
+	}
+
+	relay = netsock_alloc(NULL, fd, &addr, 0);
+	if (!relay) {
+		close(fd);
+		return socks_error(cli, SOCKS5_ERROR);
+	}
+	relay->type  = NETSOCK_UDPRELAY;
+	relay->state = NETSTATE_CONNECTED;
+	relay->u.udprelay.ctrl = cli;
+	cli->u.sockscli.udp = relay;
+
+	tid = channel_request_tunnel(TUNAF_UDP, "*", 0, 0);
+	if (tid == R2T_TID_NONE) {
+		netsock_close(relay); // also aborts the control connection
+		return -1;
+	}
+
+	tunnel_attach(relay, tid);
+	relay->stats.t0 = net_now_ms();
+	cli->state = NETSTATE_CONNECTING;
+	netsock_watch_connect(cli);
+
+	info(0, "SOCKS5 UDP associate request, relay on port %hu",
+			ntohs(addr.ip4.sin_port));
+	return 0;
+}
+
 static int socks5_setup(netsock_t *cli)
 {
-	unsigned int len, methods_count, port_off;
+	unsigned int len, methods_count, port_off, tid;
 	unsigned short port;
-	unsigned char tunaf, tid, *buf, out[2];
+	unsigned char cmd, tunaf, *buf, out[2];
 	iobuf_t *ibuf;
 	char *host, ip[INET6_ADDRSTRLEN+1];
 
@@ -169,8 +251,9 @@ static int socks5_setup(netsock_t *cli)
 	if (buf[2] != 0)
 		return error("invalid SOCKS5 reserved field (0x%02x)", buf[2]);
 
-	if (buf[1] != SOCKS5_CONNECT) {
-		warn("unsupported SOCKS5 command 0x%02x", buf[1]);
+	cmd = buf[1];
+	if ((cmd != SOCKS5_CONNECT) && (cmd != SOCKS5_UDPASSOC)) {
+		warn("unsupported SOCKS5 command 0x%02x", cmd);
 		return socks_error(cli, SOCKS5_UNKCOMMAND);
 	}
 
@@ -220,24 +303,224 @@ static int socks5_setup(netsock_t *cli)
 	}
 
 	port = ntohs((((unsigned short)buf[port_off+1]) << 8) | buf[port_off]);
-	if (!port) {
+	if (!port && (cmd != SOCKS5_UDPASSOC)) {
+		// an idle UDP-associate client may not know its port yet
 		if (host && (host != ip))
 			free(host);
 		return error("invalid SOCKS5 port");
 	}
 	iobuf_consume(ibuf, port_off+2);
 
+	if (cmd == SOCKS5_UDPASSOC) {
+		// the address is only a hint, the relay locks on the first datagram
+		if (host && (host != ip))
+			free(host);
+		return socks5_associate_setup(cli);
+	}
+
 	info(0, "SOCKS5 forward request to %s:%hu", host, port);
 
 	tid = channel_request_tunnel(tunaf, host, port, 0);
 	if (host && (host != ip))
 		free(host);
 
-	if (tid == 0xff)
+	if (tid == R2T_TID_NONE)
 		return -1;
 
-	cli->tid   = tid;
+	tunnel_attach(cli, tid);
 	cli->state = NETSTATE_CONNECTING;
+	cli->stats.t0 = net_now_ms();
+	netsock_watch_connect(cli);
+
+	return 0;
+}
+
+/**
+ * handle UDP relay tunnel connect-event
+ * @param[in] relay UDP relay socket
+ * @note called when the rdp2tcp server has confirmed the UDP tunnel,
+ *       answers the relay address to the SOCKS5 client
+ */
+void socks5_associate_event(netsock_t *relay)
+{
+	unsigned int addr_len;
+	netsock_t *cli;
+	unsigned char ans[4+16+2];
+
+	assert(valid_netsock(relay) && (relay->type == NETSOCK_UDPRELAY));
+	trace_socks("tid=0x%02x", relay->tid);
+
+	cli = relay->u.udprelay.ctrl;
+	if (!cli) {
+		// control connection died during tunnel setup
+		tunnel_close(relay, 1);
+		return;
+	}
+
+	if (relay->stats.t0)
+		relay->stats.connect_ms =
+					(unsigned int)(net_now_ms() - relay->stats.t0);
+
+	ans[0] = SOCKS5_VERSION;
+	ans[1] = SOCKS5_SUCCESS;
+	ans[2] = 0;
+	if (netaddr_af(&relay->addr) == AF_INET) {
+		ans[3] = SOCKS5_ATYPE_IPV4;
+		memcpy(&ans[4], &relay->addr.ip4.sin_addr, 4);
+		memcpy(&ans[8], &relay->addr.ip4.sin_port, 2);
+		addr_len = 4;
+	} else {
+		ans[3] = SOCKS5_ATYPE_IPV6;
+		memcpy(&ans[4], &relay->addr.ip6.sin6_addr, 16);
+		memcpy(&ans[20], &relay->addr.ip6.sin6_port, 2);
+		addr_len = 16;
+	}
+
+	cli->state = NETSTATE_CONNECTED;
+	netsock_watch_idle(cli);
+	if (netsock_write(cli, ans, addr_len+6) < 0)
+		tunnel_close(relay, 1);
+}
+
+/**
+ * handle UDP relay network read-event
+ * @param[in] ns UDP relay socket
+ * @return 0 on success
+ * @note datagrams are batched into a single R2TCMD_UDATA message;
+ *       they are lossy traffic and bypass flow-control accounting
+ */
+int socks5_udp_read_event(netsock_t *ns)
+{
+	ssize_t r;
+	unsigned int used, alen, hlen, plen;
+	socklen_t slen;
+	netaddr_t src;
+	unsigned char af, dgram[4+16+2+RDP2TCP_MAX_DGRAM];
+
+	assert(valid_netsock(ns) && (ns->type == NETSOCK_UDPRELAY));
+	trace_socks("tid=0x%02x", ns->tid);
+
+	used = 0;
+	for (;;) {
+
+		memset(&src, 0, sizeof(src));
+		slen = sizeof(src);
+		r = recvfrom(ns->fd, dgram, sizeof(dgram), 0,
+							(struct sockaddr *)&src, &slen);
+		if (r < 0)
+			break; // EAGAIN, flush what was batched
+
+		// RFC1928: lock the relay on the first client endpoint
+		if (!ns->u.udprelay.locked) {
+			memcpy(&ns->u.udprelay.peer, &src, sizeof(src));
+			ns->u.udprelay.locked = 1;
+		} else if (netaddr_cmp(&src, &ns->u.udprelay.peer)) {
+			continue; // not the association peer
+		}
+
+		// +----+------+------+----------+----------+----------+
+		// |RSV | FRAG | ATYP | DST.ADDR | DST.PORT |   DATA   |
+		// +----+------+------+----------+----------+----------+
+		if ((r < 10) || dgram[0] || dgram[1] || dgram[2])
+			continue; // malformed or fragmented datagram
+
+		switch (dgram[3]) {
+			case SOCKS5_ATYPE_IPV4:
+				af   = TUNAF_IPV4;
+				alen = 4;
+				break;
+			case SOCKS5_ATYPE_IPV6:
+				af   = TUNAF_IPV6;
+				alen = 16;
+				break;
+			default:
+				// a FQDN would require a blocking resolve per datagram
+				continue;
+		}
+
+		hlen = 4 + alen + 2;
+		if ((unsigned int) r <= hlen)
+			continue; // empty datagram
+		plen = (unsigned int) r - hlen;
+
+		if (used && (used + 5 + alen + plen > sizeof(udp_batch))) {
+			channel_write_msg(R2TCMD_UDATA, ns->tid, udp_batch, used);
+			++ns->stats.msgs_out;
+			used = 0;
+		}
+
+		udp_batch[used]   = af;
+		udp_batch[used+1] = dgram[4+alen]; // port, already network order
+		udp_batch[used+2] = dgram[5+alen];
+		udp_batch[used+3] = (unsigned char)(plen >> 8);
+		udp_batch[used+4] = (unsigned char)(plen & 0xff);
+		memcpy(&udp_batch[used+5], &dgram[4], alen);
+		memcpy(&udp_batch[used+5+alen], &dgram[hlen], plen);
+		used += 5 + alen + plen;
+		ns->stats.bytes_in += plen;
+	}
+
+	if (used) {
+		if (channel_write_msg(R2TCMD_UDATA, ns->tid, udp_batch, used) < 0)
+			return -1;
+		++ns->stats.msgs_out;
+	}
+
+	return 0;
+}
+
+/**
+ * deliver batched datagrams received from the rdp2tcp server
+ * @param[in] ns UDP relay socket
+ * @param[in] data R2TCMD_UDATA records
+ * @param[in] len total records size
+ * @return 0 on success
+ */
+int socks5_udp_deliver(netsock_t *ns, const void *data, unsigned int len)
+{
+	const unsigned char *rec;
+	unsigned int off, alen, plen;
+	socklen_t slen;
+	unsigned char dgram[4+16+2+RDP2TCP_MAX_DGRAM];
+
+	assert(valid_netsock(ns) && (ns->type == NETSOCK_UDPRELAY) && data);
+	trace_socks("tid=0x%02x, len=%u", ns->tid, len);
+
+	rec = data;
+	for (off = 0; off + 5 <= len; off += 5 + alen + plen) {
+
+		switch (rec[off]) {
+			case TUNAF_IPV4: alen = 4;  break;
+			case TUNAF_IPV6: alen = 16; break;
+			default:
+				return error("invalid UDP relay record");
+		}
+
+		plen = (((unsigned int)rec[off+3]) << 8) | rec[off+4];
+		if (off + 5 + alen + plen > len)
+			return error("truncated UDP relay record");
+
+		if (!ns->u.udprelay.locked || (6 + alen + plen > sizeof(dgram)))
+			continue; // no client endpoint yet, or oversized record
+
+		dgram[0] = 0;
+		dgram[1] = 0;
+		dgram[2] = 0;
+		dgram[3] = (alen == 4 ? SOCKS5_ATYPE_IPV4 : SOCKS5_ATYPE_IPV6);
+		memcpy(&dgram[4], &rec[off+5], alen);
+		dgram[4+alen] = rec[off+1]; // port, already network order
+		dgram[5+alen] = rec[off+2];
+		memcpy(&dgram[6+alen], &rec[off+5+alen], plen);
+
+		slen = (netaddr_af(&ns->u.udprelay.peer) == AF_INET
+					? sizeof(ns->u.udprelay.peer.ip4)
+					: sizeof(ns->u.udprelay.peer.ip6));
+		// drop on error, datagrams are best-effort
+		sendto(ns->fd, dgram, 6+alen+plen, 0,
+				(const struct sockaddr *)&ns->u.udprelay.peer, slen);
+		ns->stats.bytes_out += plen;
+	}
+	++ns->stats.msgs_in;
 
 	return 0;
 }
@@ -252,6 +535,16 @@ int socks5_read_event(netsock_t *cli)
 	assert(valid_netsock(cli) && (cli->type == NETSOCK_S5CLI));
 	trace_socks("state=0x%02x", cli->state);
 
+	if (cli->u.sockscli.udp) {
+		// UDP association control connection: no payload is expected,
+		// it only signals the end of the association by closing
+		if (netsock_read(cli, &cli->u.sockscli.ibuf, 0, NULL) < 0)
+			return -1;
+		iobuf_consume(&cli->u.sockscli.ibuf,
+							iobuf_datalen(&cli->u.sockscli.ibuf));
+		return 0;
+	}
+
 	if (cli->state != NETSTATE_CONNECTED)
 		return socks5_setup(cli);
 
@@ -276,9 +569,10 @@ void socks5_accept_event(netsock_t *srv)
 		info(0, "accepted socks5 client %s", netaddr_print(&cli->addr, host));
 		if (channel_is_connected()) {
 			cli->type  = NETSOCK_S5CLI;
-			cli->tid   = 0xff;
+			cli->tid   = R2T_TID_NONE;
 			cli->state = NETSTATE_AUTHENTICATING;
 			iobuf_init2(&cli->u.sockscli.ibuf, &cli->u.sockscli.obuf, "socks5");
+			iobuf_spill(&cli->u.sockscli.obuf, tunnel_spill_max());
 		} else {
 			error("channel not connected");
 			netsock_close(cli);
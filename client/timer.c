@@ -0,0 +1,173 @@
+/**
+ * @file timer.c
+ * event loop timer wheel
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+
+/*
+ * Timers are hashed on a wheel keyed by their deadline tick so arming
+ * and cancelling are O(1) list operations. The main loop asks for the
+ * delay until the earliest deadline instead of polling every second,
+ * so an idle client sleeps until something is actually due.
+ */
+
+/** wheel tick granularity (msecs) */
+#define TIMER_TICK_MS 64
+/** number of wheel slots, must be a power of two */
+#define TIMER_WHEEL_SIZE 256
+
+/** wheel slots, each holding the timers hashed to that tick */
+static struct list_head wheel[TIMER_WHEEL_SIZE];
+
+/** last tick swept by timers_dispatch */
+static unsigned long long last_tick;
+
+/** number of armed timers */
+static unsigned int armed_count;
+
+/**
+ * initialize the timer wheel
+ */
+void timers_init(void)
+{
+	unsigned int i;
+
+	for (i=0; i<TIMER_WHEEL_SIZE; ++i)
+		list_init(&wheel[i]);
+
+	last_tick = net_now_ms() / TIMER_TICK_MS;
+}
+
+/**
+ * arm a one-shot timer
+ * @param[in] t timer, re-armed if already pending
+ * @param[in] delay_ms delay before expiry (msecs)
+ * @param[in] cb expiry callback, runs on the event loop
+ * @param[in] arg callback argument
+ */
+void evtimer_arm(evtimer_t *t, unsigned int delay_ms, timercb_t cb, void *arg)
+{
+	assert(t && cb);
+
+	if (t->list.next)
+		list_del(&t->list);
+	else
+		++armed_count;
+
+	t->deadline = net_now_ms() + delay_ms;
+	t->cb  = cb;
+	t->arg = arg;
+
+	list_add_tail(&t->list,
+			&wheel[(t->deadline / TIMER_TICK_MS) & (TIMER_WHEEL_SIZE-1)]);
+}
+
+/**
+ * cancel a pending timer
+ * @param[in] t timer, ignored when not armed
+ */
+void evtimer_cancel(evtimer_t *t)
+{
+	assert(t);
+
+	if (t->list.next) {
+		list_del(&t->list);
+		t->list.next = NULL;
+		t->list.prev = NULL;
+		--armed_count;
+	}
+}
+
+/**
+ * compute how long the event loop may sleep
+ * @return msecs until the earliest deadline, -1 when no timer is armed
+ */
+int timers_next_delay(void)
+{
+	unsigned int i;
+	unsigned long long now, min;
+	evtimer_t *t;
+
+	if (!armed_count)
+		return -1;
+
+	min = ~0ULL;
+	for (i=0; i<TIMER_WHEEL_SIZE; ++i) {
+		list_for_each(t, &wheel[i]) {
+			if (t->deadline < min)
+				min = t->deadline;
+		}
+	}
+
+	now = net_now_ms();
+	return (min > now ? (int)(min - now) : 0);
+}
+
+/**
+ * run the callbacks of every expired timer
+ * @note called once per main loop iteration, after events_wait
+ */
+void timers_dispatch(void)
+{
+	unsigned long long now, tick;
+	evtimer_t *t;
+	struct list_head *slot;
+
+	if (!armed_count)
+		return;
+
+	now  = net_now_ms();
+	tick = now / TIMER_TICK_MS;
+	if (tick < last_tick)
+		last_tick = tick;
+
+	// after a long sleep one full rotation covers every slot
+	if (tick - last_tick >= TIMER_WHEEL_SIZE)
+		last_tick = tick - TIMER_WHEEL_SIZE + 1;
+
+	// the current tick slot is rescanned until the tick fully elapses
+	// so a timer due in the middle of it is not missed
+	for (;; ++last_tick) {
+
+		slot = &wheel[last_tick & (TIMER_WHEEL_SIZE-1)];
+
+		// restart after each callback, it may arm or cancel
+		// other timers hashed to this very slot
+restart:
+		list_for_each(t, slot) {
+
+			// the slot also holds timers due on a later rotation
+			if (t->deadline > now)
+				continue;
+
+			list_del(&t->list);
+			t->list.next = NULL;
+			t->list.prev = NULL;
+			--armed_count;
+
+			t->cb(t->arg);
+			goto restart;
+		}
+
+		if (last_tick == tick)
+			break;
+	}
+}
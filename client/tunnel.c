@@ -22,51 +22,130 @@
  */
 #include "r2tcli.h"
 #include "nethelper.h"
+#include "msgparser.h"
 
 #include <string.h>
 #include <errno.h>
+#include <stdlib.h>
 
 extern struct list_head all_sockets;
 
+/** 1 while tunnels are frozen waiting for the channel to resync */
+int tunnels_frozen;
+
+/** tunnel obuf in-memory ceiling (bytes, 0 disables spilling,
+ * -1 until RDP2TCP_SPILL was read) */
+static int spill_max = -1;
+
+/** resume grace window (seconds, 0 disables resume,
+ * -1 until RDP2TCP_RESUME was read) */
+static int resume_grace = -1;
+/** per-tunnel replay ring capacity (bytes) */
+static unsigned int resume_bufsize = RDP2TCP_RESUME_BUFSIZE;
+/** grace window expiry timer */
+static evtimer_t resume_timer;
+
+/** direct-indexed tunnel ID lookup table (tid --> socket) */
+static netsock_t *tunnel_table[0x10000];
+
+/** tunnel ID allocation bitmap words */
+#define TID_WORDS (0x10000/32)
+
+/** tunnel ID allocation bitmap, bit set when the ID is used
+ * (0xffff is the invalid ID and is permanently reserved; 0xff is
+ * skipped by the generator while 8-bit framing is in effect) */
+static unsigned int tid_bitmap[TID_WORDS] = {
+	[TID_WORDS-1] = 0x80000000
+};
+
+#define tid_is_used(tid)  (tid_bitmap[(tid) >> 5] &   (1U << ((tid) & 31)))
+#define tid_mark_used(tid) (tid_bitmap[(tid) >> 5] |=  (1U << ((tid) & 31)))
+#define tid_mark_free(tid) (tid_bitmap[(tid) >> 5] &= ~(1U << ((tid) & 31)))
+
 /**
  * lookup socket by tunnel ID
  * @param[in] tid tunnel ID
  * @return NULL if socket was not found
  */
-netsock_t *tunnel_lookup(unsigned char tid)
+netsock_t *tunnel_lookup(unsigned int tid)
 {
-	netsock_t *ns;
-
-	assert(tid != 0xff);
+	assert(tid < R2T_TID_NONE);
 	trace_tun("id=0x%02x", tid);
 
-	list_for_each(ns, &all_sockets) {
-		if (ns->tid == tid)
-			return ns;
+	return tunnel_table[tid];
+}
+
+/**
+ * generate and reserve an unused tunnel ID
+ * @return R2T_TID_NONE on error (all tunnel ID are used)
+ * @note the ID must be bound with tunnel_attach or
+ *       freed with tunnel_release_id; only 8-bit IDs are generated
+ *       until R2TCAP_TID16 has been negotiated
+ */
+unsigned int tunnel_generate_id(void)
+{
+	unsigned int i, n, word, tid;
+
+	n = (r2t_tid16_out ? TID_WORDS : 8);
+	for (i=0; i<n; ++i) {
+		word = tid_bitmap[i];
+		if (!r2t_tid16_out && (i == 7))
+			word |= 0x80000000; // 0xff is invalid on a v1 wire
+		if (word != 0xffffffff) {
+			tid = (i << 5) + __builtin_ctz(~word);
+			tid_mark_used(tid);
+			return tid;
+		}
 	}
 
-	return NULL;
+	error("failed to find available tunnel id");
+	return R2T_TID_NONE;
 }
 
-static unsigned char last_tid = 0xff;
+/**
+ * release a tunnel ID which was never bound to a socket
+ * @param[in] tid tunnel ID
+ */
+void tunnel_release_id(unsigned int tid)
+{
+	assert((tid < R2T_TID_NONE) && !tunnel_table[tid]);
+	tid_mark_free(tid);
+}
 
 /**
- * generate a unused tunnel ID
- * @return 0xff on error (all tunnel ID are used)
+ * bind a reserved tunnel ID to a socket
+ * @param[in] ns tunnel socket
+ * @param[in] tid tunnel ID
  */
-unsigned char tunnel_generate_id(void)
+void tunnel_attach(netsock_t *ns, unsigned int tid)
 {
-	unsigned char tid;
+	assert(ns && (tid < R2T_TID_NONE) && !tunnel_table[tid]);
+	trace_tun("id=0x%02x", tid);
 
-	for (tid=last_tid+1; tid!=last_tid; ++tid) {
-		if (!tunnel_lookup(tid)) {
-			last_tid = tid;
-			return tid;
+	tid_mark_used(tid);
+	tunnel_table[tid] = ns;
+	ns->tid = (unsigned short) tid;
+}
+
+/**
+ * unbind a socket from its tunnel ID
+ * @param[in] ns tunnel socket
+ */
+void tunnel_detach(netsock_t *ns)
+{
+	unsigned int tid;
+
+	assert(ns);
+
+	tid = ns->tid;
+	if (tid != R2T_TID_NONE) {
+		trace_tun("id=0x%02x", tid);
+		if (tunnel_table[tid] == ns) {
+			tunnel_table[tid] = NULL;
+			tid_mark_free(tid);
 		}
+		ns->tid = R2T_TID_NONE;
 	}
-
-	error("failed to find available tunnel id");
-	return 0xff;
 }
 
 static unsigned char sysaf_to_rdpaf(int af)
@@ -79,41 +158,72 @@ static unsigned char sysaf_to_rdpaf(int af)
 }
 
 /**
- * register a new TCP forwarding tunnel
- * @param[in] cli socket of the client who requested the tunnel
+ * create a TCP forwarding tunnel listener
+ * @param[in] cli optional controller socket answered on error
  * @param[in] lhost local hostname or IP address
  * @param[in] lport local TCP port
  * @param[in] raf remote address family (AF_INET/INET6/UNSPEC)
  * @param[in] rhost remote hostname
  * @param[in] rport remote TCP port
- * @return 0 or 1 if the controller is still connected
+ * @param[in] profile socket tuning profile (NETPROF_xxx)
+ * @return NULL on error
  */
-int tunnel_add(
+netsock_t *tunnel_create(
 			netsock_t *cli,
 			char *lhost,
 			unsigned short lport,
 			int raf,
 			char *rhost,
-			unsigned short rport)
+			unsigned short rport,
+			int profile)
 {
 	size_t rhost_len;
 	netsock_t *ns;
-	char str[NETADDRSTR_MAXSIZE*2 + 64];
 
-	assert(valid_netsock(cli) && lhost && *lhost && lport && rhost && *rhost);
+	assert(lhost && *lhost && lport && rhost && *rhost);
 	trace_tun("%s:%hu --> %s:%hu", lhost, lport, rhost, rport);
 
 	rhost_len = strlen(rhost) + 1;
 	ns = netsock_bind(cli, lhost, lport, rhost_len);
 	if (!ns)
-		return 0; // soft error, no need to kill client
+		return NULL;
 
-
-	ns->type = NETSOCK_TUNSRV;
+	ns->type    = NETSOCK_TUNSRV;
+	ns->profile = (unsigned char) profile;
 	ns->u.tunsrv.raf   = sysaf_to_rdpaf(raf);
 	ns->u.tunsrv.rport = rport;
 	memcpy(ns->u.tunsrv.rhost, rhost, rhost_len);
 
+	return ns;
+}
+
+/**
+ * register a new TCP forwarding tunnel
+ * @param[in] cli socket of the client who requested the tunnel
+ * @param[in] lhost local hostname or IP address
+ * @param[in] lport local TCP port
+ * @param[in] raf remote address family (AF_INET/INET6/UNSPEC)
+ * @param[in] rhost remote hostname
+ * @param[in] rport remote TCP port
+ * @param[in] profile socket tuning profile (NETPROF_xxx)
+ * @return 0 or 1 if the controller is still connected
+ */
+int tunnel_add(
+			netsock_t *cli,
+			char *lhost,
+			unsigned short lport,
+			int raf,
+			char *rhost,
+			unsigned short rport,
+			int profile)
+{
+	char str[NETADDRSTR_MAXSIZE*2 + 64];
+
+	assert(valid_netsock(cli) && lhost && *lhost && lport && rhost && *rhost);
+
+	if (!tunnel_create(cli, lhost, lport, raf, rhost, rport, profile))
+		return 0; // soft error, no need to kill client
+
 	if (rport) {
 		snprintf(str, sizeof(str)-1, "tunnel [%s]:%hu --> [%s]:%hu registered",
 					lhost, lport, rhost, rport);
@@ -127,37 +237,40 @@ int tunnel_add(
 }
 
 /**
- * register a new reverse connect TCP tunnel
- * @param[in] cli socket of the client who requested the tunnel
+ * create a reverse connect TCP tunnel
+ * @param[in] cli optional controller socket answered on error
  * @param[in] lhost local hostname or IP address
  * @param[in] lport local TCP port
  * @param[in] raf remote address family (AF_INET/INET6/UNSPEC)
  * @param[in] rhost remote hostname
  * @param[in] rport remote TCP port
- * @return 0 or 1 if the controller is still connected
+ * @param[in] profile socket tuning profile (NETPROF_xxx)
+ * @return NULL on error
  */
-int tunnel_add_reverse(
+netsock_t *tunnel_create_reverse(
 			netsock_t *cli,
 			char *lhost,
 			unsigned short lport,
 			int raf,
 			char *rhost,
-			unsigned short rport)
+			unsigned short rport,
+			int profile)
 {
 	size_t lhost_len, rhost_len;
+	unsigned int tid;
 	netsock_t *ns;
-	char str[NETADDRSTR_MAXSIZE*2 + 64];
 
-	assert(valid_netsock(cli) && lhost && *lhost && lport && rhost && *rhost);
+	assert(lhost && *lhost && lport && rhost && *rhost);
 	trace_tun("%s:%hu <-- %s:%hu", lhost, lport, rhost, rport);
 
 	lhost_len = strlen(lhost) + 1;
 	rhost_len = strlen(rhost) + 1;
 	ns = netsock_alloc(cli, -1, NULL, lhost_len + rhost_len);
 	if (!ns)
-		return 0; // soft-error .. maybe hard but dont kill client
+		return NULL;
 
-	ns->type = NETSOCK_RTUNSRV;
+	ns->type    = NETSOCK_RTUNSRV;
+	ns->profile = (unsigned char) profile;
 	ns->u.rtunsrv.lport = lport;
 	ns->u.rtunsrv.rport = rport;
 	ns->u.rtunsrv.lhost_len = (unsigned short) lhost_len;
@@ -166,13 +279,46 @@ int tunnel_add_reverse(
 
 	if (channel_is_connected()) {
 		// request tunnel binding right now if channel is connected
-		ns->tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1);
-		if (ns->tid == 0xff) {
+		tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1);
+		if (tid == R2T_TID_NONE) {
 			netsock_close(ns);
-			return controller_answer(cli, "error: failed to request port binding");
+			if (cli)
+				controller_answer(cli, "error: failed to request port binding");
+			return NULL;
 		}
+		tunnel_attach(ns, tid);
 	}
 
+	return ns;
+}
+
+/**
+ * register a new reverse connect TCP tunnel
+ * @param[in] cli socket of the client who requested the tunnel
+ * @param[in] lhost local hostname or IP address
+ * @param[in] lport local TCP port
+ * @param[in] raf remote address family (AF_INET/INET6/UNSPEC)
+ * @param[in] rhost remote hostname
+ * @param[in] rport remote TCP port
+ * @param[in] profile socket tuning profile (NETPROF_xxx)
+ * @return 0 or 1 if the controller is still connected
+ */
+int tunnel_add_reverse(
+			netsock_t *cli,
+			char *lhost,
+			unsigned short lport,
+			int raf,
+			char *rhost,
+			unsigned short rport,
+			int profile)
+{
+	char str[NETADDRSTR_MAXSIZE*2 + 64];
+
+	assert(valid_netsock(cli) && lhost && *lhost && lport && rhost && *rhost);
+
+	if (!tunnel_create_reverse(cli, lhost, lport, raf, rhost, rport, profile))
+		return 0; // soft-error .. maybe hard but dont kill client
+
 	snprintf(str, sizeof(str)-1, "tunnel [%s]:%hu <-- [%s]:%hu is being registred",
 				lhost, lport, rhost, rport);
 	info(0, str);
@@ -180,24 +326,19 @@ int tunnel_add_reverse(
 }
 
 /**
- * try to remove tunnel removal
- * @param[in] cli socket of client who requested tunnel removal
+ * search a tunnel listener by local endpoint
+ * @param[in] addr resolved local address
  * @param[in] lhost tunnel local hostname
  * @param[in] lport tunnel local TCP port
- * @return 0 or 1 if the controller is still connected
+ * @return NULL if no tunnel listener matches
  */
-int tunnel_del(netsock_t *cli, char *lhost, unsigned short lport)
+static netsock_t *tunnel_match(
+				const netaddr_t *addr,
+				const char *lhost,
+				unsigned short lport)
 {
 	netsock_t *ns;
-	int ret, err;
-	netaddr_t addr;
-
-	assert(valid_netsock(cli) && lhost && *lhost && lport);
-	trace_tun("host=%s:%i", lhost, lport);
-
-	ret = net_resolve(AF_UNSPEC, lhost, lport, &addr, &err);
-	if (ret)
-		return controller_answer(cli, "error: %s", net_error(ret, err));
+	int ret;
 
 	list_for_each(ns, &all_sockets) {
 
@@ -207,7 +348,7 @@ int tunnel_del(netsock_t *cli, char *lhost, unsigned short lport)
 
 			case NETSOCK_TUNSRV:
 			case NETSOCK_S5SRV:
-				ret = netaddr_cmp(&ns->addr, &addr);
+				ret = netaddr_cmp(&ns->addr, addr);
 				break;
 
 			case NETSOCK_RTUNSRV:
@@ -216,11 +357,57 @@ int tunnel_del(netsock_t *cli, char *lhost, unsigned short lport)
 				break;
 		}
 
-		if (!ret) {
-			tunnel_close(ns, 1);
-			info(0, "tunnel [%s]:%hu removed", lhost, lport);
-			return controller_answer(cli, "tunnel [%s]:%hu removed",lhost,lport);
-		}
+		if (!ret)
+			return ns;
+	}
+
+	return NULL;
+}
+
+/**
+ * search a tunnel listener by local hostname and port
+ * @param[in] lhost tunnel local hostname
+ * @param[in] lport tunnel local TCP port
+ * @return NULL if no tunnel listener matches
+ */
+netsock_t *tunnel_find(const char *lhost, unsigned short lport)
+{
+	int err;
+	netaddr_t addr;
+
+	assert(lhost && *lhost && lport);
+
+	if (net_resolve(AF_UNSPEC, (char *) lhost, lport, &addr, &err))
+		return NULL;
+
+	return tunnel_match(&addr, lhost, lport);
+}
+
+/**
+ * try to remove tunnel removal
+ * @param[in] cli socket of client who requested tunnel removal
+ * @param[in] lhost tunnel local hostname
+ * @param[in] lport tunnel local TCP port
+ * @return 0 or 1 if the controller is still connected
+ */
+int tunnel_del(netsock_t *cli, char *lhost, unsigned short lport)
+{
+	netsock_t *ns;
+	int ret, err;
+	netaddr_t addr;
+
+	assert(valid_netsock(cli) && lhost && *lhost && lport);
+	trace_tun("host=%s:%i", lhost, lport);
+
+	ret = net_resolve(AF_UNSPEC, lhost, lport, &addr, &err);
+	if (ret)
+		return controller_answer(cli, "error: %s", net_error(ret, err));
+
+	ns = tunnel_match(&addr, lhost, lport);
+	if (ns) {
+		tunnel_close(ns, 1);
+		info(0, "tunnel [%s]:%hu removed", lhost, lport);
+		return controller_answer(cli, "tunnel [%s]:%hu removed",lhost,lport);
 	}
 
 	return controller_answer(cli,"error: tunnel [%s]:%hu not found",lhost,lport);
@@ -233,7 +420,7 @@ int tunnel_del(netsock_t *cli, char *lhost, unsigned short lport)
  */
 void tunnel_close(netsock_t *ns, int notify_server)
 {
-	unsigned char tid;
+	unsigned int tid;
 	//char host[NETADDRSTR_MAXSIZE];
 
 	assert(valid_netsock(ns));
@@ -241,24 +428,44 @@ void tunnel_close(netsock_t *ns, int notify_server)
 	tid = ns->tid;
 	trace_tun("tid=0x%02x, notify=%i", tid, notify_server);
 
-	if (tid != 0xff) {
+	if (tid != R2T_TID_NONE) {
 		if (notify_server)
 			channel_close_tunnel(tid);
 
-		if (tid == last_tid)
-			--last_tid;
+		tunnel_detach(ns);
 	}
 
 	netsock_cancel(ns);
 }
 
+/**
+ * get the in-memory ceiling of tunnel output buffers
+ * @return the ceiling in bytes, 0 when spilling is disabled
+ * @note beyond the ceiling payload overflows to a disk ring so a
+ *       stalled tunnel client cannot grow the obuf in RAM without
+ *       bound (RDP2TCP_SPILL overrides the default)
+ */
+unsigned int tunnel_spill_max(void)
+{
+	const char *env;
+
+	if (spill_max < 0) {
+		spill_max = TUNNEL_SPILL_MAX;
+		env = getenv("RDP2TCP_SPILL");
+		if (env && (atoi(env) >= 0))
+			spill_max = atoi(env);
+	}
+
+	return (unsigned int) spill_max;
+}
+
 /**
  * handle tcp-connect tunnel network accept-event
  * @param[in] srv tunnel socket
  */
 void tunnel_accept_event(netsock_t *srv)
 {
-	unsigned char tid;
+	unsigned int tid;
 	netsock_t *cli;
 	char host1[NETADDRSTR_MAXSIZE], host2[NETADDRSTR_MAXSIZE];
 
@@ -269,6 +476,7 @@ void tunnel_accept_event(netsock_t *srv)
 	if (cli) {
 		cli->type = NETSOCK_TUNCLI;
 		iobuf_init(&cli->u.tuncli.obuf, 'w', "tun");
+		iobuf_spill(&cli->u.tuncli.obuf, tunnel_spill_max());
 
 		info(0, "accepted local tunnel client %s on %s",
 				netaddr_print(&cli->addr, host1),
@@ -279,11 +487,15 @@ void tunnel_accept_event(netsock_t *srv)
 													srv->u.tunsrv.rhost,
 													srv->u.tunsrv.rport, 0);
 
-			if (tid != 0xff) {
+			if (tid != R2T_TID_NONE) {
 				info(0, "reserved tunnel 0x%02x for %s",
 						tid, netaddr_print(&cli->addr, host1));
-				cli->tid = tid;
-				cli->state = NETSTATE_CONNECTING;
+				tunnel_attach(cli, tid);
+				cli->state   = NETSTATE_CONNECTING;
+				cli->profile = srv->profile;
+				net_tune(&cli->fd, cli->profile);
+				cli->stats.t0 = net_now_ms();
+				netsock_watch_connect(cli);
 			} else {
 				netsock_close(cli);
 			}
@@ -318,6 +530,9 @@ void tunnel_connect_event(
 		af == AF_INET ? "ipv4" : (af == AF_UNSPEC ? "proc" : "ipv6"), port);
 
 	ns->state = NETSTATE_CONNECTED;
+	if (ns->stats.t0)
+		ns->stats.connect_ms = (unsigned int)(net_now_ms() - ns->stats.t0);
+	netsock_watch_idle(ns);
 
 	if (af != AF_UNSPEC) {
 		// tcp forwarding
@@ -356,6 +571,48 @@ void tunnel_bind_event(
 	netaddr_set(af, addr, port, &ns->addr);
 }
 
+/**
+ * handle resolver answer for a reverse-connect tunnel client
+ * @param[in] ns tunnel client socket (NETSOCK_RTUNCLI)
+ * @param[in] ret net_resolve return value
+ * @param[in] addr resolved address
+ * @param[in] err resolver error code
+ */
+static void tunnel_resolve_event(
+				netsock_t *ns,
+				int ret,
+				const netaddr_t *addr,
+				int err)
+{
+	int fd;
+
+	assert(ns && (ns->type == NETSOCK_RTUNCLI)
+			&& (ns->state == NETSTATE_RESOLVING));
+	trace_tun("tid=0x%02x, ret=%i", ns->tid, ret);
+
+	fd = -1;
+	if (!ret) {
+		memcpy(&ns->addr, addr, sizeof(ns->addr));
+		ret = net_connect(&ns->addr, &fd, &err);
+	}
+
+	if (ret < 0) {
+		error("failed to connect reverse tunnel 0x%02x (%s)",
+				ns->tid, net_error(ret, err));
+		channel_close_tunnel(ns->tid);
+		netsock_close(ns);
+		return;
+	}
+
+	ns->fd    = fd;
+	net_tune(&ns->fd, ns->profile);
+	ns->state = (ret ? NETSTATE_CONNECTING : NETSTATE_CONNECTED);
+	if (ret)
+		netsock_watch_connect(ns);
+	else
+		netsock_watch_idle(ns);
+}
+
 /**
  * handle tcp-listen tunnel network connect-event
  * @param[in] srv tunnel (NETSOCK_RTUNSRV)
@@ -366,7 +623,7 @@ void tunnel_bind_event(
  */
 void tunnel_revconnect_event(
 				netsock_t *srv,
-				unsigned char new_id,
+				unsigned int new_id,
 				int af,
 				const void *addr,
 				unsigned short port)
@@ -376,14 +633,25 @@ void tunnel_revconnect_event(
 	assert(valid_netsock(srv) && (srv->type == NETSOCK_RTUNSRV));
 	trace_tun("new_id=0x%02x", new_id);
 
-	cli = netsock_connect(srv->u.rtunsrv.lhost, srv->u.rtunsrv.lport);
-	if (cli) {
-		cli->type = NETSOCK_RTUNCLI;
-		cli->tid = new_id;
-		netaddr_set(af, addr, port, &cli->u.tuncli.raddr);
-		iobuf_init(&cli->u.tuncli.obuf, 'w', "rtuncli");
-	} else {
+	cli = netsock_alloc(NULL, -1, NULL, 0);
+	if (!cli) {
+		channel_close_tunnel(new_id);
+		return;
+	}
+
+	cli->type    = NETSOCK_RTUNCLI;
+	cli->profile = srv->profile;
+	tunnel_attach(cli, new_id);
+	netaddr_set(af, addr, port, &cli->u.tuncli.raddr);
+	iobuf_init(&cli->u.tuncli.obuf, 'w', "rtuncli");
+	iobuf_spill(&cli->u.tuncli.obuf, tunnel_spill_max());
+
+	// resolve the local hostname off the event loop, the connect is
+	// finished by tunnel_resolve_event once the answer arrives
+	if (resolver_post(cli, srv->u.rtunsrv.lhost, srv->u.rtunsrv.lport,
+							tunnel_resolve_event)) {
 		channel_close_tunnel(new_id);
+		netsock_close(cli);
 	}
 }
 
@@ -396,12 +664,36 @@ void tunnel_revconnect_event(
  */
 int tunnel_write(netsock_t *ns, const void *buf, unsigned int len)
 {
+	int ret;
+	unsigned int before;
+
 	assert(valid_netsock(ns)
 			&& ((ns->type == NETSOCK_TUNCLI) || (ns->type == NETSOCK_RTUNCLI)
 				|| (ns->type == NETSOCK_S5CLI)));
 	trace_tun("len=%u, state=%u", len, ns->state);
 
-	return netsock_write(ns, buf, len);
+	if (ns->state == NETSTATE_RESOLVING) {
+		// no socket yet, queue until the resolver answers
+		++ns->stats.msgs_in;
+		if (!iobuf_append(&ns->u.tuncli.obuf, buf, len))
+			return -1;
+		if (iobuf_datalen(&ns->u.tuncli.obuf) > ns->stats.obuf_hiwat)
+			ns->stats.obuf_hiwat = iobuf_datalen(&ns->u.tuncli.obuf);
+		return 0;
+	}
+
+	before = iobuf_datalen(&ns->u.tuncli.obuf);
+	ret = netsock_write(ns, buf, len);
+	if (ret >= 0) {
+		channel_wndup_consumed(ns,
+					before + len - iobuf_datalen(&ns->u.tuncli.obuf));
+		ns->stats.bytes_out += before + len - iobuf_datalen(&ns->u.tuncli.obuf);
+		if (iobuf_datalen(&ns->u.tuncli.obuf) > ns->stats.obuf_hiwat)
+			ns->stats.obuf_hiwat = iobuf_datalen(&ns->u.tuncli.obuf);
+	}
+	++ns->stats.msgs_in;
+
+	return ret;
 }
 
 /**
@@ -411,10 +703,23 @@ int tunnel_write(netsock_t *ns, const void *buf, unsigned int len)
  */
 int tunnel_write_event(netsock_t *ns)
 {
-	if ((ns->type == NETSOCK_RTUNCLI) && (ns->state != NETSTATE_CONNECTED))
+	int ret;
+	unsigned int before;
+
+	if ((ns->type == NETSOCK_RTUNCLI) && (ns->state != NETSTATE_CONNECTED)) {
 		ns->state = NETSTATE_CONNECTED;
+		netsock_watch_idle(ns);
+	}
+
+	before = iobuf_datalen(&ns->u.tuncli.obuf);
+	ret = netsock_write(ns, NULL, 0);
+	if (ret >= 0) {
+		channel_wndup_consumed(ns,
+					before - iobuf_datalen(&ns->u.tuncli.obuf));
+		ns->stats.bytes_out += before - iobuf_datalen(&ns->u.tuncli.obuf);
+	}
 
-	return netsock_write(ns, NULL, 0);
+	return ret;
 }
 
 /**
@@ -428,7 +733,7 @@ void tunnels_kill_clients(void)
 	list_for_each_safe(ns, bak, &all_sockets) {
 
 		if (ns->type == NETSOCK_RTUNSRV) {
-			ns->tid   = 0xff;
+			tunnel_detach(ns);
 			ns->u.rtunsrv.bound = 0;
 			memset(&ns->addr, 0, sizeof(ns->addr));
 
@@ -447,6 +752,7 @@ void tunnels_restart(void)
 {
 	netsock_t *ns, *bak;
 	const char *rhost;
+	unsigned int tid;
 	unsigned short rport;
 
 	list_for_each_safe(ns, bak, &all_sockets) {
@@ -456,8 +762,9 @@ void tunnels_restart(void)
 			rhost = &ns->u.rtunsrv.lhost[ns->u.rtunsrv.lhost_len];
 			rport = ns->u.rtunsrv.rport;
 
-			ns->tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1);
-			if (ns->tid != 0xff) {
+			tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1);
+			if (tid != R2T_TID_NONE) {
+				tunnel_attach(ns, tid);
 				info(0, "restarted %s:%hu <-- %s:%hu",
 						ns->u.rtunsrv.lhost, ns->u.rtunsrv.lport, rhost, rport);
 			} else {
@@ -469,3 +776,188 @@ void tunnels_restart(void)
 	}
 }
 
+
+/**
+ * check whether tunnel session resume is enabled
+ * @return the grace window in seconds, 0 when disabled
+ */
+int tunnel_resume_enabled(void)
+{
+	const char *env;
+
+	if (resume_grace < 0) {
+		env = getenv("RDP2TCP_RESUME");
+		resume_grace = (env ? atoi(env) : 0);
+		if (resume_grace < 0)
+			resume_grace = 0;
+		env = getenv("RDP2TCP_RESUME_BUF");
+		if (env && (atoi(env) > 0))
+			resume_bufsize = (unsigned int) atoi(env);
+	}
+
+	return resume_grace;
+}
+
+/**
+ * record forwarded payload bytes in the tunnel replay ring
+ * @param[in] ns tunnel socket
+ * @param[in] data forwarded payload
+ * @param[in] len payload size
+ * @note the ring keeps the most recently forwarded bytes so the
+ *       unacknowledged tail can be replayed after a channel blip
+ */
+void tunnel_resume_capture(netsock_t *ns, const void *data, unsigned int len)
+{
+	unsigned int total;
+
+	if (!tunnel_resume_enabled() || (ns->tid == R2T_TID_NONE) || !len)
+		return;
+
+	if (!ns->rsm_on) {
+		iobuf_init(&ns->rsm_buf, 'w', "rsm");
+		ns->rsm_on = 1;
+	}
+	if (ns->rsm_on != 1)
+		return; // ring fell behind, the tunnel lost resumability
+
+	if (len > resume_bufsize) {
+		data = (const char *)data + (len - resume_bufsize);
+		len = resume_bufsize;
+	}
+
+	if (!iobuf_append(&ns->rsm_buf, data, len)) {
+		// a gap in the ring would replay corrupt data; the ring may
+		// already be empty when the very first append fails
+		if (iobuf_datalen(&ns->rsm_buf))
+			iobuf_consume(&ns->rsm_buf, iobuf_datalen(&ns->rsm_buf));
+		ns->rsm_on = 2;
+		return;
+	}
+
+	total = iobuf_datalen(&ns->rsm_buf);
+	if (total > resume_bufsize)
+		iobuf_consume(&ns->rsm_buf, total - resume_bufsize);
+}
+
+/**
+ * grace window expiry, the channel did not come back in time
+ * @param[in] arg unused
+ */
+static void resume_expired(void *arg)
+{
+	info(0, "resume grace window expired, closing tunnel clients");
+	tunnels_frozen = 0;
+	tunnels_kill_clients();
+}
+
+/**
+ * freeze tunnels instead of killing them on channel loss
+ * @return -1 when resume is disabled
+ * @note frozen tunnels are not read (local peers are backpressured
+ *       by their kernel socket buffers) until the channel resyncs
+ *       or the grace window expires
+ */
+int tunnels_freeze(void)
+{
+	if (!tunnel_resume_enabled())
+		return -1;
+
+	info(0, "channel lost, freezing tunnels for %i seconds", resume_grace);
+	tunnels_frozen = 1;
+
+	// messages queued for the dead channel are dropped, the replay
+	// rings re-send lost tunnel payload after the resync
+	channel_drop_queued();
+
+	evtimer_arm(&resume_timer, (unsigned int)resume_grace * 1000,
+					resume_expired, NULL);
+	return 0;
+}
+
+/**
+ * resync frozen tunnels with the reconnected server
+ * @param[in] available 1 if the server advertised R2TCAP_RESUME
+ */
+void tunnels_resume(int available)
+{
+	netsock_t *ns, *bak;
+	unsigned long long seq_in;
+	unsigned int seq[2];
+
+	if (!tunnels_frozen)
+		return;
+
+	evtimer_cancel(&resume_timer);
+	tunnels_frozen = 0;
+
+	if (!available) {
+		info(0, "server cannot resume tunnels");
+		tunnels_kill_clients();
+		tunnels_restart();
+		return;
+	}
+
+	list_for_each_safe(ns, bak, &all_sockets) {
+
+		if ((ns->type != NETSOCK_TUNCLI) && (ns->type != NETSOCK_S5CLI)
+				&& (ns->type != NETSOCK_RTUNCLI))
+			continue;
+
+		// in-flight handshakes cannot be resynced
+		if ((ns->state < NETSTATE_CONNECTED) || (ns->tid == R2T_TID_NONE)) {
+			netsock_close(ns);
+			continue;
+		}
+
+		// stale flow-control state, the server re-acknowledges
+		// replayed data
+		ns->wnd_used = 0;
+		ns->wnd_ack  = 0;
+		ns->rsm_wait = 1;
+
+		seq_in = ns->stats.bytes_out + iobuf_datalen(&ns->u.tuncli.obuf);
+		seq[0] = htonl((unsigned int)(seq_in >> 32));
+		seq[1] = htonl((unsigned int) seq_in);
+		channel_write_msg(R2TCMD_RESUME, ns->tid, seq, 8);
+	}
+}
+
+/**
+ * handle a R2TCMD_RESUME answer from the rdp2tcp server
+ * @param[in] tid tunnel identifier
+ * @param[in] err R2TERR_xxx status, the tunnel is gone when non-zero
+ * @param[in] srv_seq payload bytes the server safely received
+ */
+void tunnel_resume_event(unsigned int tid, int err, unsigned long long srv_seq)
+{
+	netsock_t *ns;
+	char *ptr;
+	unsigned long long seq_out;
+	unsigned int delta, avail, chunk;
+
+	ns = tunnel_lookup(tid);
+	if (!ns)
+		return;
+
+	ns->rsm_wait = 0;
+	seq_out = ns->stats.bytes_in;
+	avail = ((ns->rsm_on == 1) ? iobuf_datalen(&ns->rsm_buf) : 0);
+
+	if (err || (srv_seq > seq_out) || (seq_out - srv_seq > avail)) {
+		info(0, "tunnel 0x%02x not resumable, closing", tid);
+		tunnel_close(ns, err ? 0 : 1);
+		return;
+	}
+
+	delta = (unsigned int)(seq_out - srv_seq);
+	info(0, "resumed tunnel 0x%02x, replaying %u bytes", tid, delta);
+
+	ptr = (char *) iobuf_dataptr(&ns->rsm_buf) + (avail - delta);
+	while (delta > 0) {
+		chunk = (delta > NETBUF_MAX_SIZE ? NETBUF_MAX_SIZE : delta);
+		if (channel_write_msg(R2TCMD_DATA, tid, ptr, chunk))
+			break;
+		ptr += chunk;
+		delta -= chunk;
+	}
+}
@@ -0,0 +1,218 @@
+/**
+ * @file compress.c
+ * R2TCMD_ZDATA payload compression (byte-oriented LZ77)
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "compress.h"
+
+#include <string.h>
+
+/*
+ * encoded stream format (LZF-like):
+ *   000LLLLL               literal run of L+1 bytes
+ *   LLLOOOOO OOOOOOOO      backref, length L+2 (L < 7), offset O+1
+ *   111OOOOO LLLLLLLL OOOOOOOO  backref, length L+9, offset O+1
+ */
+
+#define ZHASH_LOG  13
+#define ZHASH_SIZE (1u << ZHASH_LOG)
+
+#define ZMAX_OFF 8192
+#define ZMAX_REF ((1 << 8) + 8)
+#define ZMAX_LIT 32
+
+/** 3-byte match candidate index (single-threaded) */
+static const unsigned char *htab[ZHASH_SIZE];
+
+static unsigned int zhash(const unsigned char *p)
+{
+	unsigned int v;
+
+	v = (p[0] << 16) | (p[1] << 8) | p[2];
+	return ((v >> (24 - ZHASH_LOG)) - (v * 5)) & (ZHASH_SIZE - 1);
+}
+
+/**
+ * compress a buffer
+ * @param[in] src input buffer
+ * @param[in] slen input buffer size
+ * @param[out] dst output buffer
+ * @param[in] dlen output buffer size
+ * @return compressed size or 0 if the input does not
+ *         compress within dlen bytes
+ */
+unsigned int r2t_compress(
+				const void *src,
+				unsigned int slen,
+				void *dst,
+				unsigned int dlen)
+{
+	const unsigned char *in, *in_end, *ip, *ref;
+	unsigned char *op, *out_end, *lit_ctrl;
+	unsigned int hval, lit, len, max_len, off;
+
+	if (slen < 4)
+		return 0;
+
+	in      = (const unsigned char *) src;
+	in_end  = in + slen;
+	ip      = in;
+	op      = (unsigned char *) dst;
+	out_end = op + dlen;
+
+	memset(htab, 0, sizeof(htab));
+
+	lit_ctrl = op++;
+	lit = 0;
+
+	while (ip + 2 < in_end) {
+
+		hval = zhash(ip);
+		ref  = htab[hval];
+		htab[hval] = ip;
+
+		// stale entries may point into previous buffers, range-check first
+		if (ref && (ref >= in) && (ref < ip)
+				&& ((unsigned int)(ip - ref) <= ZMAX_OFF)
+				&& (ref[0] == ip[0]) && (ref[1] == ip[1]) && (ref[2] == ip[2])) {
+
+			max_len = (unsigned int)(in_end - ip);
+			if (max_len > ZMAX_REF)
+				max_len = ZMAX_REF;
+
+			len = 3;
+			while ((len < max_len) && (ref[len] == ip[len]))
+				++len;
+
+			off = (unsigned int)(ip - ref) - 1;
+
+			if (lit)
+				*lit_ctrl = lit - 1;
+			else
+				op = lit_ctrl; // drop the unused literal control byte
+
+			if (op + 4 > out_end)
+				return 0;
+
+			if (len <= 8) {
+				*op++ = ((len - 2) << 5) | (off >> 8);
+			} else {
+				*op++ = (7 << 5) | (off >> 8);
+				*op++ = len - 9;
+			}
+			*op++ = off & 0xff;
+
+			ip += len;
+			lit_ctrl = op++;
+			lit = 0;
+
+		} else {
+			if (op + 2 > out_end)
+				return 0;
+			*op++ = *ip++;
+			if (++lit == ZMAX_LIT) {
+				*lit_ctrl = lit - 1;
+				lit_ctrl  = op++;
+				lit = 0;
+			}
+		}
+	}
+
+	while (ip < in_end) {
+		if (op + 2 > out_end)
+			return 0;
+		*op++ = *ip++;
+		if (++lit == ZMAX_LIT) {
+			*lit_ctrl = lit - 1;
+			lit_ctrl  = op++;
+			lit = 0;
+		}
+	}
+
+	if (lit)
+		*lit_ctrl = lit - 1;
+	else
+		op = lit_ctrl;
+
+	return (unsigned int)(op - (unsigned char *)dst);
+}
+
+/**
+ * decompress a buffer
+ * @param[in] src compressed buffer
+ * @param[in] slen compressed buffer size
+ * @param[out] dst output buffer
+ * @param[in] dlen output buffer size
+ * @return decompressed size or -1 if the stream is corrupted
+ */
+int r2t_decompress(
+			const void *src,
+			unsigned int slen,
+			void *dst,
+			unsigned int dlen)
+{
+	const unsigned char *ip, *in_end;
+	unsigned char *op, *out_end, *ref;
+	unsigned int ctrl, len, off;
+
+	ip      = (const unsigned char *) src;
+	in_end  = ip + slen;
+	op      = (unsigned char *) dst;
+	out_end = op + dlen;
+
+	while (ip < in_end) {
+
+		ctrl = *ip++;
+
+		if (ctrl < 32) { // literal run
+			len = ctrl + 1;
+			if ((ip + len > in_end) || (op + len > out_end))
+				return -1;
+			memcpy(op, ip, len);
+			op += len;
+			ip += len;
+
+		} else { // backref
+			len = ctrl >> 5;
+			if (len == 7) {
+				if (ip >= in_end)
+					return -1;
+				len += *ip++;
+			}
+			len += 2;
+
+			if (ip >= in_end)
+				return -1;
+			off = ((ctrl & 0x1f) << 8) | *ip++;
+
+			ref = op - off - 1;
+			if ((ref < (unsigned char *)dst) || (op + len > out_end))
+				return -1;
+
+			// backrefs may overlap their output, copy byte per byte
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	return (int)(op - (unsigned char *)dst);
+}
+
+// vim: ts=3 sw=3
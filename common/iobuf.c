@@ -26,10 +26,307 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
-#ifdef DEBUG
+#ifndef _WIN32
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#elif defined(DEBUG)
 #include <stdio.h>
 #endif
 
+/** geometric growth ceiling, larger buffers grow linearly */
+#define IOBUF_MAX_GROW (128*1024)
+/** consecutive mostly-empty drains before a buffer gives memory back */
+#define IOBUF_SHRINK_IDLE 8
+
+/** recycling size classes (IOBUF_MIN_SIZE << class, up to the ceiling) */
+#define IOBUF_CACHE_CLASSES 7
+/** recycled backing buffers kept per size class */
+#define IOBUF_CACHE_SLOTS 4
+
+/** cache of freed backing buffers, reused by iobuf_reserve;
+ * geometric growth keeps sizes power-of-two so a buffer maps to
+ * exactly one class and reuse is a pointer swap, not a realloc */
+static char *iobuf_cache[IOBUF_CACHE_CLASSES][IOBUF_CACHE_SLOTS];
+
+#ifndef _WIN32
+/** initial disk ring size, doubled as the backlog grows */
+#define IOBUF_SPILL_MIN (256*1024)
+
+/** disk-backed overflow ring, backed by an unlinked mmap'd temp file */
+struct iobuf_spill {
+	int fd;            /**< backing temp file, unlinked at creation */
+	char *map;         /**< mapped ring */
+	unsigned int cap;  /**< mapped size */
+	unsigned int off;  /**< offset of the oldest spilled byte */
+	unsigned int used; /**< spilled bytes pending */
+};
+
+/**
+ * create the disk ring backing a spilling buffer
+ * @return NULL if the temp file cannot be created or mapped
+ */
+static struct iobuf_spill *iobuf_spill_open(void)
+{
+	struct iobuf_spill *sp;
+	const char *dir;
+	char path[256];
+	int fd;
+
+	dir = getenv("TMPDIR");
+	if (!dir)
+		dir = "/tmp";
+	snprintf(path, sizeof(path), "%s/rdp2tcp-XXXXXX", dir);
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return NULL;
+	unlink(path);
+
+	sp = calloc(1, sizeof(*sp));
+	if (!sp || ftruncate(fd, IOBUF_SPILL_MIN)) {
+		free(sp);
+		close(fd);
+		return NULL;
+	}
+
+	sp->map = mmap(NULL, IOBUF_SPILL_MIN, PROT_READ|PROT_WRITE,
+						MAP_SHARED, fd, 0);
+	if (sp->map == MAP_FAILED) {
+		free(sp);
+		close(fd);
+		return NULL;
+	}
+
+	sp->fd  = fd;
+	sp->cap = IOBUF_SPILL_MIN;
+
+	return sp;
+}
+
+/**
+ * release the disk ring of a spilling buffer
+ * @param[in] buf I/O buffer
+ */
+static void iobuf_spill_close(iobuf_t *buf)
+{
+	struct iobuf_spill *sp;
+
+	sp = buf->spill;
+	if (sp) {
+		munmap(sp->map, sp->cap);
+		close(sp->fd);
+		free(sp);
+		buf->spill = NULL;
+	}
+}
+
+/**
+ * grow the disk ring
+ * @param[in] sp disk ring
+ * @param[in] want minimal capacity
+ * @return -1 if the file cannot be extended or remapped
+ */
+static int iobuf_spill_grow(struct iobuf_spill *sp, unsigned int want)
+{
+	unsigned int cap, wrapped;
+	char *map;
+
+	cap = sp->cap;
+	while (cap < want)
+		cap <<= 1;
+
+	if (ftruncate(sp->fd, cap))
+		return -1;
+
+	map = mmap(NULL, cap, PROT_READ|PROT_WRITE, MAP_SHARED, sp->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	munmap(sp->map, sp->cap);
+
+	// the capacity at least doubled so the wrapped prefix fits
+	// right after the old end, making the pending data linear again
+	wrapped = ((sp->off + sp->used > sp->cap)
+					? sp->off + sp->used - sp->cap : 0);
+	if (wrapped)
+		memcpy(map + sp->cap, map, wrapped);
+
+	sp->map = map;
+	sp->cap = cap;
+
+	return 0;
+}
+
+/**
+ * append overflow data to the disk ring
+ * @param[in] buf I/O buffer past its in-memory ceiling
+ * @param[in] data content to append
+ * @param[in] size size of data to append
+ * @return pointer where data have been written or NULL on error
+ */
+static void *iobuf_spill_write(iobuf_t *buf, const void *data,
+										unsigned int size)
+{
+	struct iobuf_spill *sp;
+	unsigned int pos, contig;
+	void *ptr;
+
+	if (!buf->spill) {
+		buf->spill = iobuf_spill_open();
+		if (!buf->spill)
+			return NULL;
+	}
+	sp = buf->spill;
+
+	if ((sp->used + size > sp->cap)
+			&& iobuf_spill_grow(sp, sp->used + size))
+		return NULL;
+
+	pos = sp->off + sp->used;
+	if (pos >= sp->cap)
+		pos -= sp->cap;
+	ptr = sp->map + pos;
+
+	contig = sp->cap - pos;
+	if (size <= contig) {
+		memcpy(ptr, data, size);
+	} else {
+		memcpy(ptr, data, contig);
+		memcpy(sp->map, ((const char *)data) + contig, size - contig);
+	}
+	sp->used += size;
+
+	trace_iobuf("[%c] %s, spilled=%u, pending=%u",
+					buf->type, buf->name, size, sp->used);
+
+	return ptr;
+}
+
+/**
+ * move spilled data back in memory after a drain
+ * @param[in] buf I/O buffer
+ * @param[in] size maximal size to move back
+ * @note bounded by the drained size so the in-memory tail never grows
+ *       past where it stood before the drain
+ */
+static void iobuf_spill_refill(iobuf_t *buf, unsigned int size)
+{
+	struct iobuf_spill *sp;
+	unsigned int len;
+	void *ptr;
+
+	sp = buf->spill;
+
+	while (size && sp->used) {
+		len = (size < sp->used ? size : sp->used);
+		if (len > sp->cap - sp->off)
+			len = sp->cap - sp->off;
+
+		ptr = iobuf_reserve(buf, len, NULL);
+		if (!ptr)
+			return; // keep the data on disk until the next drain
+		memcpy(ptr, sp->map + sp->off, len);
+		iobuf_commit(buf, len);
+
+		sp->off += len;
+		if (sp->off == sp->cap)
+			sp->off = 0;
+		sp->used -= len;
+		size -= len;
+	}
+
+	// the backlog is gone, give the disk space back
+	if (!sp->used)
+		iobuf_spill_close(buf);
+}
+#endif
+
+/**
+ * enable the disk-backed overflow tier on an I/O buffer
+ * @param[in] buf I/O buffer
+ * @param[in] max in-memory ceiling in bytes, 0 disables spilling
+ * @note the backing temp file is only created once the ceiling is hit
+ */
+void iobuf_spill(iobuf_t *buf, unsigned int max)
+{
+	assert_iobuf(buf);
+
+#ifndef _WIN32
+	buf->spill_max = max;
+#else
+	(void) max; // no overflow tier without mmap
+#endif
+}
+
+/**
+ * map an allocated size to its recycling class
+ * @param[in] total allocated size
+ * @return -1 for odd sizes which are not recycled
+ */
+static int iobuf_cache_class(unsigned int total)
+{
+	unsigned int i, sz;
+
+	for (i=0, sz=IOBUF_MIN_SIZE; i<IOBUF_CACHE_CLASSES; ++i, sz<<=1) {
+		if (total == sz)
+			return (int) i;
+	}
+
+	return -1;
+}
+
+/**
+ * recycle a backing buffer
+ * @param[in] data buffer to recycle
+ * @param[in] total allocated size
+ * @return -1 if the buffer cannot be cached and must be freed
+ */
+static int iobuf_cache_put(char *data, unsigned int total)
+{
+	unsigned int i;
+	int cls;
+
+	cls = iobuf_cache_class(total);
+	if (cls < 0)
+		return -1;
+
+	for (i=0; i<IOBUF_CACHE_SLOTS; ++i) {
+		if (!iobuf_cache[cls][i]) {
+			iobuf_cache[cls][i] = data;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * fetch a recycled backing buffer
+ * @param[in] size minimal buffer size
+ * @param[out] total will hold the allocated size
+ * @return NULL if no cached buffer is large enough
+ */
+static char *iobuf_cache_get(unsigned int size, unsigned int *total)
+{
+	unsigned int i, cls, sz;
+	char *data;
+
+	for (cls=0, sz=IOBUF_MIN_SIZE; cls<IOBUF_CACHE_CLASSES; ++cls, sz<<=1) {
+		if (sz < size)
+			continue;
+		for (i=0; i<IOBUF_CACHE_SLOTS; ++i) {
+			if (iobuf_cache[cls][i]) {
+				data = iobuf_cache[cls][i];
+				iobuf_cache[cls][i] = NULL;
+				*total = sz;
+				return data;
+			}
+		}
+	}
+
+	return NULL;
+}
+
 /**
  * @brief initialize I/O buffer
  * @param[out] buf buffer to initialize
@@ -43,8 +340,13 @@ void __iobuf_init(iobuf_t *buf
 	assert(buf);
 
 	buf->data  = NULL;
+	buf->start = 0;
 	buf->size  = 0;
 	buf->total = 0;
+	buf->peak  = 0;
+	buf->idle  = 0;
+	buf->spill_max = 0;
+	buf->spill = NULL;
 #ifdef DEBUG
 	buf->name  = name;
 	buf->type  = type;
@@ -86,8 +388,11 @@ void iobuf_kill(iobuf_t *buf)
 	assert_iobuf(buf);
 	trace_iobuf("[%c] %s", buf->type, buf->name);
 
-	if (buf->data)
+	if (buf->data && iobuf_cache_put(buf->data, buf->total))
 		free(buf->data);
+#ifndef _WIN32
+	iobuf_spill_close(buf);
+#endif
 }
 
 /**
@@ -107,6 +412,7 @@ void iobuf_kill2(iobuf_t *ibuf, iobuf_t *obuf)
  * @brief consume data in an I/O buffer
  * @param[in] buf I/O buffer where data will be consumed
  * @param[in] consumed size of consumed data
+ * @note O(1), the head offset is advanced without moving the remainder
  */
 void iobuf_consume(iobuf_t *buf, unsigned int consumed)
 {
@@ -118,10 +424,34 @@ void iobuf_consume(iobuf_t *buf, unsigned int consumed)
 	trace_iobuf("[%c] %s, consumed=%u, remaining=%u",
 					buf->type, buf->name, consumed, size);
 
-	if (size)
-		memmove(buf->data, buf->data + consumed, size);
-
 	buf->size = size;
+	buf->start = (size ? buf->start + consumed : 0);
+
+#ifndef _WIN32
+	// stream spilled payload back as the consumer drains so the
+	// in-memory tail never runs dry while overflow is pending
+	if (buf->spill && buf->spill->used) {
+		iobuf_spill_refill(buf, consumed);
+		size = buf->size;
+	}
+#endif
+
+	// shrink-on-idle: a buffer repeatedly drained while using a
+	// fraction of its allocation gives its backing memory back
+	if (!size) {
+		if ((buf->total > IOBUF_MIN_SIZE) && (buf->peak <= buf->total/4)) {
+			if (++buf->idle >= IOBUF_SHRINK_IDLE) {
+				if (iobuf_cache_put(buf->data, buf->total))
+					free(buf->data);
+				buf->data  = NULL;
+				buf->total = 0;
+				buf->idle  = 0;
+			}
+		} else {
+			buf->idle = 0;
+		}
+		buf->peak = 0;
+	}
 }
 
 /**
@@ -134,12 +464,12 @@ void iobuf_consume(iobuf_t *buf, unsigned int consumed)
  */
 void *iobuf_reserve(iobuf_t *buf, unsigned int size, unsigned int *reserved)
 {
-	unsigned int avail;
+	unsigned int avail, want, total;
 	void *bak, *data;
 
 	assert(valid_iobuf(buf) && (size || reserved));
 
-	avail = buf->total - buf->size;
+	avail = buf->total - buf->start - buf->size;
 
 	if (!size)
 		size = IOBUF_MIN_SIZE;
@@ -148,18 +478,43 @@ void *iobuf_reserve(iobuf_t *buf, unsigned int size, unsigned int *reserved)
 					buf->type, buf->name, size, avail);
 
 	if (size > avail) {
-		bak = buf->data;
-		data = realloc(bak, buf->size + size);
-		if (!data)
-			return NULL;
-		buf->data = data;
-		buf->total = buf->size + size;
+
+		// reclaim the hole left by consumed data before growing
+		if (buf->start > 0) {
+			if (buf->size)
+				memmove(buf->data, buf->data + buf->start, buf->size);
+			buf->start = 0;
+			avail = buf->total - buf->size;
+		}
+
+		if (size > avail) {
+			want = buf->size + size;
+			// fresh buffers are served from the recycling cache first
+			if (!buf->data
+					&& (data = iobuf_cache_get(want, &buf->total)) != NULL) {
+				buf->data = data;
+			} else {
+				// double up to the ceiling so bursts cost O(log n)
+				// reallocs, odd-sized giants grow linearly
+				total = (buf->total ? buf->total : IOBUF_MIN_SIZE);
+				while ((total < want) && (total < IOBUF_MAX_GROW))
+					total <<= 1;
+				if (total < want)
+					total = want;
+				bak = buf->data;
+				data = realloc(bak, total);
+				if (!data)
+					return NULL;
+				buf->data = data;
+				buf->total = total;
+			}
+		}
 	}
 
 	if (reserved)
 		*reserved = size;
 
-	return buf->data + buf->size;
+	return buf->data + buf->start + buf->size;
 }
 
 /**
@@ -171,11 +526,13 @@ void *iobuf_reserve(iobuf_t *buf, unsigned int size, unsigned int *reserved)
 void iobuf_commit(iobuf_t *buf, unsigned int commited)
 {
 	assert(valid_iobuf(buf) && (commited > 0)
-				&& (commited <= (buf->total - buf->size)));
+				&& (commited <= (buf->total - buf->start - buf->size)));
 	trace_iobuf("[%c] %s, commited=%u, total=%u, size=%u",
 			buf->type, buf->name, commited, buf->total, buf->size);
 
 	buf->size += commited;
+	if (buf->size > buf->peak)
+		buf->peak = buf->size;
 }
 
 /**
@@ -193,6 +550,16 @@ void *iobuf_append(iobuf_t *buf, const void *data, unsigned int size)
 	assert(valid_iobuf(buf) && data && size);
 	trace_iobuf("[%c] %s, size=%u", buf->type, buf->name, size);
 
+#ifndef _WIN32
+	// overflow tier: beyond the in-memory ceiling (or while spilled
+	// payload is already pending, to preserve ordering) data goes to
+	// the disk ring instead of growing the allocation
+	if (buf->spill_max
+			&& ((buf->spill && buf->spill->used)
+				|| (buf->size + size > buf->spill_max)))
+		return iobuf_spill_write(buf, data, size);
+#endif
+
 	ptr = iobuf_reserve(buf, size, NULL);
 	if (!ptr)
 		return NULL;
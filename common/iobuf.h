@@ -26,10 +26,15 @@
 #define IOBUF_MIN_SIZE 2048
 #endif
 
-/** I/O buffer */
+/** I/O buffer (head-offset ring, data lives in [start, start+size[) */
 typedef struct iobuf {
+	unsigned int start; /**< offset of first used byte */
 	unsigned int size;  /**< used size */
 	unsigned int total; /**< allocated size */
+	unsigned int peak;  /**< largest used size since the last drain */
+	unsigned char idle; /**< consecutive mostly-empty drains */
+	unsigned int spill_max;    /**< in-memory ceiling, 0 if spilling disabled */
+	struct iobuf_spill *spill; /**< disk-backed overflow ring (lazy) */
 	char *data;         /**< data buffer */
 #ifdef DEBUG
 	const char *name;
@@ -39,7 +44,8 @@ typedef struct iobuf {
 
 #ifdef DEBUG
 #define valid_iobuf(x) \
-	((x) && (((x)->size <= (x)->total) && ((x)->data || !((x)->total))) \
+	((x) && ((((x)->start + (x)->size) <= (x)->total) \
+	 && ((x)->data || !((x)->total))) \
 	 && (x)->name && (((x)->type == 'r') || (x)->type == 'w'))
 void iobuf_dump(iobuf_t *);
 void __iobuf_init(iobuf_t *, char, const char *);
@@ -49,7 +55,8 @@ void __iobuf_init2(iobuf_t *, iobuf_t *, const char *);
 
 #else
 #define valid_iobuf(x) \
-	((x) && (((x)->size <= (x)->total) && ((x)->data || !((x)->total))))
+	((x) && ((((x)->start + (x)->size) <= (x)->total) \
+	 && ((x)->data || !((x)->total))))
 void __iobuf_init(iobuf_t *);
 void __iobuf_init2(iobuf_t *, iobuf_t *);
 #define iobuf_init(buf, type, name) __iobuf_init(buf)
@@ -72,12 +79,12 @@ static inline unsigned int iobuf_datalen(iobuf_t *buf)
 
 static inline void *iobuf_dataptr(iobuf_t *buf)
 {
-	return buf->size ? buf->data : 0;
+	return buf->size ? buf->data + buf->start : 0;
 }
 
 static inline void *iobuf_allocptr(iobuf_t *buf)
 {
-	return ((char *)buf->data) + buf->size;
+	return ((char *)buf->data) + buf->start + buf->size;
 }
 
 void iobuf_consume(iobuf_t *, unsigned int);
@@ -85,6 +92,7 @@ void iobuf_consume(iobuf_t *, unsigned int);
 void *iobuf_reserve(iobuf_t *, unsigned int, unsigned int *);
 void iobuf_commit(iobuf_t *, unsigned int);
 void *iobuf_append(iobuf_t *, const void *, unsigned int);
+void iobuf_spill(iobuf_t *, unsigned int);
 //void iobuf_xfer(iobuf_t *, iobuf_t *);
 
 #endif
@@ -0,0 +1,81 @@
+/**
+ * @file lathist.c
+ * latency histograms for pipeline tracing
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "lathist.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+
+/**
+ * get the current time with microsecond resolution
+ * @return time since the epoch (usecs)
+ */
+unsigned long long lathist_now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((unsigned long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/**
+ * account a duration sample
+ * @param[in,out] h latency histogram
+ * @param[in] usecs measured duration (usecs)
+ */
+void lathist_add(lathist_t *h, unsigned long long usecs)
+{
+	unsigned int i;
+
+	for (i=0; (i < LATHIST_BUCKETS-1) && (usecs >= (1ULL << i)); ++i)
+		;
+	++h->count[i];
+}
+
+/**
+ * format the non-empty buckets of a histogram
+ * @param[in] h latency histogram
+ * @param[out] buf output buffer
+ * @param[in] size output buffer size
+ * @return number of characters written
+ * @note each bucket prints as "<bound-usecs>=<count>"
+ */
+int lathist_format(const lathist_t *h, char *buf, unsigned int size)
+{
+	unsigned int i;
+	int ret, len;
+
+	len = 0;
+	if (size)
+		buf[0] = 0;
+	for (i=0; i<LATHIST_BUCKETS; ++i) {
+		if (!h->count[i])
+			continue;
+		ret = snprintf(buf+len, size-len, " %u=%u", 1 << i, h->count[i]);
+		if ((ret < 0) || ((unsigned int)ret >= size-len))
+			break;
+		len += ret;
+	}
+
+	return len;
+}
+// vim: ts=3 sw=3
@@ -0,0 +1,36 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __LATHIST_H__
+#define __LATHIST_H__
+
+/** number of latency histogram buckets */
+#define LATHIST_BUCKETS 16
+
+/** power-of-two latency histogram, bucket i counts durations
+ * below 2^i microseconds */
+typedef struct _lathist {
+	unsigned int count[LATHIST_BUCKETS];
+} lathist_t;
+
+unsigned long long lathist_now_us(void);
+void lathist_add(lathist_t *, unsigned long long);
+int lathist_format(const lathist_t *, char *, unsigned int);
+
+#endif
+// vim: ts=3 sw=3
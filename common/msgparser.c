@@ -34,6 +34,34 @@
 extern int debug_level;
 extern const cmdhandler_t cmd_handlers[];
 
+/** 16-bit tunnel identifiers negotiated for incoming messages */
+int r2t_tid16_in;
+/** 16-bit tunnel identifiers negotiated for outgoing messages */
+int r2t_tid16_out;
+
+/**
+ * write a message header with the negotiated framing
+ * @param[in] ptr output buffer (at least 3 bytes)
+ * @param[in] cmd rdp2tcp command (R2TCMD_xxx)
+ * @param[in] tid tunnel identifier
+ * @return the header size
+ * @note R2TCMD_HELLO headers are written by the channel code itself
+ *       since they always keep the 1-byte identifier
+ */
+unsigned int r2t_hdr_write(void *ptr, unsigned char cmd, unsigned int tid)
+{
+	unsigned char *hdr = ptr;
+
+	hdr[0] = cmd;
+	if (!r2t_tid16_out) {
+		hdr[1] = (unsigned char) tid;
+		return 2;
+	}
+	hdr[1] = (unsigned char)(tid >> 8);
+	hdr[2] = (unsigned char)(tid & 0xff);
+	return 3;
+}
+
 /**
  * parse rdp2tcp commands and call specific handlers
  * @param[in] ibuf input buffer
@@ -42,14 +70,20 @@ extern const cmdhandler_t cmd_handlers[];
 int commands_parse(iobuf_t *ibuf)
 {
 	unsigned char cmd, *data;
-	unsigned int off, msg_len, avail;
+	unsigned int off, msg_len, avail, hdr_len, tid, body_len;
 	static const unsigned char r2t_min_size[R2TCMD_MAX] = {
-		3, // R2TCMD_CONN
-		2, // R2TCMD_CLOSE
-		2, // R2TCMD_DATA
-		1, // R2TCMD_PING
-		3, // R2TCMD_BIND
-		2  // R2TCMD_RCONN
+		1, // R2TCMD_CONN
+		0, // R2TCMD_CLOSE
+		0, // R2TCMD_DATA
+		0, // R2TCMD_PING
+		1, // R2TCMD_BIND
+		0, // R2TCMD_RCONN
+		1, // R2TCMD_HELLO
+		5, // R2TCMD_ZDATA
+		4, // R2TCMD_WNDUP
+		9, // R2TCMD_UDATA
+		0, // R2TCMD_LATSTAT
+		8  // R2TCMD_RESUME
 	};
 
 	assert(valid_iobuf(ibuf) && (iobuf_datalen(ibuf)>0));
@@ -79,15 +113,30 @@ int commands_parse(iobuf_t *ibuf)
 		if (cmd >= R2TCMD_MAX)
 			return error("invalid command id 0x%02x", cmd);
 
-		if (msg_len < (unsigned int)r2t_min_size[cmd])
-			return error("command 0x%02x too short 0x%08x < 0x%08x", 
-					cmd, msg_len, (unsigned int)r2t_min_size[cmd]);
+		// R2TCMD_HELLO keeps the 1-byte identifier, it drives the
+		// framing negotiation itself
+		hdr_len = ((r2t_tid16_in && (cmd != R2TCMD_HELLO)) ? 3 : 2);
+		if (msg_len >= hdr_len) {
+			tid = data[off+1];
+			if (hdr_len == 3)
+				tid = (tid << 8) | data[off+2];
+			body_len = msg_len - hdr_len;
+		} else {
+			// a bare R2TCMD_PING may omit the identifier
+			tid = 0;
+			body_len = 0;
+			hdr_len = msg_len;
+		}
+
+		if (body_len < (unsigned int)r2t_min_size[cmd])
+			return error("command 0x%02x too short 0x%08x < 0x%08x",
+					cmd, body_len, (unsigned int)r2t_min_size[cmd]);
 
 		if (!cmd_handlers[cmd])
 			return error("command 0x%02x not supported", cmd);
 
 		// call specific command handler
-		if (cmd_handlers[cmd]((const r2tmsg_t*)(data+off), msg_len))
+		if (cmd_handlers[cmd](tid, data+off+hdr_len, body_len))
 			return -1;
 
 		off += msg_len;
@@ -21,8 +21,23 @@
 
 #include "rdp2tcp.h"
 
-typedef int (*cmdhandler_t)(const r2tmsg_t *, unsigned int);
+/** command handler called by commands_parse with the decoded tunnel
+ * identifier and the message body following it
+ * @note the body points into the channel input buffer and is only
+ *       valid for the duration of the call; handlers may write the
+ *       payload straight to a socket (the zero-copy forward path) but
+ *       must copy whatever they queue past their return */
+typedef int (*cmdhandler_t)(unsigned int, const void *, unsigned int);
 
+/** 16-bit tunnel identifiers negotiated for incoming messages */
+extern int r2t_tid16_in;
+/** 16-bit tunnel identifiers negotiated for outgoing messages */
+extern int r2t_tid16_out;
+
+/** size of the command + tunnel identifier header written out */
+#define r2t_hdr_len() ((unsigned int)(r2t_tid16_out ? 3 : 2))
+
+unsigned int r2t_hdr_write(void *, unsigned char, unsigned int);
 int commands_parse(iobuf_t *);
 
 #endif
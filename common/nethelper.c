@@ -24,15 +24,32 @@
 #include "debug.h"
 
 #include <stdio.h>
-#ifndef _WIN32
 #include <string.h>
+#ifndef _WIN32
 #include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
 #endif
 
+/**
+ * get a millisecond timestamp for connect latency statistics
+ */
+unsigned long long net_now_ms(void)
+{
+#ifndef _WIN32
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((unsigned long long)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+#else
+	return GetTickCount();
+#endif
+}
+
 #ifndef _WIN32
 #define nethelper_error errno
 #define nethelper_badsock -1
@@ -320,6 +337,134 @@ int net_client(
 	return netres(2, pref_af, host, port, out_sock, addr, err);
 }
 
+/**
+ * parse a socket tuning profile name
+ * @param[in] name profile name
+ * @return NETPROF_xxx profile, -1 if the name is unknown
+ */
+int net_profile(const char *name)
+{
+	if (!strcmp(name, "default"))
+		return NETPROF_DEFAULT;
+	if (!strcmp(name, "interactive"))
+		return NETPROF_INTERACTIVE;
+	if (!strcmp(name, "bulk"))
+		return NETPROF_BULK;
+	return -1;
+}
+
+/**
+ * apply a socket tuning profile
+ * @param[in] sock connected or connecting socket
+ * @param[in] profile NETPROF_xxx profile
+ * @note best effort, a refused option keeps the kernel default
+ */
+void net_tune(sock_t *sock, int profile)
+{
+	int n;
+#ifndef _WIN32
+	int fd = *sock;
+#else
+	SOCKET fd = sock->fd;
+#endif
+
+	switch (profile) {
+
+		case NETPROF_INTERACTIVE:
+			// forwarded chatter must not wait on Nagle coalescing
+			n = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+							(const void *)&n, sizeof(n));
+			break;
+
+		case NETPROF_BULK:
+			// large kernel buffers so a high-BDP path can stay full
+			n = NETPROF_BULK_BUFSIZE;
+			setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+							(const void *)&n, sizeof(n));
+			setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+							(const void *)&n, sizeof(n));
+			break;
+	}
+}
+
+/**
+ * connect a socket client to an already-resolved address
+ * @param[in] addr peer network address
+ * @param[out] out_sock connected socket
+ * @param[out] err system error code on failure
+ * @return -1 on error, 0 on success, 1 if connection is pending
+ */
+int net_connect(const netaddr_t *addr, sock_t *out_sock, int *err)
+{
+#ifndef _WIN32
+	int fd;
+#else
+	SOCKET fd;
+	WSAEVENT evt;
+#endif
+	socklen_t addrlen;
+
+	assert(addr && out_sock && err
+			&& ((netaddr_af(addr) == AF_INET) || (netaddr_af(addr) == AF_INET6)));
+	*err = 0;
+
+	addrlen = (netaddr_af(addr) == AF_INET
+					? sizeof(addr->ip4) : sizeof(addr->ip6));
+
+	fd = socket(netaddr_af(addr), SOCK_STREAM, 0);
+	if (fd == nethelper_badsock) {
+		*err = nethelper_error;
+		return NETERR_SOCKET;
+	}
+
+#ifndef _WIN32
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+
+	if (!connect(fd, (const struct sockaddr *)addr, addrlen)) {
+		*out_sock = fd;
+		return 0;
+	}
+
+	if (net_pending()) {
+		*out_sock = fd;
+		return 1;
+	}
+
+	*err = nethelper_error;
+	close_sock(fd);
+	return NETERR_CONNECT;
+
+#else
+	evt = WSACreateEvent();
+	if (evt == WSA_INVALID_EVENT) {
+		*err = nethelper_error;
+		close_sock(fd);
+		return NETERR_SOCKET;
+	}
+
+	if (!WSAEventSelect(fd, evt, FD_CONNECT|FD_CLOSE)) {
+
+		if (!connect(fd, (const struct sockaddr *)addr, addrlen)) {
+			if (!WSAEventSelect(fd, evt, FD_READ|FD_CLOSE)) {
+				out_sock->fd  = fd;
+				out_sock->evt = evt;
+				return 0;
+			}
+		} else if (net_pending()) {
+			out_sock->fd  = fd;
+			out_sock->evt = evt;
+			return 1;
+		}
+	}
+
+	*err = nethelper_error;
+	WSACloseEvent(evt);
+	close_sock(fd);
+	return NETERR_CONNECT;
+#endif
+}
+
 /**
  * accept a client connection
  * @param[in] srv the server socket
@@ -69,6 +69,19 @@ int net_update_watch(sock_t *, iobuf_t *);
 #define NETBUF_MAX_SIZE (1024*16)
 #endif
 
+/** hot-path tunnel I/O counters (plain unlocked increments) */
+typedef struct _netstats {
+	unsigned long long bytes_in;  /**< payload bytes read from the local peer */
+	unsigned long long bytes_out; /**< payload bytes written to the local peer */
+	unsigned long long msgs_in;   /**< channel messages received */
+	unsigned long long msgs_out;  /**< channel messages sent */
+	unsigned int obuf_hiwat;      /**< output buffer high-water mark */
+	unsigned int connect_ms;      /**< observed connect latency (msec) */
+	unsigned long long t0;        /**< connection request timestamp (msec) */
+} netstats_t;
+
+unsigned long long net_now_ms(void);
+
 /** peer address */
 typedef union {
 	struct sockaddr_in  ip4; /**< IPv4 address */
@@ -85,9 +98,21 @@ const char *netaddr_print(const netaddr_t *, char *);
 
 const char *net_error(int, int);
 
+// socket tuning profiles
+#define NETPROF_DEFAULT     0 /**< kernel defaults */
+#define NETPROF_INTERACTIVE 1 /**< TCP_NODELAY, latency over batching */
+#define NETPROF_BULK        2 /**< enlarged kernel buffers for throughput */
+
+/** kernel socket buffer size applied by NETPROF_BULK */
+#define NETPROF_BULK_BUFSIZE (256*1024)
+
+int net_profile(const char *);
+void net_tune(sock_t *, int);
+
 int net_resolve(int, const char *, unsigned short, netaddr_t *, int *);
 int net_server(int, const char *, unsigned short, sock_t *, netaddr_t *,int*);
 int net_client(int, const char *, unsigned short, sock_t *, netaddr_t *,int*);
+int net_connect(const netaddr_t *, sock_t *, int *);
 int net_accept(sock_t *, sock_t *, netaddr_t *);
 int net_read(sock_t*, iobuf_t*, unsigned int, unsigned int*, unsigned int*);
 int net_write(sock_t *, iobuf_t *, const void *, unsigned int, unsigned int *);
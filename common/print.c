@@ -38,6 +38,27 @@
 int info_level = 3;
 static FILE *print_fps[PRINT_MAX];
 
+/** size of a buffered log line (bytes) */
+#define LOG_LINE_SIZE 128
+/** number of buffered log lines, must be a power of two */
+#define LOG_RING_SIZE 256
+
+/*
+ * High-rate log lines (info levels above 0, mostly transfer traces) are
+ * formatted into a ring buffer and written out in one batch when the
+ * event loop goes idle, so logging no longer serializes the hot path on
+ * the console. The ring is single-producer/single-consumer: only the
+ * event loop buffers lines and flushes them. Synchronous messages
+ * (info level 0, warnings, errors) flush the ring first so the output
+ * stays ordered.
+ */
+static char log_ring[LOG_RING_SIZE][LOG_LINE_SIZE];
+static volatile unsigned int log_head, log_tail;
+static unsigned int log_dropped;
+
+/** comma-separated subsystem names allowed to trace transfers */
+static const char *xfer_filter;
+
 /* common code {{{  */
 static void do_print(
 					unsigned int fid,
@@ -91,9 +112,9 @@ void __trace(
 /* info/warn/error API {{{ */
 void print_init(void)
 {
-#ifdef DEBUG
 	char *val;
 
+#ifdef DEBUG
 	val = getenv("DEBUG");
 	if (val)
 		debug_level = atoi(val);
@@ -105,6 +126,43 @@ void print_init(void)
 	print_fps[0] = stderr;
 	print_fps[1] = stderr;
 	print_fps[2] = stderr;
+
+	val = getenv("RDP2TCP_VERBOSE");
+	if (val)
+		info_level = atoi(val);
+	val = getenv("RDP2TCP_LOG");
+	if (val)
+		xfer_filter = val;
+}
+
+/**
+ * flush the buffered log lines
+ * @note called by the event loop when it goes idle
+ */
+void print_flush(void)
+{
+	FILE *fp;
+	static volatile int flushing;
+
+	if ((log_tail == log_head) && !log_dropped)
+		return;
+
+	fp = print_fps[PRINT_INFO];
+	if (!fp || flushing)
+		return;
+	flushing = 1;
+
+	for (; log_tail != log_head; ++log_tail) {
+		fputs(log_ring[log_tail & (LOG_RING_SIZE-1)], fp);
+		fputc('\n', fp);
+	}
+
+	if (log_dropped) {
+		fprintf(fp, "(%u log lines dropped)\n", log_dropped);
+		log_dropped = 0;
+	}
+
+	flushing = 0;
 }
 
 /**
@@ -119,11 +177,27 @@ void info(int level, const char *fmt, ...)
 
 	assert(fmt);
 
-	if (level <= info_level) {
-		va_start(va, fmt);
-		do_print(PRINT_INFO, NULL, fmt, va);
-		va_end(va);
+	if (level > info_level)
+		return;
+
+	if (level > 0) {
+		// high-rate line, buffered until the event loop goes idle
+		if (log_head - log_tail < LOG_RING_SIZE) {
+			va_start(va, fmt);
+			vsnprintf(log_ring[log_head & (LOG_RING_SIZE-1)],
+						LOG_LINE_SIZE, fmt, va);
+			va_end(va);
+			++log_head;
+		} else {
+			++log_dropped;
+		}
+		return;
 	}
+
+	print_flush();
+	va_start(va, fmt);
+	do_print(PRINT_INFO, NULL, fmt, va);
+	va_end(va);
 }
 
 /**
@@ -138,6 +212,7 @@ int warn(const char *fmt, ...)
 
 	assert(fmt);
 
+	print_flush();
 	va_start(va, fmt);
 	do_print(PRINT_WARN, "warn: ", fmt, va);
 	va_end(va);
@@ -156,6 +231,7 @@ int error(const char *fmt, ...)
 
 	assert(fmt);
 
+	print_flush();
 	va_start(va, fmt);
 	do_print(PRINT_ERR, "error: ", fmt, va);
 	va_end(va);
@@ -164,10 +240,33 @@ int error(const char *fmt, ...)
 }
 /* }}} */
 
+/**
+ * check whether a subsystem may trace its transfers
+ * @param[in] name name of stream displayed on console
+ * @return 0 if RDP2TCP_LOG is set and does not list the subsystem
+ */
+int print_xfer_enabled(const char *name)
+{
+	const char *p;
+	size_t n;
+
+	if (!xfer_filter)
+		return 1;
+
+	n = strlen(name);
+	for (p = xfer_filter; (p = strstr(p, name)); p += n) {
+		if (((p == xfer_filter) || (p[-1] == ','))
+				&& ((p[n] == 0) || (p[n] == ',')))
+			return 1;
+	}
+
+	return 0;
+}
+
 /**
  * print I/O transfer length
  */
-void print_xfer(const char *name, char rw, unsigned int size)
+void __print_xfer(const char *name, char rw, unsigned int size)
 {
 	info(1, (rw=='r'?"%-6s          < %-8u":"%-6s %8u >"), name, size);
 }
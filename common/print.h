@@ -23,12 +23,26 @@
 #include "debug.h"
 
 void print_init(void);
+void print_flush(void);
+
+extern int info_level;
 
 void info(int, const char *, ...);
 int warn(const char *, ...);
 int error(const char *, ...);
 
-void print_xfer(const char *, char, unsigned int);
+int print_xfer_enabled(const char *);
+void __print_xfer(const char *, char, unsigned int);
+
+#ifndef NO_XFER_TRACE
+/** log an I/O transfer; costs a single comparison when filtered out at
+ * runtime and compiles to nothing with -DNO_XFER_TRACE */
+#define print_xfer(name, rw, size) \
+	{ if ((info_level >= 1) && print_xfer_enabled(name)) \
+		__print_xfer(name, rw, size); }
+#else
+#define print_xfer(name, rw, size) ((void)0)
+#endif
 
 #ifdef DEBUG
 void fprint_hex(void *, unsigned int, FILE *);
@@ -26,11 +26,24 @@
 #include "compiler.h"
 
 #define RDP2TCP_MAX_MSGLEN (512*1024)
+/** maximal relayed UDP datagram payload size */
+#define RDP2TCP_MAX_DGRAM 2048
 /**
  *  default TS virtual channel name
  */
 #define RDP2TCP_CHAN_NAME "rdp2tcp"
 #define RDP2TCP_PING_DELAY 5 // secs
+/** minimal delay between adaptive keepalive probes */
+#define RDP2TCP_PING_MINDELAY 1 // secs
+/** nominal channel RTT used to scale the flow-control window */
+#define RDP2TCP_RTT_NOMINAL 100 // msecs
+/** maximal RTT-driven flow-control window growth factor */
+#define RDP2TCP_WINDOW_MAXSCALE 4
+
+/** maximal number of virtual channel stripes;
+ * stripe 0 uses the plain channel name, extra stripes append their
+ * index to it ("rdp2tcp1", ...) and only carry per-tunnel payloads */
+#define RDP2TCP_MAX_STRIPES 4
 
 // rdp2tcp commands
 #define R2TCMD_CONN  0x00
@@ -39,12 +52,50 @@
 #define R2TCMD_PING  0x03
 #define R2TCMD_BIND  0x04
 #define R2TCMD_RCONN 0x05
-#define R2TCMD_MAX   0x06
+#define R2TCMD_HELLO 0x06
+#define R2TCMD_ZDATA 0x07
+#define R2TCMD_WNDUP 0x08
+#define R2TCMD_UDATA 0x09
+#define R2TCMD_LATSTAT 0x0a
+#define R2TCMD_RESUME 0x0b
+#define R2TCMD_MAX   0x0c
+
+// capability bits exchanged with R2TCMD_HELLO
+#define R2TCAP_ZDATA 0x01
+#define R2TCAP_WNDUP 0x02
+#define R2TCAP_UDP   0x04
+#define R2TCAP_TID16 0x08
+/** the peer echoes timestamped R2TCMD_PING probes (RTT measurement);
+ * a probe carries the sender clock (4 bytes, truncated milliseconds,
+ * network order) with identifier 0 and is echoed back unchanged with
+ * identifier 1 */
+#define R2TCAP_RTT   0x10
+/** the peer accepts R2TCMD_LATSTAT latency histograms (server -->
+ * client); the body holds LATHIST_BUCKETS counters, 4 bytes each in
+ * network order */
+#define R2TCAP_LATSTAT 0x20
+/** tunnels survive a channel blip and resync with R2TCMD_RESUME:
+ * the client reports how many payload bytes it safely received on a
+ * tunnel and the server answers with its own count, then each side
+ * replays the unacknowledged tail from its replay ring */
+#define R2TCAP_RESUME 0x40
+
+/** default per-tunnel replay ring capacity (bytes) */
+#define RDP2TCP_RESUME_BUFSIZE (64*1024)
+
+/** invalid tunnel identifier (0xff on a v1 wire) */
+#define R2T_TID_NONE 0xffff
+
+/** default per-tunnel flow-control window */
+#define RDP2TCP_WINDOW_SIZE (256*1024)
+/** minimal consumed size worth a window-update message */
+#define RDP2TCP_WINDOW_ACKMIN (RDP2TCP_WINDOW_SIZE/4)
 
 // address family on wire
 #define TUNAF_ANY  0x00
 #define TUNAF_IPV4 0x01
 #define TUNAF_IPV6 0x02
+#define TUNAF_UDP  0x03 /**< R2TCMD_CONN only, requests a UDP relay tunnel */
 
 // rdp2tcp error codes
 #define R2TERR_SUCCESS     0x00
@@ -57,43 +108,78 @@
 #define R2TERR_NOTFOUND    0x07
 #define R2TERR_MAX         0x08
 
-/** generic rdp2tcp message header */
-PACK(struct _r2tmsg {
-	unsigned char cmd; /**< R2TCMD_xxx */
-	unsigned char id;  /**< tunnel identifier */
-});
-typedef struct _r2tmsg r2tmsg_t;
+/* every message starts with a 1-byte R2TCMD_xxx command followed by
+ * the tunnel identifier; the identifier is a single byte (protocol v1,
+ * 0xff invalid) until both peers advertised R2TCAP_TID16, then 2 bytes
+ * in network order (protocol v2, 0xffff invalid); R2TCMD_HELLO always
+ * keeps the 1-byte identifier since it bootstraps the negotiation and
+ * its identifier byte is 0, or 1 for the framing acknowledgment sent
+ * by the client once it switched;
+ * the structures below describe the message bodies after the header */
 
-/** R2TCMD_CONN or R2TCMD_BIND message (client --> server) */
+/** R2TCMD_CONN or R2TCMD_BIND body (client --> server) */
 PACK(struct _r2tmsg_connreq {
-	unsigned char cmd;   /**< R2TCMD_CONN or R2TCMD_BIND */
-	unsigned char id;    /**< tunnel identifier */
 	unsigned short port; /**< TCP port or 0 for process tunnel */
 	unsigned char af;    /**< address family */
 	char hostname[0];    /**< tunnel remote hostname or command line */
 });
 typedef struct _r2tmsg_connreq r2tmsg_connreq_t;
 
-/** R2TCMD_CONN or R2TCMD_BIND message (server --> client) */
+/** R2TCMD_CONN or R2TCMD_BIND answer body, after the 1-byte error
+ * code, or after the remote tunnel identifier for R2TCMD_RCONN
+ * (server --> client) */
 PACK(struct _r2tmsg_connans {
-	unsigned char cmd;      /**< R2TCMD_CONN or R2TCMD_BIND */
-	unsigned char id;       /**< tunnel identifier */
-	unsigned char err;      /**< error code */
 	unsigned char af;       /**< address family */
 	unsigned short port;    /**< TCP port or 0 for process tunnel */
 	unsigned char addr[16]; /**< tunnel address */
 });
 typedef struct _r2tmsg_connans r2tmsg_connans_t;
 
-/** R2TCMD_RCONN message (server --> client) */
-PACK(struct _r2tmsg_rconnreq {
-	unsigned char cmd;      /**< R2TCMD_RCONN */
-	unsigned char id;       /**< local tunnel identifier */
-	unsigned char rid;      /**< remote tunnel identifier */
-	unsigned char af;       /**< address family */
-	unsigned short port;    /**< TCP port */
-	unsigned char addr[16]; /**< tunnel address */
+/** R2TCMD_HELLO body (both directions) */
+PACK(struct _r2tmsg_hello {
+	unsigned char caps; /**< R2TCAP_xxx bitmask */
+});
+typedef struct _r2tmsg_hello r2tmsg_hello_t;
+
+/** R2TCMD_ZDATA body (both directions)
+ * the compressed payload follows the raw size */
+PACK(struct _r2tmsg_zdata {
+	unsigned int raw_len;    /**< uncompressed payload size (network order) */
+});
+typedef struct _r2tmsg_zdata r2tmsg_zdata_t;
+
+/** R2TCMD_WNDUP body (both directions) */
+PACK(struct _r2tmsg_wndup {
+	unsigned int len;  /**< acknowledged payload size (network order) */
+});
+typedef struct _r2tmsg_wndup r2tmsg_wndup_t;
+
+/** R2TCMD_RESUME body (client --> server) */
+PACK(struct _r2tmsg_resume {
+	unsigned int seq_hi; /**< received payload bytes, high (network order) */
+	unsigned int seq_lo; /**< received payload bytes, low (network order) */
+});
+typedef struct _r2tmsg_resume r2tmsg_resume_t;
+
+/** R2TCMD_RESUME answer body (server --> client) */
+PACK(struct _r2tmsg_resumeans {
+	unsigned char err;   /**< R2TERR_xxx, tunnel is gone when non-zero */
+	unsigned int seq_hi; /**< received payload bytes, high (network order) */
+	unsigned int seq_lo; /**< received payload bytes, low (network order) */
+});
+typedef struct _r2tmsg_resumeans r2tmsg_resumeans_t;
+
+/** R2TCMD_UDATA datagram record (both directions)
+ * several records are batched after the message header, each
+ * followed by a 4 or 16 byte address and the datagram payload;
+ * the address is the destination (client --> server) or the source
+ * (server --> client) of the datagram */
+PACK(struct _r2tmsg_udata_rec {
+	unsigned char af;      /**< TUNAF_IPV4 or TUNAF_IPV6 */
+	unsigned short port;   /**< UDP port (network order) */
+	unsigned short len;    /**< payload size (network order) */
+	unsigned char addr[0]; /**< address followed by payload */
 });
-typedef struct _r2tmsg_rconnreq r2tmsg_rconnreq_t;
+typedef struct _r2tmsg_udata_rec r2tmsg_udata_rec_t;
 
 #endif
@@ -63,6 +63,7 @@ int __aio_init_forward(aio_t *rio, aio_t *wio
 	wio->io.hEvent = evt2;
 	rio->min_io_size = 1024;
 	wio->min_io_size = 0;
+	wio->max_io_size = 0;
 
 	return 0;
 }
@@ -224,6 +225,11 @@ int aio_write(aio_t *wio, HANDLE fd, const char *name)
 		return 0;
 	}
 
+	// transports with a bounded PDU size are written in slices, the
+	// event stays signaled so the main loop flushes the remainder
+	if (wio->max_io_size && (len > wio->max_io_size))
+		len = wio->max_io_size;
+
 #ifdef DEBUG
 	if (debug_level > 0) iobuf_dump(obuf);
 #endif
@@ -24,19 +24,80 @@
 #include "r2twin.h"
 #include "rdp2tcp.h"
 #include "msgparser.h"
+#include "compress.h"
+#include "lathist.h"
 #include "wtsapi32.h"
 
+#include <stdlib.h>
+
 #ifndef CHANNEL_CHUNK_LENGTH
 /** minimal chunk size supported by TS virtual channel */
 #define CHANNEL_CHUNK_LENGTH 1600
 #endif
 
+/** payload quantum one tunnel may forward per scheduler pass */
+#define CHANNEL_SCHED_QUANTUM NETBUF_MAX_SIZE
+/** channel output backlog above which tunnel payload is staged
+ * in the tunnel input buffer and scheduled instead of being
+ * forwarded straight away */
+#define CHANNEL_SCHED_HIWAT (2*NETBUF_MAX_SIZE)
+
+/** minimal payload size worth compressing */
+#define CHANNEL_ZDATA_MINLEN 64
+/** consecutive incompressible payloads before a tunnel opts out */
+#define CHANNEL_ZDATA_MAXFAIL 8
+
+/** check whether payloads of a tunnel should be compressed */
+#define channel_zdata_active(tun) \
+		((vc.caps & vc.peer_caps & R2TCAP_ZDATA) \
+		 && ((tun)->zfail < CHANNEL_ZDATA_MAXFAIL))
+
+/** check whether the client echoes timestamped ping probes */
+#define channel_rtt_active() (vc.caps & vc.peer_caps & R2TCAP_RTT)
+
+/** per-tunnel flow-control window size (0 disables flow control) */
+unsigned int channel_window = RDP2TCP_WINDOW_SIZE;
+
+/** configured window, RTT scaling never shrinks channel_window below it */
+static unsigned int window_base = RDP2TCP_WINDOW_SIZE;
+
+/** smoothed channel RTT (msecs, 0=unknown) */
+static unsigned int chan_srtt;
+/** smoothed RTT jitter (msecs) */
+static unsigned int chan_rttvar;
+
 #ifdef DEBUG
 extern int debug_level;
 #endif
 
 static vchannel_t vc;
 
+/** extra virtual channel stripe
+ * stripes only carry per-tunnel messages so a bulk transfer queued on
+ * one stripe cannot head-of-line-block interactive tunnels pinned to
+ * another; every other message stays on the main channel */
+typedef struct _vcstripe {
+	HANDLE ts;   /**< RDP channel handle */
+	HANDLE chan; /**< RDP channel I/O handle */
+	aio_t rio;   /**< input aio_t */
+	aio_t wio;   /**< output aio_t */
+} vcstripe_t;
+
+static vcstripe_t stripes[RDP2TCP_MAX_STRIPES];
+static unsigned int nstripes = 1;
+
+/** payload quantum, tunable with RDP2TCP_QUANTUM */
+static unsigned int sched_quantum = CHANNEL_SCHED_QUANTUM;
+/** round-robin ring of tunnels with staged payload */
+static tunnel_t *fq_head, *fq_tail;
+
+/** input aio of a channel stripe */
+#define stripe_rio(s)    ((s) ? &stripes[s].rio : &vc.rio)
+/** output aio of a channel stripe */
+#define stripe_wio(s)    ((s) ? &stripes[s].wio : &vc.wio)
+/** I/O handle of a channel stripe */
+#define stripe_handle(s) ((s) ? stripes[s].chan : vc.chan)
+
 /**
  * check whether channel is connected
  */
@@ -46,23 +107,49 @@ int channel_is_connected(void)
 }
 
 /**
- * initialize the TS virtual channel associated with rdp2tcp session
+ * open a TS virtual channel of the current session
  * @param[in] name virtual channel name
+ * @param[out] out_ts opened RDP channel handle
+ * @param[out] out_chan channel I/O handle
+ * @param[out] out_dynamic set to 1 for a dynamic virtual channel
  * @return 0 on success
- * @note only 1 virtual channel per server instance
  */
-int channel_init(const char *name)
+static int chan_open(
+			const char *name,
+			HANDLE *out_ts,
+			HANDLE *out_chan,
+			int *out_dynamic)
 {
+	typedef HANDLE (WINAPI *wts_openex_t)(DWORD, LPSTR, DWORD);
 	HANDLE ts, *hbuf;
 	DWORD buflen = 0;
+	wts_openex_t openex;
 
 	trace_chan("%s", name);
-	memset(&vc, 0, sizeof(vc));
 
-	ts = WTSVirtualChannelOpen(
-				WTS_CURRENT_SERVER_HANDLE,
-				WTS_CURRENT_SESSION,
-				(LPSTR) name);
+	// dynamic virtual channels are not sliced into 1600-byte PDUs,
+	// prefer them when the session supports it (Vista/2008 and later)
+	ts = NULL;
+	*out_dynamic = 0;
+	if (!getenv("RDP2TCP_NODVC")) {
+		openex = (wts_openex_t) GetProcAddress(
+						GetModuleHandleA("wtsapi32.dll"),
+						"WTSVirtualChannelOpenEx");
+		if (openex) {
+			ts = openex(WTS_CURRENT_SESSION, (LPSTR) name,
+							WTS_CHANNEL_OPTION_DYNAMIC);
+			if (ts)
+				*out_dynamic = 1;
+			else
+				debug(0, "dynamic virtual channel not available");
+		}
+	}
+
+	if (!ts)
+		ts = WTSVirtualChannelOpen(
+					WTS_CURRENT_SERVER_HANDLE,
+					WTS_CURRENT_SESSION,
+					(LPSTR) name);
 	if (!ts)
 		return syserror("WTSVirtualChannelOpen");
 
@@ -74,18 +161,116 @@ int channel_init(const char *name)
 		return -1;
 	}
 
-	vc.ts = ts;
-	vc.chan = *hbuf;
+	*out_ts   = ts;
+	*out_chan = *hbuf;
 	WTSFreeMemory(hbuf);
 
+	return 0;
+}
+
+/**
+ * open the extra channel stripes registered by the rdesktop addin
+ * @param[in] name virtual channel base name
+ * @param[in] count requested stripe count
+ * @note static channel names are limited to 7 characters, extra
+ *       stripes effectively require a dynamic channel or a short name
+ */
+static void chan_open_stripes(const char *name, unsigned int count)
+{
+	char sname[16];
+	const char *env;
+	int dynamic;
+	unsigned int i;
+
+	if (count > RDP2TCP_MAX_STRIPES)
+		count = RDP2TCP_MAX_STRIPES;
+
+	for (i=1; i<count; ++i) {
+		snprintf(sname, sizeof(sname), "%s%u", name, i);
+		if (chan_open(sname, &stripes[i].ts, &stripes[i].chan, &dynamic))
+			break;
+
+		if (aio_init_forward(&stripes[i].rio, &stripes[i].wio, "strp")) {
+			CloseHandle(stripes[i].chan);
+			WTSVirtualChannelClose(stripes[i].ts);
+			break;
+		}
+
+		stripes[i].wio.max_io_size = (dynamic ? 0 : CHANNEL_CHUNK_LENGTH);
+		env = getenv("RDP2TCP_CHUNK");
+		if (env)
+			stripes[i].wio.max_io_size = (unsigned int) atoi(env);
+
+		if (event_add_stripe(i, stripes[i].wio.io.hEvent,
+											stripes[i].rio.io.hEvent)) {
+			aio_kill_forward(&stripes[i].rio, &stripes[i].wio);
+			CloseHandle(stripes[i].chan);
+			WTSVirtualChannelClose(stripes[i].ts);
+			break;
+		}
+
+		nstripes = i + 1;
+	}
+
+	if (nstripes > 1)
+		info(0, "striping tunnel payloads across %u channels", nstripes);
+}
+
+/**
+ * initialize the TS virtual channel associated with rdp2tcp session
+ * @param[in] name virtual channel name
+ * @return 0 on success
+ * @note only 1 virtual channel per server instance
+ */
+int channel_init(const char *name)
+{
+	const char *env;
+	int dynamic;
+
+	trace_chan("%s", name);
+	memset(&vc, 0, sizeof(vc));
+
+	env = getenv("RDP2TCP_WINDOW");
+	if (env)
+		channel_window = (unsigned int) atoi(env);
+	window_base = channel_window;
+
+	env = getenv("RDP2TCP_QUANTUM");
+	if (env && (atoi(env) > 0))
+		sched_quantum = (unsigned int) atoi(env);
+
+	if (chan_open(name, &vc.ts, &vc.chan, &dynamic))
+		return -1;
+	vc.dynamic = dynamic;
+
+	vc.caps = R2TCAP_ZDATA | R2TCAP_UDP | R2TCAP_TID16 | R2TCAP_RTT
+				| R2TCAP_RESUME
+				| (channel_window ? R2TCAP_WNDUP : 0);
+	iobuf_init(&vc.zbuf, 'r', "zdata");
+
 	if (aio_init_forward(&vc.rio, &vc.wio, "chan")) {
 		CloseHandle(vc.chan);
 		WTSVirtualChannelClose(vc.ts);
 		return -1;
 	}
 
+	// static channels are written one chunk at a time, a dynamic
+	// channel takes whole buffers; RDP2TCP_CHUNK overrides the size
+	// when the session negotiated a larger static-channel PDU
+	vc.wio.max_io_size = (vc.dynamic ? 0 : CHANNEL_CHUNK_LENGTH);
+	env = getenv("RDP2TCP_CHUNK");
+	if (env)
+		vc.wio.max_io_size = (unsigned int) atoi(env);
+
+	if (vc.dynamic)
+		info(0, "using dynamic virtual channel");
+
 	events_init(vc.wio.io.hEvent, vc.rio.io.hEvent);
 
+	env = getenv("RDP2TCP_STRIPES");
+	if (env)
+		chan_open_stripes(name, (unsigned int) atoi(env));
+
 	return 0;
 }
 
@@ -94,8 +279,20 @@ int channel_init(const char *name)
  */
 void channel_kill(void)
 {
+	unsigned int i;
+
 	trace_chan("");
+
+	for (i=1; i<nstripes; ++i) {
+		CancelIo(stripes[i].chan);
+		aio_kill_forward(&stripes[i].rio, &stripes[i].wio);
+		CloseHandle(stripes[i].chan);
+		WTSVirtualChannelClose(stripes[i].ts);
+	}
+	nstripes = 1;
+
 	CancelIo(vc.chan);
+	iobuf_kill(&vc.zbuf);
 	aio_kill_forward(&vc.rio, &vc.wio);
 	CloseHandle(vc.chan);
 	// TODO why does it throw invalid handle exception ?
@@ -109,44 +306,73 @@ static int on_read_completed(iobuf_t *ibuf, void *bla)
 
 /**
  * handle TS virtual channel read-event
+ * @param[in] stripe channel stripe index
  * @return 0 on success
  */
-int channel_read_event(void)
+int channel_read_event(unsigned int stripe)
 {
-	trace_chan("pending=%i", vc.rio.pending);
-	return aio_read(&vc.rio, vc.chan, "chan", on_read_completed, NULL);
+	assert(stripe < nstripes);
+	trace_chan("stripe=%u, pending=%i", stripe, stripe_rio(stripe)->pending);
+	return aio_read(stripe_rio(stripe), stripe_handle(stripe), "chan",
+							on_read_completed, NULL);
 }
 
 /**
  * check whether a async I/O write is pending
+ * @param[in] stripe channel stripe index
  */
-int channel_write_pending(void)
+int channel_write_pending(unsigned int stripe)
 {
-	//trace_chan("pending=%i", (int)vc.wio.pending);
-	return vc.wio.pending;
+	//trace_chan("pending=%i", (int)stripe_wio(stripe)->pending);
+	return stripe_wio(stripe)->pending;
 }
 
 /**
  * process TS virtual channel write-event
+ * @param[in] stripe channel stripe index
  * @return 0 on success
  */
-int channel_write_event(void)
+int channel_write_event(unsigned int stripe)
 {
 	int ret;
 
-	ret = aio_write(&vc.wio, vc.chan, "chan");
-	trace_chan("pending=%i, outavail=%u, connected=%i, ret=%i",
-			vc.wio.pending, iobuf_datalen(&vc.wio.buf), vc.connected, ret);
+	assert(stripe < nstripes);
+	ret = aio_write(stripe_wio(stripe), stripe_handle(stripe), "chan");
+	trace_chan("stripe=%u, pending=%i, outavail=%u, connected=%i, ret=%i",
+			stripe, stripe_wio(stripe)->pending,
+			iobuf_datalen(&stripe_wio(stripe)->buf), vc.connected, ret);
 
-
-	if ((ret >= 0) ^ !!vc.connected) {
+	// the connected state is tracked on the main channel only
+	if (!stripe && ((ret >= 0) ^ !!vc.connected)) {
 		info(0, "channel %sconnected", vc.connected?"dis":"");
 		vc.connected ^= 1;
 	}
 
+	// the drain freed channel credit for staged tunnels
+	if (ret >= 0)
+		channel_fq_run();
+
 	return 0;
 }
 
+/**
+ * select the channel stripe carrying a message
+ * @param[in] cmd rdp2tcp command (R2TCMD_xxx)
+ * @param[in] tun_id rdp2tcp tunnel ID
+ * @return the stripe index
+ * @note per-tunnel payloads follow their tunnel stripe so they stay
+ *       ordered, anything else stays on the main channel
+ */
+static unsigned int stripe_of(unsigned char cmd, unsigned int tun_id)
+{
+	if ((nstripes < 2)
+			|| ((cmd != R2TCMD_DATA) && (cmd != R2TCMD_ZDATA)
+				&& (cmd != R2TCMD_UDATA) && (cmd != R2TCMD_CLOSE)))
+		return 0;
+
+	return tun_id % nstripes;
+}
+
 /**
  * send a message through TS virtual channel
  * @param[in] cmd rdp2tcp command (R2TCMD_xxx)
@@ -157,53 +383,448 @@ int channel_write_event(void)
  */
 int channel_write(
 	unsigned char cmd,
-	unsigned char tun_id,
+	unsigned int tun_id,
 	const void *data,
 	unsigned int data_len)
 {
 	unsigned char *ptr;
-	unsigned int used;
+	unsigned int used, stripe, hdr_len;
+	iobuf_t *obuf;
 
 	trace_chan("cmd=%02x id=%02x len=%u", cmd, tun_id, data_len);
-	used = iobuf_datalen(&vc.wio.buf);
+	stripe = stripe_of(cmd, tun_id);
+	obuf = &stripe_wio(stripe)->buf;
+	used = iobuf_datalen(obuf);
 
-	ptr = iobuf_reserve(&vc.wio.buf, data_len+6, NULL);
+	hdr_len = r2t_hdr_len();
+	ptr = iobuf_reserve(obuf, data_len+4+hdr_len, NULL);
 	if (!ptr)
-		return error("failed to append %u bytes to channel buffer", data_len+6);
-	*((unsigned int *)ptr) = htonl(data_len+2);
+		return error("failed to append %u bytes to channel buffer",
+							data_len+4+hdr_len);
+	*((unsigned int *)ptr) = htonl(data_len+hdr_len);
 
-	ptr[4] = cmd;
-	ptr[5] = tun_id;
-	memcpy(ptr+6, data, data_len);
-	iobuf_commit(&vc.wio.buf, data_len+6);
+	r2t_hdr_write(ptr+4, cmd, tun_id);
+	memcpy(ptr+4+hdr_len, data, data_len);
+	iobuf_commit(obuf, data_len+4+hdr_len);
 
 	if (used > 0)
 		return 0;
 
-	return channel_write_event();
+	return channel_write_event(stripe);
 }
 
 /**
- * forward tunnel input buffer to virtual channel
+ * handle the client capability announcement
+ * @param[in] caps client capabilities (R2TCAP_xxx)
+ * @param[in] ack 1 for the framing acknowledgment sent by a client
+ *            which switched to 16-bit tunnel identifiers
+ */
+void channel_hello_event(unsigned char caps, int ack)
+{
+	trace_chan("caps=0x%02x, ack=%i", caps, ack);
+
+	vc.peer_caps = caps;
+
+	if (ack) {
+		// the client parses and writes v2 frames from now on
+		if (vc.caps & caps & R2TCAP_TID16) {
+			r2t_tid16_in = 1;
+			info(0, "16-bit tunnel identifiers enabled");
+		}
+		return;
+	}
+
+	if (vc.caps & caps & R2TCAP_ZDATA)
+		info(0, "channel compression enabled");
+
+	// a fresh client session restarts the RTT estimator
+	chan_srtt   = 0;
+	chan_rttvar = 0;
+	channel_window = window_base;
+
+	// the hello answer keeps the 1-byte identifier framing, frames
+	// queued after it may already use 16-bit tunnel identifiers
+	r2t_tid16_in  = 0;
+	r2t_tid16_out = 0;
+	channel_write(R2TCMD_HELLO, 0, &vc.caps, 1);
+	if (vc.caps & caps & R2TCAP_TID16)
+		r2t_tid16_out = 1;
+
+	// surviving tunnels are parked until the client resyncs them
+	if (vc.caps & caps & R2TCAP_RESUME)
+		tunnels_resume_pending();
+}
+
+/**
+ * send a keepalive ping to the rdp2tcp client
+ * @return -1 on error
+ * @note the probe carries the local clock when the client echoes it
+ */
+int channel_ping(void)
+{
+	unsigned int ts, i;
+	const lathist_t *lat;
+	unsigned int counts[LATHIST_BUCKETS];
+
+	// piggyback the queue-delay histogram on the keepalive period
+	lat = tunnel_latstat();
+	if (lat && (vc.peer_caps & R2TCAP_LATSTAT)) {
+		for (i=0; i<LATHIST_BUCKETS; ++i)
+			counts[i] = htonl(lat->count[i]);
+		if (channel_write(R2TCMD_LATSTAT, 0, counts, sizeof(counts)) < 0)
+			return -1;
+	}
+
+	if (channel_rtt_active()) {
+		ts = htonl((unsigned int) net_now_ms());
+		return channel_write(R2TCMD_PING, 0, &ts, 4);
+	}
+
+	return channel_write(R2TCMD_PING, 0, NULL, 0);
+}
+
+/**
+ * handle the echo of a timestamped keepalive probe
+ * @param[in] ts_ms probe transmit clock (truncated milliseconds)
+ * @note smoothing follows the TCP estimator (RFC 6298); the
+ *       flow-control window grows with the RTT so a long fat channel
+ *       is not capped below its bandwidth-delay product
+ */
+void channel_rtt_event(unsigned int ts_ms)
+{
+	unsigned int rtt, delta;
+	unsigned long long wnd;
+
+	rtt = (unsigned int) net_now_ms() - ts_ms;
+
+	if (!chan_srtt && !chan_rttvar) {
+		chan_srtt   = (rtt ? rtt : 1);
+		chan_rttvar = rtt / 2;
+	} else {
+		delta = (rtt > chan_srtt ? rtt - chan_srtt : chan_srtt - rtt);
+		chan_rttvar = (3 * chan_rttvar + delta) / 4;
+		chan_srtt   = (7 * chan_srtt + rtt) / 8;
+		if (!chan_srtt)
+			chan_srtt = 1;
+	}
+	debug(1, "channel rtt=%ums srtt=%ums jitter=%ums",
+			rtt, chan_srtt, chan_rttvar);
+
+	if (window_base) {
+		wnd = ((unsigned long long) window_base * chan_srtt)
+				/ RDP2TCP_RTT_NOMINAL;
+		if (wnd < window_base)
+			wnd = window_base;
+		else if (wnd > (unsigned long long)
+							RDP2TCP_WINDOW_MAXSCALE * window_base)
+			wnd = (unsigned long long) RDP2TCP_WINDOW_MAXSCALE * window_base;
+		channel_window = (unsigned int) wnd;
+	}
+}
+
+/**
+ * try to send a tunnel payload as a compressed R2TCMD_ZDATA message
+ * @param[in] tun tunnel
+ * @param[in] data payload
+ * @param[in] len payload size
+ * @return 1 if the payload did not compress and must be sent plain
+ */
+static int channel_write_zdata(
+				tunnel_t *tun,
+				const void *data,
+				unsigned int len)
+{
+	unsigned char *ptr;
+	unsigned int used, zlen, stripe, hdr_len;
+	iobuf_t *obuf;
+
+	stripe = stripe_of(R2TCMD_ZDATA, tun->id);
+	obuf = &stripe_wio(stripe)->buf;
+	used = iobuf_datalen(obuf);
+
+	hdr_len = r2t_hdr_len();
+	ptr = iobuf_reserve(obuf, len+8+hdr_len, NULL);
+	if (!ptr)
+		return error("failed to append %u bytes to channel buffer",
+							len+8+hdr_len);
+
+	// only worth it when the 4-byte raw size header is amortized
+	zlen = r2t_compress(data, len, ptr+8+hdr_len, len-5);
+	if (!zlen) {
+		if (tun->zfail < 0xff)
+			++tun->zfail;
+		return 1; // reserved bytes are simply not committed
+	}
+	tun->zfail = 0;
+
+	trace_chan("id=%02x len=%u->%u", tun->id, len, zlen);
+
+	*((unsigned int *)ptr) = htonl(zlen+4+hdr_len);
+	r2t_hdr_write(ptr+4, R2TCMD_ZDATA, tun->id);
+	*((unsigned int *)(ptr+4+hdr_len)) = htonl(len);
+	iobuf_commit(obuf, zlen+8+hdr_len);
+
+	if (used > 0)
+		return 0;
+
+	return channel_write_event(stripe);
+}
+
+/**
+ * decompress a R2TCMD_ZDATA payload and forward it to the tunnel
  * @param[in] tun tunnel
+ * @param[in] zdata compressed payload
+ * @param[in] zlen compressed payload size
+ * @param[in] raw_len expected decompressed size
  * @return -1 on error
  */
-int channel_forward(tunnel_t *tun)
+int channel_zdata_recv(
+			tunnel_t *tun,
+			const void *zdata,
+			unsigned int zlen,
+			unsigned int raw_len)
+{
+	void *ptr;
+
+	trace_chan("id=%02x len=%u->%u", tun->id, zlen, raw_len);
+
+	ptr = iobuf_reserve(&vc.zbuf, raw_len, NULL);
+	if (!ptr)
+		return error("failed to allocate decompression memory");
+
+	if (r2t_decompress(zdata, zlen, ptr, raw_len) != (int)raw_len) {
+		error("corrupted compressed payload on tunnel 0x%02x", tun->id);
+		tunnel_close(tun);
+		return 0;
+	}
+
+	return tunnel_write(tun, ptr, raw_len);
+}
+
+/**
+ * forward the head of the tunnel input buffer to the virtual channel
+ * @param[in] tun tunnel
+ * @param[in] len payload size to forward
+ * @return -1 on error
+ */
+static int channel_forward_chunk(tunnel_t *tun, unsigned int len)
 {
 	iobuf_t *ibuf;
-	unsigned int len;
 	int ret;
 
 	ibuf = &tun->rio.buf;
-	len = iobuf_datalen(ibuf);
+	assert(len <= iobuf_datalen(ibuf));
 	ret = 0;
 
 	if (len > 0) {
+		if ((len >= CHANNEL_ZDATA_MINLEN) && channel_zdata_active(tun)) {
+			ret = channel_write_zdata(tun, iobuf_dataptr(ibuf), len);
+			if (ret != 1) {
+				if (ret >= 0) {
+					tunnel_resume_capture(tun, iobuf_dataptr(ibuf), len);
+					iobuf_consume(ibuf, len);
+					if (channel_wndup_active())
+						tun->wnd_used += len;
+					tun->stats.bytes_in += len;
+					++tun->stats.msgs_out;
+				}
+				return ret;
+			}
+		}
+
 		ret = channel_write(R2TCMD_DATA, tun->id, iobuf_dataptr(ibuf), len);
-		if (ret >= 0)
+		if (ret >= 0) {
+			tunnel_resume_capture(tun, iobuf_dataptr(ibuf), len);
 			iobuf_consume(ibuf, len);
+			if (channel_wndup_active())
+				tun->wnd_used += len;
+			tun->stats.bytes_in += len;
+			++tun->stats.msgs_out;
+		}
 	}
 
 	return ret;
 }
 
+/**
+ * append a tunnel to the back of the scheduler ring
+ * @param[in] tun tunnel with staged payload
+ */
+static void channel_fq_enqueue(tunnel_t *tun)
+{
+	if (tun->fq_queued)
+		return;
+
+	tun->fq_queued = 1;
+	tun->fq_next = NULL;
+	if (fq_tail)
+		fq_tail->fq_next = tun;
+	else
+		fq_head = tun;
+	fq_tail = tun;
+}
+
+/**
+ * remove a closing tunnel from the scheduler ring
+ * @param[in] tun tunnel
+ */
+void channel_fq_unlink(tunnel_t *tun)
+{
+	tunnel_t *cur, *prev;
+
+	if (!tun->fq_queued)
+		return;
+	tun->fq_queued = 0;
+
+	prev = NULL;
+	for (cur=fq_head; cur; prev=cur, cur=cur->fq_next) {
+		if (cur != tun)
+			continue;
+		if (prev)
+			prev->fq_next = tun->fq_next;
+		else
+			fq_head = tun->fq_next;
+		if (fq_tail == tun)
+			fq_tail = prev;
+		return;
+	}
+}
+
+/**
+ * interleave staged tunnel payload into the channel buffers
+ * @return -1 on channel error
+ * @note round-robin quanta; the ring is serviced until its tunnels
+ *       drain or every stripe they are pinned to reaches the backlog
+ *       mark, so one bulk transfer only ever queues a bounded burst
+ *       in front of an interactive message
+ */
+int channel_fq_run(void)
+{
+	static int running;
+	tunnel_t *tun, *wait_head, *wait_tail;
+	unsigned int len;
+	int ret;
+
+	if (running)
+		return 0;
+	running = 1;
+	ret = 0;
+
+	// tunnels parked here keep their service order for the next run
+	wait_head = NULL;
+	wait_tail = NULL;
+
+	while ((tun = fq_head) != NULL) {
+		fq_head = tun->fq_next;
+		if (!fq_head)
+			fq_tail = NULL;
+		tun->fq_queued = 0;
+		tun->fq_next = NULL;
+
+		if (tun->rsm_wait
+				|| (iobuf_datalen(&stripe_wio(
+						stripe_of(R2TCMD_DATA, tun->id))->buf)
+							>= CHANNEL_SCHED_HIWAT)) {
+			// no credit on this stripe, other stripes may still go
+			tun->fq_queued = 1;
+			if (wait_tail)
+				wait_tail->fq_next = tun;
+			else
+				wait_head = tun;
+			wait_tail = tun;
+			continue;
+		}
+
+		len = iobuf_datalen(&tun->rio.buf);
+		if (len > sched_quantum)
+			len = sched_quantum;
+
+		if (channel_forward_chunk(tun, len) < 0) {
+			ret = -1;
+			continue;
+		}
+
+		if (iobuf_datalen(&tun->rio.buf))
+			channel_fq_enqueue(tun);
+		else if (tunnel_staging_event(tun) < 0)
+			ret = -1;
+	}
+
+	if (wait_head) {
+		wait_tail->fq_next = fq_head;
+		fq_head = wait_head;
+		if (!fq_tail)
+			fq_tail = wait_tail;
+	}
+
+	running = 0;
+	return ret;
+}
+
+/**
+ * forward tunnel input buffer to virtual channel
+ * @param[in] tun tunnel
+ * @return -1 on error
+ * @note the payload stays staged in the tunnel input buffer and the
+ *       scheduler interleaves bounded quanta, so one tunnel never
+ *       queues a whole socket buffer in front of the others
+ */
+int channel_forward(tunnel_t *tun)
+{
+	if (iobuf_datalen(&tun->rio.buf))
+		channel_fq_enqueue(tun);
+	return channel_fq_run();
+}
+
+/**
+ * flush the whole staged payload of a closing tunnel
+ * @param[in] tun tunnel
+ * @return -1 on error
+ */
+int channel_forward_flush(tunnel_t *tun)
+{
+	channel_fq_unlink(tun);
+	return channel_forward_chunk(tun, iobuf_datalen(&tun->rio.buf));
+}
+
+/**
+ * check whether session resume was negotiated
+ */
+int channel_resume_active(void)
+{
+	return vc.caps & vc.peer_caps & R2TCAP_RESUME;
+}
+
+/**
+ * check whether flow control was negotiated
+ */
+int channel_wndup_active(void)
+{
+	return channel_window && (vc.caps & vc.peer_caps & R2TCAP_WNDUP);
+}
+
+/**
+ * account payload bytes flushed to the local tunnel endpoint
+ * and acknowledge them to the rdp2tcp client
+ * @param[in] tun tunnel
+ * @param[in] len flushed payload size
+ */
+void channel_wndup_consumed(tunnel_t *tun, unsigned int len)
+{
+	unsigned int acked;
+
+	if (!len || !channel_wndup_active())
+		return;
+
+	// coalesce acknowledgments until they are worth a message
+	tun->wnd_ack += len;
+	if (tun->wnd_ack < RDP2TCP_WINDOW_ACKMIN)
+		return;
+
+	trace_chan("id=%02x acked=%u", tun->id, tun->wnd_ack);
+
+	acked = htonl(tun->wnd_ack);
+	if (channel_write(R2TCMD_WNDUP, tun->id, &acked, 4) >= 0)
+		tun->wnd_ack = 0;
+}
+
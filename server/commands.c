@@ -24,61 +24,73 @@
 #include "r2twin.h"
 #include "msgparser.h"
 
-static int protoerror(unsigned char tid, unsigned char err, const char *errstr)
+static int protoerror(unsigned int tid, unsigned char err, const char *errstr)
 {
 	channel_write(R2TCMD_CONN, tid, &err, 1);
 	return error("protocol error (%s)", errstr);
 }
 
 static int start_tcp_tunnel(
+					unsigned int tid,
 					const r2tmsg_connreq_t *msg,
 					unsigned int len,
 					int bind_tunnel)
 {
 	static const int r2taf_to_sysaf[3] = { AF_UNSPEC, AF_INET, AF_INET6 };
 
-	if (len < 7)
-		return protoerror(msg->id, R2TERR_BADMSG, "command too small");
+	if (len < 5)
+		return protoerror(tid, R2TERR_BADMSG, "command too small");
 
-	if (tunnel_lookup(msg->id))
-		return error("tunnel 0x%02x is already used", msg->id);
+	// a parked warm connection squatting the ID is silently evicted
+	if (tunnel_lookup(tid) && tunnel_pool_evict(tid))
+		return error("tunnel 0x%02x is already used", tid);
+
+	if (msg->af == TUNAF_UDP) {
+		if (bind_tunnel)
+			return protoerror(tid, R2TERR_BADMSG,
+										"invalid address family");
+		tunnel_create_udp(tid);
+		return 0;
+	}
 
 	if (msg->af > TUNAF_IPV6)
-		return protoerror(msg->id, R2TERR_BADMSG, "invalid address family");
+		return protoerror(tid, R2TERR_BADMSG, "invalid address family");
 
-	if (msg->hostname[len-6])
-		return protoerror(msg->id, R2TERR_BADMSG, "invalid hostname");
+	if (msg->hostname[len-4])
+		return protoerror(tid, R2TERR_BADMSG, "invalid hostname");
 
-	tunnel_create(msg->id, r2taf_to_sysaf[msg->af],
+	tunnel_create(tid, r2taf_to_sysaf[msg->af],
 						msg->hostname, ntohs(msg->port), bind_tunnel);
 
 	return 0;
 }
-	
-static int cmd_conn(const r2tmsg_connreq_t *msg, unsigned int len)
+
+static int cmd_conn(unsigned int tid, const r2tmsg_connreq_t *msg,
+							unsigned int len)
 {
 	trace_chan("len=%u, tid=0x%02x, af=0x%02x, port=0x%04x",
-		len, msg->id, msg->af, msg->port);
+		len, tid, msg->af, msg->port);
 
-	return start_tcp_tunnel(msg, len, 0);
+	return start_tcp_tunnel(tid, msg, len, 0);
 }
 
-static int cmd_bind(const r2tmsg_connreq_t *msg, unsigned int len)
+static int cmd_bind(unsigned int tid, const r2tmsg_connreq_t *msg,
+							unsigned int len)
 {
 	trace_chan("len=%u, tid=0x%02x, af=0x%02x, port=0x%04x",
-		len, msg->id, msg->af, msg->port);
+		len, tid, msg->af, msg->port);
 
-	return start_tcp_tunnel(msg, len, 1);
+	return start_tcp_tunnel(tid, msg, len, 1);
 }
 
-static int cmd_close(const r2tmsg_t *msg, unsigned int len)
+static int cmd_close(unsigned int tid, const void *body, unsigned int len)
 {
 	tunnel_t *tun;
-	
-	trace_chan("len=%u, tid=0x%02x", len, msg->id);
-	tun = tunnel_lookup(msg->id);
+
+	trace_chan("len=%u, tid=0x%02x", len, tid);
+	tun = tunnel_lookup(tid);
 	if (!tun) {
-		error("invalid tunnel id 0x%02x", msg->id);
+		error("invalid tunnel id 0x%02x", tid);
 		return 0;
 	}
 
@@ -86,26 +98,120 @@ static int cmd_close(const r2tmsg_t *msg, unsigned int len)
 	return 0;
 }
 
-static int cmd_data(const r2tmsg_t *msg, unsigned int len)
+static int cmd_data(unsigned int tid, const void *body, unsigned int len)
 {
 	tunnel_t *tun;
-	
-	trace_chan("len=%u, id=0x%02x", len, msg->id);
-	tun = tunnel_lookup(msg->id);
+
+	trace_chan("len=%u, id=0x%02x", len, tid);
+	tun = tunnel_lookup(tid);
 	if (!tun) {
-		error("invalid tunnel id 0x%02x", msg->id);
+		error("invalid tunnel id 0x%02x", tid);
 		return 0;
 	}
 
-	return tunnel_write(tun, ((const char *)msg)+2, len-2);
+	return tunnel_write(tun, body, len);
+}
+
+static int cmd_ping(unsigned int tid, const void *body, unsigned int len)
+{
+	trace_chan("len=%u, tid=0x%02x", len, tid);
+
+	if (len >= 4) {
+		if (tid == 1) // echo of a local probe
+			channel_rtt_event(ntohl(*(const unsigned int *)body));
+		else // client probe, echo its timestamp back
+			channel_write(R2TCMD_PING, 1, body, 4);
+	}
+
+	return 0;
+}
+
+static int cmd_hello(unsigned int tid, const r2tmsg_hello_t *msg,
+							unsigned int len)
+{
+	trace_chan("len=%u, caps=0x%02x", len, msg->caps);
+
+	// the identifier byte flags the framing acknowledgment
+	channel_hello_event(msg->caps, tid == 1);
+	return 0;
+}
+
+static int cmd_zdata(unsigned int tid, const r2tmsg_zdata_t *msg,
+							unsigned int len)
+{
+	tunnel_t *tun;
+	unsigned int raw_len;
+
+	trace_chan("len=%u, id=0x%02x", len, tid);
+	tun = tunnel_lookup(tid);
+	if (!tun) {
+		error("invalid tunnel id 0x%02x", tid);
+		return 0;
+	}
+
+	raw_len = ntohl(msg->raw_len);
+	if (!raw_len || (raw_len > RDP2TCP_MAX_MSGLEN))
+		return protoerror(tid, R2TERR_BADMSG, "invalid raw size");
+
+	return channel_zdata_recv(tun, ((const char *)msg)+4, len-4, raw_len);
+}
+
+static int cmd_wndup(unsigned int tid, const r2tmsg_wndup_t *msg,
+							unsigned int len)
+{
+	tunnel_t *tun;
+
+	trace_chan("len=%u, id=0x%02x", len, tid);
+
+	// window updates may cross a R2TCMD_CLOSE in flight, ignore them
+	tun = tunnel_lookup(tid);
+	if (!tun)
+		return 0;
+
+	if (tunnel_window_event(tun, ntohl(msg->len)) < 0)
+		tunnel_close(tun);
+
+	return 0;
+}
+
+static int cmd_udata(unsigned int tid, const void *body, unsigned int len)
+{
+	tunnel_t *tun;
+
+	trace_chan("len=%u, id=0x%02x", len, tid);
+
+	// datagrams may cross a R2TCMD_CLOSE in flight, ignore them
+	tun = tunnel_lookup(tid);
+	if (!tun || !tun->udp)
+		return 0;
+
+	return tunnel_udata_event(tun, body, len);
+}
+
+static int cmd_resume(unsigned int tid, const r2tmsg_resume_t *msg,
+							unsigned int len)
+{
+	unsigned long long seq;
+
+	trace_chan("len=%u, tid=0x%02x", len, tid);
+
+	seq = ((unsigned long long) ntohl(msg->seq_hi) << 32)
+			| ntohl(msg->seq_lo);
+	return tunnel_resume_event(tid, seq);
 }
 
 const cmdhandler_t cmd_handlers[R2TCMD_MAX] = {
 	(cmdhandler_t) cmd_conn,  /* R2TCMD_CONN */
 	(cmdhandler_t) cmd_close, /* R2TCMD_CLOSE */
 	(cmdhandler_t) cmd_data,  /* R2TCMD_DATA */
-	NULL,
+	(cmdhandler_t) cmd_ping,  /* R2TCMD_PING */
 	(cmdhandler_t) cmd_bind,  /* R2TCMD_BIND */
-	NULL
+	NULL,
+	(cmdhandler_t) cmd_hello, /* R2TCMD_HELLO */
+	(cmdhandler_t) cmd_zdata, /* R2TCMD_ZDATA */
+	(cmdhandler_t) cmd_wndup, /* R2TCMD_WNDUP */
+	(cmdhandler_t) cmd_udata, /* R2TCMD_UDATA */
+	NULL,                     /* R2TCMD_LATSTAT (never received) */
+	(cmdhandler_t) cmd_resume /* R2TCMD_RESUME */
 };
 
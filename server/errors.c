@@ -60,3 +60,10 @@ int syserror(const char *func)
 	return do_error(func, GetLastError());
 }
 
+/** print a win32-level error captured earlier, e.g. on a worker
+ * thread where the log ring must not be touched */
+int syserror2(const char *func, DWORD err)
+{
+	return do_error(func, err);
+}
+
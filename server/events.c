@@ -23,11 +23,133 @@
 #include "r2twin.h"
 #include "rdp2tcp.h"
 
-extern struct list_head all_tunnels;
+/*
+ * The loop is driven by a single I/O completion port instead of
+ * WaitForMultipleObjects, which hard-caps at 64 handles. Every event
+ * handle (WSAEventSelect events, overlapped aio events, process
+ * handles) is bridged to the port with a one-shot registered wait
+ * whose callback posts the registration slot as completion key; the
+ * kernel wait thread-pool scales past the 64-handle cliff and the
+ * key gives O(1) event-to-tunnel translation.
+ */
+
+/** 2 events per channel stripe + 3 handles per process tunnel;
+ * the completion key packs the slot in 16 bits so the table must
+ * stay below 0x10000 entries (wait-object pressure bounds practical
+ * concurrency well before the 16-bit tunnel ID space anyway) */
+#define EVENT_MAX_REGS (2*RDP2TCP_MAX_STRIPES + 3*0x1000)
+
+/** slots reserved for the TS virtual channel stripes */
+#define EVENT_CHAN_WRITE_SLOT(s) (2*(s))
+#define EVENT_CHAN_READ_SLOT(s)  (2*(s)+1)
+/** first slot available for tunnel registrations */
+#define EVENT_CHAN_SLOTS (2*RDP2TCP_MAX_STRIPES)
+
+/** completion key of worker pool jobs */
+#define EVENT_JOB_KEY ((ULONG_PTR)~0)
+
+/** bridged event handle */
+typedef struct _evtreg {
+	HANDLE evt;         /**< waited handle (NULL when slot is free) */
+	HANDLE wait;        /**< one-shot wait registration or NULL */
+	unsigned short gen; /**< generation, stale completions are dropped */
+	unsigned short id;  /**< rdp2tcp tunnel ID or stripe index */
+	unsigned char type; /**< EVT_xxx */
+} evtreg_t;
 
-static unsigned int events_count = 0;
-static HANDLE all_events[0x102] = {0, };
-static unsigned char evtid_to_tunid[0x102] = {0, };
+static HANDLE iocp;
+static evtreg_t all_regs[EVENT_MAX_REGS];
+
+/** slot to re-arm once its event has been handled */
+static unsigned int rearm_slot = EVENT_MAX_REGS;
+
+/** wait thread-pool callback, runs outside the main thread */
+static void CALLBACK event_fired(void *key, BOOLEAN timedout)
+{
+	(void) timedout;
+	PostQueuedCompletionStatus(iocp, 0, (ULONG_PTR) key, NULL);
+}
+
+/** arm the one-shot wait of a registration slot
+ * @param[in] i registration slot
+ * @return 0 on success */
+static int event_arm(unsigned int i)
+{
+	evtreg_t *reg;
+
+	reg = &all_regs[i];
+	assert(reg->evt && !reg->wait);
+
+	if (!RegisterWaitForSingleObject(&reg->wait, reg->evt, event_fired,
+				(void *)(ULONG_PTR)((i << 16) | reg->gen),
+				INFINITE, WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD))
+		return syserror("RegisterWaitForSingleObject");
+
+	return 0;
+}
+
+/** cancel the pending wait of a registration slot
+ * @param[in] i registration slot */
+static void event_disarm(unsigned int i)
+{
+	evtreg_t *reg;
+
+	reg = &all_regs[i];
+	if (reg->wait) {
+		// block until a possibly in-flight callback has posted
+		UnregisterWaitEx(reg->wait, INVALID_HANDLE_VALUE);
+		reg->wait = NULL;
+	}
+	// drop completions already queued for this registration
+	++reg->gen;
+}
+
+/** bridge an event handle to the completion port
+ * @param[in] evt event handle
+ * @param[in] id rdp2tcp tunnel ID
+ * @param[in] type event type (EVT_xxx)
+ * @return 0 on success */
+static int event_register(HANDLE evt, unsigned int id, unsigned char type)
+{
+	unsigned int i;
+
+	for (i=EVENT_CHAN_SLOTS; i<EVENT_MAX_REGS; ++i) {
+		if (!all_regs[i].evt) {
+			all_regs[i].evt  = evt;
+			all_regs[i].id   = (unsigned short) id;
+			all_regs[i].type = type;
+			if (event_arm(i)) {
+				all_regs[i].evt = NULL;
+				return -1;
+			}
+			return 0;
+		}
+	}
+
+	return error("too many registered events");
+}
+
+/** bridge the events of a virtual channel stripe
+ * @param[in] stripe stripe index
+ * @param[in] wevt stripe write-event
+ * @param[in] revt stripe read-event
+ * @return 0 on success */
+int event_add_stripe(unsigned int stripe, HANDLE wevt, HANDLE revt)
+{
+	trace_evt("stripe=%u, wevt=%x, revt=%x", stripe, wevt, revt);
+	assert(stripe < RDP2TCP_MAX_STRIPES);
+
+	all_regs[EVENT_CHAN_WRITE_SLOT(stripe)].evt  = wevt;
+	all_regs[EVENT_CHAN_WRITE_SLOT(stripe)].id   = (unsigned short) stripe;
+	all_regs[EVENT_CHAN_WRITE_SLOT(stripe)].type = EVT_CHAN_WRITE;
+
+	all_regs[EVENT_CHAN_READ_SLOT(stripe)].evt  = revt;
+	all_regs[EVENT_CHAN_READ_SLOT(stripe)].id   = (unsigned short) stripe;
+	all_regs[EVENT_CHAN_READ_SLOT(stripe)].type = EVT_CHAN_READ;
+
+	// the write event is only armed while a channel write is pending
+	return event_arm(EVENT_CHAN_READ_SLOT(stripe));
+}
 
 /** initialize the TS events loop
  * @param[in] wevt TS virtual channel write-event
@@ -35,32 +157,24 @@ static unsigned char evtid_to_tunid[0x102] = {0, };
 void events_init(HANDLE wevt, HANDLE revt)
 {
 	trace_evt("wevt=%x, revt=%x", wevt, revt);
-	all_events[0] = wevt;
-	all_events[1] = revt;
-	events_count = 2;
+
+	iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (!iocp) {
+		syserror("CreateIoCompletionPort");
+		return;
+	}
+
+	event_add_stripe(0, wevt, revt);
 }
 
 /** register a network tunnel event
  * @param[in] evt TS virtual channel socket event
  * @param[in] id rdp2tcp tunnel ID
  * @return 0 on success */
-int event_add_tunnel(HANDLE evt, unsigned char id)
+int event_add_tunnel(HANDLE evt, unsigned int id)
 {
-	unsigned int i;
-
 	trace_evt("evt=%x, id=0x%02x", evt, id);
-
-	i = events_count;
-	if (i >= 0x101) {
-		return -1;
-	}
-
-	all_events[i] = evt;
-	evtid_to_tunid[i] = id;
-
-	++events_count;
-
-	return 0;
+	return event_register(evt, id, EVT_TUNNEL);
 }
 
 /** register a process tunnel event
@@ -69,97 +183,135 @@ int event_add_tunnel(HANDLE evt, unsigned char id)
  * @param[in] we child process write event
  * @param[in] id rdp2tcp tunnel ID
  * @return 0 on success */
-int event_add_process(HANDLE proc, HANDLE re, HANDLE we, unsigned char id)
+int event_add_process(HANDLE proc, HANDLE re, HANDLE we, unsigned int id)
 {
-	unsigned int i;
-
 	trace_evt("proc=%x, revt=%x, wevt=%x, id=%u", proc, re, we, id);
 
-	i = events_count;
-	if (i+2 >= 0x101) {
+	if (event_register(proc, id, EVT_TUNNEL))
+		return -1;
+	if (event_register(re, id, EVT_TUNNEL)) {
+		event_del_tunnel(id);
+		return -1;
+	}
+	if (event_register(we, id, EVT_TUNNEL)) {
+		event_del_tunnel(id);
 		return -1;
 	}
-
-	all_events[i] = proc;
-	all_events[i+1] = re; // read overlapped event
-	all_events[i+2] = we; // write overlapped event
-
-	evtid_to_tunid[i] = id;
-	evtid_to_tunid[i+1] = id;
-	evtid_to_tunid[i+2] = id;
-
-	events_count += 3;
 
 	return 0;
 }
 
 /** remove events associated with a rdp2tcp tunnel
  * @param[in] id rdp2tcp tunnel ID */
-void event_del_tunnel(unsigned char id)
+void event_del_tunnel(unsigned int id)
 {
-	unsigned int i, j;
+	unsigned int i;
 
 	trace_evt("id=0x%02x", id);
 
-	for (i=2, j=0; i<events_count; ++i) {
-		if (evtid_to_tunid[i] == id)
-			++j;
-		else if (j)
-			break;
-	}
-
-	if (j > 0) {
-		if (i < events_count) {
-			memmove(&evtid_to_tunid[i-j], &evtid_to_tunid[i],
-						sizeof(evtid_to_tunid[0]) * (events_count-i));
-			memmove(&all_events[i-j], &all_events[i],
-						sizeof(all_events[0]) * (events_count-i));
+	for (i=EVENT_CHAN_SLOTS; i<EVENT_MAX_REGS; ++i) {
+		if (all_regs[i].evt && (all_regs[i].id == id)) {
+			event_disarm(i);
+			all_regs[i].evt = NULL;
 		}
-		events_count -= j;
 	}
 }
 
+/** post a completed worker job back to the main loop
+ * @param[in] job completed job
+ * @return 0 on success
+ * @note called from worker threads */
+int event_post_job(job_t *job)
+{
+	if (!PostQueuedCompletionStatus(iocp, 0, EVENT_JOB_KEY,
+												(OVERLAPPED *) job))
+		return syserror("PostQueuedCompletionStatus");
+	return 0;
+}
+
 /** wait for tunnel events
  * @param[out] out_tun tunnel associated with last event
  * @param[out] out_h last event handle
+ * @param[out] out_stripe channel stripe index for EVT_CHAN_xxx events
  * @return the last event type (EVT_xxx) or -1 on error */
-int event_wait(tunnel_t **out_tun, HANDLE *out_h)
+int event_wait(tunnel_t **out_tun, HANDLE *out_h, unsigned int *out_stripe)
 {
-	DWORD ret, off;
+	DWORD nbytes;
+	ULONG_PTR key;
+	OVERLAPPED *ov;
+	unsigned int i, s;
+	evtreg_t *reg;
 	tunnel_t *tun;
 
-	off = (channel_write_pending() ? 0 : 1);
+	for (;;) {
 
-	trace_evt("WaitForMultipleObjects: events_count=%i, offset=%i, events: %x", events_count, off, all_events[off]);
-	ret = WaitForMultipleObjects(events_count-off, &all_events[off], FALSE,
-											RDP2TCP_PING_DELAY*1000);
+		// re-arm the slot whose event was handled by the main loop
+		if (rearm_slot < EVENT_MAX_REGS) {
+			reg = &all_regs[rearm_slot];
+			if (reg->evt && !reg->wait)
+				event_arm(rearm_slot);
+			rearm_slot = EVENT_MAX_REGS;
+		}
 
-	if (ret == WAIT_FAILED) {
-		assert(GetLastError() != ERROR_INVALID_HANDLE);
-		return syserror("WaitForMultipleObjects");
-	}
+		// a channel write event stays signaled while no write is
+		// pending, only watch it when there is something to flush
+		for (s=0; s<RDP2TCP_MAX_STRIPES; ++s) {
+			reg = &all_regs[EVENT_CHAN_WRITE_SLOT(s)];
+			if (!reg->evt)
+				continue;
+			if (channel_write_pending(s)) {
+				if (!reg->wait)
+					event_arm(EVENT_CHAN_WRITE_SLOT(s));
+			} else if (reg->wait) {
+				event_disarm(EVENT_CHAN_WRITE_SLOT(s));
+			}
+		}
 
-	if (ret == WAIT_TIMEOUT) {
-		return EVT_PING;
-	}
+		ov = NULL;
+		if (!GetQueuedCompletionStatus(iocp, &nbytes, &key, &ov,
+													RDP2TCP_PING_DELAY*1000)) {
+			if (GetLastError() == WAIT_TIMEOUT)
+				return EVT_PING;
+			if (!ov)
+				return syserror("GetQueuedCompletionStatus");
+			continue;
+		}
 
-	ret -= WAIT_OBJECT_0;
-	trace_evt("off=%i --> 0x%x (evt=0x%x)", off, ret, all_events[off+ret]);
+		if (key == EVENT_JOB_KEY) {
+			// worker job completed, finish it on the main thread
+			((job_t *) ov)->complete((job_t *) ov);
+			continue;
+		}
 
-	if (ret == 0) {
-		return (off == 0 ? EVT_CHAN_WRITE : EVT_CHAN_READ);
-	}
+		i = (unsigned int)(key >> 16);
+		assert(i < EVENT_MAX_REGS);
+		reg = &all_regs[i];
 
-	if ((ret == 1) && (off == 0)) {
-		return EVT_CHAN_READ;
-	}
+		// stale completion from a closed tunnel or a disarmed wait
+		if (!reg->evt || ((unsigned short)(key & 0xffff) != reg->gen))
+			continue;
 
-	tun = tunnel_lookup(evtid_to_tunid[off+ret]);
-	if (!tun) {
-		return error("invalid tunnel event 0x%02x", evtid_to_tunid[off+ret]);
-	}
+		if (reg->wait) {
+			UnregisterWaitEx(reg->wait, INVALID_HANDLE_VALUE);
+			reg->wait = NULL;
+		}
+		trace_evt("slot=%u, type=%u, id=0x%02x", i, reg->type, reg->id);
 
-	*out_tun = tun;
-	*out_h   = all_events[off+ret];
-	return EVT_TUNNEL;
+		if (reg->type != EVT_TUNNEL) {
+			rearm_slot = (reg->type == EVT_CHAN_READ ? i : EVENT_MAX_REGS);
+			*out_stripe = reg->id;
+			return reg->type;
+		}
+
+		tun = tunnel_lookup(reg->id);
+		if (!tun) {
+			error("invalid tunnel event 0x%02x", reg->id);
+			continue;
+		}
+
+		rearm_slot = i;
+		*out_tun = tun;
+		*out_h   = reg->evt;
+		return EVT_TUNNEL;
+	}
 }
@@ -38,9 +38,11 @@
 
 void bye(void)
 {
+	workers_kill();
 	channel_kill();
 	tunnels_kill();
 	net_exit();
+	print_flush();
 	exit(0);
 }
 
@@ -61,6 +63,7 @@ static void setup(void)
 {
 	print_init();
 	net_init();
+	workers_init();
 	SetConsoleCtrlHandler(on_signal, TRUE);
 }
 
@@ -78,7 +81,7 @@ static int ping(time_t *now)
 	time(now);
 	if (!last_ping || (last_ping + RDP2TCP_PING_DELAY - 1 < *now)) {
 		last_ping = *now;
-		return channel_write(R2TCMD_PING, 0, NULL, 0);
+		return channel_ping();
 	}
 
 	return 0;
@@ -90,6 +93,7 @@ int main(int argc, char **argv)
 	const char *chan_name;
 	tunnel_t *tun;
 	HANDLE h;
+	unsigned int stripe;
 	time_t now;
 
 	if (argc > 2)
@@ -108,18 +112,18 @@ int main(int argc, char **argv)
 		// I/O loop
 		while (ret >= 0) {
 
-			switch (event_wait(&tun, &h)) {
+			switch (event_wait(&tun, &h, &stripe)) {
 
 				case EVT_CHAN_WRITE: // virtual channel outgoing data
 					debug(0, "EVT_CHAN_WRITE");
-					ret = channel_write_event();
+					ret = channel_write_event(stripe);
 					if (!ret)
 						last_ping = now;
 					break;
 
 				case EVT_CHAN_READ: // virtual channel incoming data
 					debug(0, "EVT_CHAN_READ");
-					ret = channel_read_event();
+					ret = channel_read_event(stripe);
 					if (ret >= 0)
 						ping(&now);
 					break;
@@ -130,6 +134,7 @@ int main(int argc, char **argv)
 					break;
 
 				case EVT_PING: // ping delay
+					print_flush();
 					if (channel_is_connected()) {
 						debug(0, "EVT_PING");
 						ret = ping(&now);
@@ -25,50 +25,84 @@
 #include "rdp2tcp.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
 /** default stdin/stdout pipes name prefix */
 #define PIPE_NAME "r2tcmd"
 
+/** default stdin/stdout pipe buffer size (bytes) */
+#define PIPE_BUFSIZE (256*1024)
+
 static void pipe_close(HANDLE *pfd)
 {
 	CloseHandle(pfd[0]);
 	CloseHandle(pfd[1]);
 }
 
-static int pipe_create(HANDLE *pfd, int parent_fd)
+/**
+ * create a one-way overlapped pipe between rdp2tcp and a child process
+ * @param[out] pfd parent (overlapped) and child (synchronous) pipe ends
+ * @param[in] outbound 1 if the parent writes, 0 if the parent reads
+ * @param[out] sysfunc failed win32 API name
+ * @param[out] syserr captured win32 error code
+ * @return 0 on success
+ * @note the parent always keeps the overlapped server end (pfd[0]) so
+ *       both directions can be driven by the aio layer, while the child
+ *       inherits a synchronous end (pfd[1]) fit for blocking stdio;
+ *       RDP2TCP_PIPE_BUFSIZE overrides the kernel buffer size
+ */
+static int pipe_create(
+			HANDLE *pfd,
+			int outbound,
+			const char **sysfunc,
+			DWORD *syserr)
 {
 	HANDLE fd;
 	SECURITY_ATTRIBUTES sattr;
+	unsigned int bufsize;
+	const char *env;
 	char name[128];
 
 	memset(&sattr, 0, sizeof(sattr));
 	sattr.nLength = sizeof(sattr);
 	sattr.bInheritHandle = TRUE;
 
+	bufsize = PIPE_BUFSIZE;
+	env = getenv("RDP2TCP_PIPE_BUFSIZE");
+	if (env && (atoi(env) > 0))
+		bufsize = (unsigned int) atoi(env);
+
 	snprintf(name, sizeof(name)-1, "\\\\.\\pipe\\" PIPE_NAME "-%lu-%i",
 			GetCurrentProcessId(), rand());
 
 	fd = CreateNamedPipeA(name,
-			PIPE_ACCESS_INBOUND|FILE_FLAG_OVERLAPPED,
-			PIPE_TYPE_BYTE|PIPE_WAIT, 2, NETBUF_MAX_SIZE/2, NETBUF_MAX_SIZE/2,
+			(outbound ? PIPE_ACCESS_OUTBOUND : PIPE_ACCESS_INBOUND)
+				| FILE_FLAG_OVERLAPPED,
+			PIPE_TYPE_BYTE|PIPE_WAIT, 2, bufsize, bufsize,
 			5000 /*msec*/, &sattr);
-	if (fd == INVALID_HANDLE_VALUE)
-		return syserror("CreateNamedPipe");
+	if (fd == INVALID_HANDLE_VALUE) {
+		*sysfunc = "CreateNamedPipe";
+		*syserr = GetLastError();
+		return -1;
+	}
 
 	pfd[0] = fd;
 
-	fd = CreateFileA(name, GENERIC_WRITE, 0, &sattr, 
+	fd = CreateFileA(name,
+			(outbound ? GENERIC_READ : GENERIC_WRITE), 0, &sattr,
 			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (fd == INVALID_HANDLE_VALUE) {
-		syserror("CreateFile");
+		*sysfunc = "CreateFile";
+		*syserr = GetLastError();
 		CloseHandle(pfd[0]);
 		return -1;
 	}
 
 	pfd[1] = fd;
 
-	if (!SetHandleInformation(pfd[parent_fd], HANDLE_FLAG_INHERIT, 0)) {
-		syserror("SetHandleInformation");
+	if (!SetHandleInformation(pfd[0], HANDLE_FLAG_INHERIT, 0)) {
+		*sysfunc = "SetHandleInformation";
+		*syserr = GetLastError();
 		pipe_close(pfd);
 		return -1;
 	}
@@ -76,11 +110,26 @@ static int pipe_create(HANDLE *pfd, int parent_fd)
 	return 0;
 }
 
-static int start_child(
+/**
+ * spawn a child process with redirected stdin/stdout/stderr
+ * @param[in] cmd command line to execute
+ * @param[out] out_std child stdout/stdin pipe ends
+ * @param[out] pi process information
+ * @param[out] err rdp2tcp error code on failure
+ * @param[out] sysfunc failed win32 API name, NULL if none
+ * @param[out] syserr captured win32 error code
+ * @return 0 on success
+ * @note blocking, may run on a worker thread; the log ring belongs to
+ *       the event loop so failures are only captured here and logged
+ *       by the completion half (process_attach)
+ */
+int process_spawn(
 					const char *cmd,
 					HANDLE *out_std,
 					PROCESS_INFORMATION *pi,
-					unsigned char *err)
+					unsigned char *err,
+					const char **sysfunc,
+					DWORD *syserr)
 {
 	BOOL res;
 	HANDLE stderr_child, pstdin[2], pstdout[2];
@@ -88,13 +137,15 @@ static int start_child(
 
 	trace_proc("%s", cmd);
 	*err = R2TERR_GENERIC;
+	*sysfunc = NULL;
+	*syserr = 0;
 
-	// stdin pipe
-	if (pipe_create(pstdin, 1))
+	// stdin pipe, parent writes
+	if (pipe_create(pstdin, 1, sysfunc, syserr))
 		return -1;
 
-	// stdout pipe
-	if (pipe_create(pstdout, 0)) {
+	// stdout pipe, parent reads
+	if (pipe_create(pstdout, 0, sysfunc, syserr)) {
 		pipe_close(pstdin);
 		return -1;
 	}
@@ -109,7 +160,7 @@ static int start_child(
 		memset(&si, 0, sizeof(si));
 		si.cb         = sizeof(si);
 		si.dwFlags    = STARTF_USESTDHANDLES;
-		si.hStdInput  = pstdin[0];
+		si.hStdInput  = pstdin[1];
 		si.hStdOutput = pstdout[1];
 		si.hStdError  = stderr_child;
 
@@ -118,10 +169,10 @@ static int start_child(
 		if (res) {
 			CloseHandle(stderr_child);
 			CloseHandle(pi->hThread);
-			CloseHandle(pstdin[0]);
+			CloseHandle(pstdin[1]);
 			CloseHandle(pstdout[1]);
 			out_std[0] = pstdout[0];
-			out_std[1] = pstdin[1];
+			out_std[1] = pstdin[0];
 			return 0;
 		}
 
@@ -132,13 +183,15 @@ static int start_child(
 				break;
 
 			default:
-				syserror("CreateProcess");
+				*sysfunc = "CreateProcess";
+				*syserr = GetLastError();
 		}
 
 		CloseHandle(stderr_child);
 
 	} else {
-		syserror("DuplicateHandle");
+		*sysfunc = "DuplicateHandle";
+		*syserr = GetLastError();
 	}
 
 	pipe_close(pstdout);
@@ -148,43 +201,63 @@ static int start_child(
 }
 
 /**
- * spawn a child process and attach stdin/stdout/stderr to tunnel
+ * attach a spawned child process to its tunnel and answer the client
  * @param[in] tun the new tunnel
- * @param[in] cmd command line to execute
+ * @param[in] cmd command line (for logging)
+ * @param[in] ret process_spawn return value
+ * @param[in] pstd child stdout/stdin pipe ends
+ * @param[in] pi process information
+ * @param[in] err rdp2tcp error code reported by process_spawn
+ * @param[in] sysfunc win32 API process_spawn failed on, NULL if none
+ * @param[in] syserr win32 error code captured by process_spawn
  * @return 0 on success
+ * @note runs on the main loop, which owns the log ring; spawn errors
+ *       captured on a worker thread are reported here
  */
-int process_start(tunnel_t *tun, const char *cmd)
+int process_attach(
+				tunnel_t *tun,
+				const char *cmd,
+				int ret,
+				HANDLE *pstd,
+				PROCESS_INFORMATION *pi,
+				unsigned char err,
+				const char *sysfunc,
+				DWORD syserr)
 {
-	int ret;
 	unsigned int ans_len;
 	unsigned long pid;
-	HANDLE pstd[2];
-	PROCESS_INFORMATION pi;
 	r2tmsg_connans_t ans;
 
-	trace_proc("tid=0x%02x cmd=%s", tun->id, cmd);
+	trace_proc("tid=0x%02x cmd=%s ret=%i", tun->id, cmd, ret);
+
+	if (ret && sysfunc)
+		syserror2(sysfunc, syserr);
 
 	memset(&ans, 0, sizeof(ans));
+	ans.err = err;
 	ans_len = 1;
 
-	ret = start_child(cmd, pstd, &pi, &ans.err);
 	if (!ret) {
 
 		if (!aio_init_forward(&tun->rio, &tun->wio, "proc")) {
 
-			if (!event_add_process(pi.hProcess, tun->rio.io.hEvent,
+			// process output streams in whole buffers right away instead
+			// of ramping up from 1KB chunks
+			tun->rio.min_io_size = NETBUF_MAX_SIZE;
+
+			if (!event_add_process(pi->hProcess, tun->rio.io.hEvent,
 										tun->wio.io.hEvent, tun->id)) {
 
 				tun->rfd  = pstd[0];
 				tun->wfd  = pstd[1];
-				tun->proc = pi.hProcess;
+				tun->proc = pi->hProcess;
 
 				info(0, "started process %s with pid %u for tunnel 0x%02x",
-						cmd, (unsigned int) pi.dwProcessId,  tun->id);
+						cmd, (unsigned int) pi->dwProcessId,  tun->id);
 
 				ans.err  = R2TERR_SUCCESS;
 				ans.af   = TUNAF_ANY;
-				pid = htonl(pi.dwProcessId);
+				pid = htonl(pi->dwProcessId);
 				memcpy(&ans.addr[0], &pid, 4);
 				ans_len = 8;
 
@@ -202,8 +275,8 @@ int process_start(tunnel_t *tun, const char *cmd)
 
 	if (!ret) {
 		event_del_tunnel(tun->id);
-		TerminateProcess(pi.hProcess, 0);
-		CloseHandle(pi.hProcess);
+		TerminateProcess(pi->hProcess, 0);
+		CloseHandle(pi->hProcess);
 		CloseHandle(pstd[0]);
 		CloseHandle(pstd[1]);
 	}
@@ -211,6 +284,27 @@ int process_start(tunnel_t *tun, const char *cmd)
 	return error("failed to start process %s for tunnel 0x%02x", cmd, tun->id);
 }
 
+/**
+ * spawn a child process and attach stdin/stdout/stderr to tunnel
+ * @param[in] tun the new tunnel
+ * @param[in] cmd command line to execute
+ * @return 0 on success
+ */
+int process_start(tunnel_t *tun, const char *cmd)
+{
+	int ret;
+	unsigned char err;
+	const char *sysfunc;
+	DWORD syserr;
+	HANDLE pstd[2];
+	PROCESS_INFORMATION pi;
+
+	trace_proc("tid=0x%02x cmd=%s", tun->id, cmd);
+
+	ret = process_spawn(cmd, pstd, &pi, &err, &sysfunc, &syserr);
+	return process_attach(tun, cmd, ret, pstd, &pi, err, sysfunc, syserr);
+}
+
 /**
  * stop a tunnel associated with a process
  * @param[in] tun the process tunnel
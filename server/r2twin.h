@@ -30,6 +30,7 @@
 typedef struct _aio {
 	iobuf_t buf;   /**< I/O buffer */
 	unsigned int min_io_size; /**< minimal I/O buffer size */
+	unsigned int max_io_size; /**< maximal write size (0 = unlimited) */
 	int pending;   /**< 1 if an I/O is pending */
 	OVERLAPPED io; /**< async event */
 } aio_t;
@@ -39,25 +40,48 @@ typedef struct _vchannel {
 	HANDLE ts;       /**< RDP channel handle */
 	HANDLE chan;     /**< RDP channel I/O handle */
 	int connected:1; /**< 1 if channel is conneced */
+	int dynamic:1;   /**< 1 if dynamic virtual channel */
+	unsigned char caps;      /**< local capabilities (R2TCAP_xxx) */
+	unsigned char peer_caps; /**< negotiated client capabilities */
 	aio_t rio;       /**< input aio_t */
 	aio_t wio;       /**< output aio_t */
+	iobuf_t zbuf;    /**< compression scratch buffer */
 } vchannel_t;
 
+struct _pooltarget;
+
 /** rdp2tcp tunnel */
 typedef struct _tunnel {
 	struct list_head list;   /**< double-linked list */
 	sock_t sock;             /**< tunnel socket */
 	unsigned char connected; /**< 1 if tunnel is connected */
 	unsigned char server;    /**< 1 for reverse-connect tunnel */
-	unsigned char id;        /**< tunnel identifier */
+	unsigned short id;       /**< tunnel identifier */
+	unsigned char zfail;     /**< consecutive incompressible payloads */
+	unsigned char throttled; /**< 1 when flow-control window is full */
+	unsigned char udp;       /**< 1 for UDP relay tunnel */
+	unsigned char rsm_wait;  /**< 1 until the client resyncs the tunnel */
+	unsigned char rsm_on;    /**< 1 once the replay ring is initialized */
+	unsigned char fq_queued; /**< 1 while queued on the scheduler ring */
+	unsigned char pooled;    /**< 1 while parked in the warm-connection pool */
+	struct _tunnel *fq_next; /**< next tunnel on the scheduler ring */
+	struct _pooltarget *pool; /**< owning pool target while parked */
+	iobuf_t rsm_buf;         /**< replay ring (recently forwarded bytes) */
+	unsigned int wnd_used;   /**< sent payload bytes not yet acknowledged */
+	unsigned int wnd_ack;    /**< consumed payload bytes not yet reported */
 	HANDLE proc;     /**< child process HANDLE */
 	HANDLE rfd;      /**< child process stdout/stderr HANDLE */
 	HANDLE wfd;      /**< child process stdin HANDLE */
 	aio_t rio;       /**< input aio_t */
 	aio_t wio;       /**< output aio_t */
 	netaddr_t addr;  /**< network address */
+	netstats_t stats; /**< hot-path I/O counters */
 } tunnel_t;
 
+/** maximal staged payload per tunnel before its socket stops
+ * being read (fair-queuing backpressure) */
+#define CHANNEL_TXQ_MAX (256*1024)
+
 /* aio.c ***/
 #define valid_aio(aio) ((aio) && valid_iobuf(&(aio)->buf) && (aio)->io.hEvent)
 #ifdef DEBUG
@@ -74,6 +98,18 @@ typedef int (*aio_readcb_t)(iobuf_t *, void *);
 int aio_read(aio_t *, HANDLE, const char *, aio_readcb_t, void *);
 int aio_write(aio_t *, HANDLE, const char *);
 
+/* worker.c ***/
+/** blocking work shipped to the worker pool */
+typedef struct _job {
+	struct list_head list;           /**< pool queue */
+	void (*run)(struct _job *);      /**< executed on a worker thread */
+	void (*complete)(struct _job *); /**< executed on the main loop */
+} job_t;
+
+int  workers_init(void);
+void workers_kill(void);
+int  worker_post(job_t *);
+
 /* events ***/
 #define EVT_CHAN_WRITE 0
 #define EVT_CHAN_READ  1
@@ -81,35 +117,64 @@ int aio_write(aio_t *, HANDLE, const char *);
 #define EVT_PING       3
 
 void events_init(HANDLE, HANDLE);
-int event_add_tunnel(HANDLE, unsigned char);
-void event_del_tunnel(unsigned char);
-int event_add_process(HANDLE, HANDLE, HANDLE, unsigned char);
-int event_wait(tunnel_t **, HANDLE *);
+int event_add_stripe(unsigned int, HANDLE, HANDLE);
+int event_add_tunnel(HANDLE, unsigned int);
+void event_del_tunnel(unsigned int);
+int event_add_process(HANDLE, HANDLE, HANDLE, unsigned int);
+int event_post_job(job_t *);
+int event_wait(tunnel_t **, HANDLE *, unsigned int *);
 
 /* channel.c ***/
+extern unsigned int channel_window;
 int channel_init(const char *);
 void channel_kill(void);
 int channel_is_connected(void);
-int channel_read_event(void);
-int channel_write_event(void);
-int channel_write_pending(void);
-int channel_write(unsigned char, unsigned char, const void *, unsigned int);
+int channel_read_event(unsigned int);
+int channel_write_event(unsigned int);
+int channel_write_pending(unsigned int);
+int channel_write(unsigned char, unsigned int, const void *, unsigned int);
 int channel_forward(tunnel_t *);
+int channel_forward_flush(tunnel_t *);
+int channel_fq_run(void);
+void channel_fq_unlink(tunnel_t *);
+int channel_ping(void);
+void channel_hello_event(unsigned char, int);
+void channel_rtt_event(unsigned int);
+struct _lathist;
+const struct _lathist *tunnel_latstat(void);
+int channel_zdata_recv(tunnel_t *, const void *, unsigned int, unsigned int);
+int channel_wndup_active(void);
+void channel_wndup_consumed(tunnel_t *, unsigned int);
+int channel_resume_active(void);
 
 /* tunnel.c ***/
 #define valid_tunnel(tun) ((tun) && (tun)->list.next && (tun)->list.prev)
-void tunnel_create(unsigned char, int, const char *, unsigned short, int);
-tunnel_t *tunnel_lookup(unsigned char);
+void tunnel_create(unsigned int, int, const char *, unsigned short, int);
+void tunnel_create_udp(unsigned int);
+tunnel_t *tunnel_lookup(unsigned int);
+int tunnel_udata_event(tunnel_t *, const void *, unsigned int);
 int tunnel_event(tunnel_t *, HANDLE);
 int tunnel_write(tunnel_t *tun, const void *, unsigned int);
+int tunnel_window_event(tunnel_t *, unsigned int);
+int tunnel_staging_event(tunnel_t *);
+void tunnel_resume_capture(tunnel_t *, const void *, unsigned int);
+int  tunnel_resume_event(unsigned int, unsigned long long);
+void tunnels_resume_pending(void);
+int  tunnel_pool_evict(unsigned int);
 void tunnel_close(tunnel_t *);
 void tunnels_kill(void);
 
 /* errors.c ***/
 int wsaerror(const char *);
 int syserror(const char *);
+int syserror2(const char *, DWORD);
 
 /* process.c ***/
+int  process_spawn(const char *, HANDLE *, PROCESS_INFORMATION *,
+							unsigned char *, const char **, DWORD *);
+int  process_attach(tunnel_t *, const char *, int, HANDLE *,
+							PROCESS_INFORMATION *, unsigned char,
+							const char *, DWORD);
 int  process_start(tunnel_t *, const char *);
 void process_stop(tunnel_t *);
 
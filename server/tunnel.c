@@ -22,29 +22,230 @@
  */
 #include "rdp2tcp.h"
 #include "r2twin.h"
+#include "msgparser.h"
 #include "print.h"
+#include "lathist.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
 extern const char *r2t_errors[R2TERR_MAX];
 
 /** global tunnels double-linked list */
 LIST_HEAD_INIT(all_tunnels);
 
+/** maximal number of pooled tunnel_t structures */
+#define TUNNEL_POOL_SIZE 64
+
+/** recycled tunnel_t structures */
+static LIST_HEAD_INIT(free_tunnels);
+static unsigned int free_tunnels_count;
+
+/** latency tracing sample rate (1-in-N messages, 0 disables tracing,
+ * -1 until RDP2TCP_TRACE_LAT was read) */
+static unsigned int lat_sample_rate = (unsigned int) -1;
+/** messages enqueued since the last latency sample */
+static unsigned int lat_sample_count;
+/** enqueue timestamp of the in-flight sample (usecs, 0 when idle) */
+static unsigned long long lat_mark_us;
+/** tunnel owning the in-flight sample */
+static tunnel_t *lat_tun;
+/** local queue delay (channel receive --> socket buffer drained) */
+static lathist_t lat_queue;
+
+/**
+ * maybe stamp the enqueue time of a payload for latency tracing
+ * @param[in] tun destination tunnel
+ */
+static void tunnel_lat_enqueue(tunnel_t *tun)
+{
+	const char *env;
+
+	if (lat_sample_rate == (unsigned int) -1) {
+		env = getenv("RDP2TCP_TRACE_LAT");
+		lat_sample_rate = (env ? (unsigned int) atoi(env) : 0);
+	}
+
+	if (!lat_sample_rate || lat_mark_us)
+		return;
+
+	if (++lat_sample_count < lat_sample_rate)
+		return;
+
+	lat_sample_count = 0;
+	lat_mark_us = lathist_now_us();
+	lat_tun = tun;
+}
+
+/**
+ * complete the in-flight latency sample if its bytes were written out
+ * @param[in] tun flushed tunnel
+ */
+static void tunnel_lat_drained(tunnel_t *tun)
+{
+	if (lat_mark_us && (lat_tun == tun)
+			&& !iobuf_datalen(&tun->wio.buf)) {
+		lathist_add(&lat_queue, lathist_now_us() - lat_mark_us);
+		lat_mark_us = 0;
+		lat_tun = NULL;
+	}
+}
+
+/**
+ * expose the queue-delay histogram pushed to the rdp2tcp client
+ * @return NULL while latency tracing is disabled
+ */
+const lathist_t *tunnel_latstat(void)
+{
+	if (!lat_sample_rate || (lat_sample_rate == (unsigned int) -1))
+		return NULL;
+	return &lat_queue;
+}
+
+/**
+ * apply the socket tuning profile selected by RDP2TCP_SOCKPROF
+ * @param[in] tun connected or accepted TCP tunnel
+ * @note the knob is process-wide; selecting a profile per tunnel
+ *       would require a protocol extension
+ */
+static void tunnel_tune(tunnel_t *tun)
+{
+	static int profile = -1;
+	const char *env;
+
+	if (profile < 0) {
+		env = getenv("RDP2TCP_SOCKPROF");
+		profile = (env ? net_profile(env) : NETPROF_INTERACTIVE);
+		if (profile < 0) {
+			warn("unknown socket profile \"%s\"", env);
+			profile = NETPROF_INTERACTIVE;
+		}
+	}
+
+	net_tune(&tun->sock, profile);
+}
+
+/** per-tunnel replay ring capacity (bytes, 0 until env was read) */
+static unsigned int resume_bufsize;
+
+/**
+ * record forwarded payload bytes in the tunnel replay ring
+ * @param[in] tun source tunnel
+ * @param[in] data forwarded payload
+ * @param[in] len payload size
+ * @note the ring keeps the most recently forwarded bytes so the
+ *       unacknowledged tail can be replayed after a channel blip
+ */
+void tunnel_resume_capture(tunnel_t *tun, const void *data, unsigned int len)
+{
+	const char *env;
+	unsigned int total;
+
+	if (!channel_resume_active() || tun->udp || !len)
+		return;
+
+	if (!resume_bufsize) {
+		env = getenv("RDP2TCP_RESUME_BUF");
+		resume_bufsize = ((env && (atoi(env) > 0))
+								? (unsigned int) atoi(env)
+								: RDP2TCP_RESUME_BUFSIZE);
+	}
+
+	if (!tun->rsm_on) {
+		iobuf_init(&tun->rsm_buf, 'w', "rsm");
+		tun->rsm_on = 1;
+	}
+	if (tun->rsm_on != 1)
+		return; // ring fell behind, the tunnel lost resumability
+
+	if (len > resume_bufsize) {
+		data = (const char *)data + (len - resume_bufsize);
+		len = resume_bufsize;
+	}
+
+	if (!iobuf_append(&tun->rsm_buf, data, len)) {
+		// a gap in the ring would replay corrupt data; the ring may
+		// already be empty when the very first append fails
+		if (iobuf_datalen(&tun->rsm_buf))
+			iobuf_consume(&tun->rsm_buf, iobuf_datalen(&tun->rsm_buf));
+		tun->rsm_on = 2;
+		return;
+	}
+
+	total = iobuf_datalen(&tun->rsm_buf);
+	if (total > resume_bufsize)
+		iobuf_consume(&tun->rsm_buf, total - resume_bufsize);
+}
+
+/**
+ * park surviving tunnels until the reconnected client resyncs them
+ * @note called on each hello from a resume-capable client; a tunnel
+ *       still parked from the previous session belongs to a client
+ *       which never came back
+ */
+void tunnels_resume_pending(void)
+{
+	tunnel_t *tun, *bak;
+
+	list_for_each_safe(tun, bak, &all_tunnels) {
+
+		if (tun->udp || tun->server || !tun->connected)
+			continue;
+
+		if (tun->rsm_wait) {
+			info(0, "tunnel 0x%02x was never resumed, closing", tun->id);
+			tunnel_close(tun);
+			continue;
+		}
+
+		tun->rsm_wait = 1;
+	}
+}
+
+/** direct-indexed tunnel ID lookup table (id --> tunnel) */
+static tunnel_t *tunnel_table[0x10000];
+
+/** tunnel ID allocation bitmap words */
+#define TID_WORDS (0x10000/32)
+
+/** tunnel ID allocation bitmap, bit set when the ID is used
+ * (0xffff is the invalid ID and is permanently reserved) */
+static unsigned int tid_bitmap[TID_WORDS] = {
+	[TID_WORDS-1] = 0x80000000
+};
+
+#define tid_mark_used(tid) (tid_bitmap[(tid) >> 5] |=  (1U << ((tid) & 31)))
+#define tid_mark_free(tid) (tid_bitmap[(tid) >> 5] &= ~(1U << ((tid) & 31)))
+
+/** register tunnel in the ID lookup table
+ * @param[in] tun established tunnel */
+static void tunnel_register(tunnel_t *tun)
+{
+	assert(tun && (tun->id != R2T_TID_NONE) && !tunnel_table[tun->id]);
+
+	tid_mark_used(tun->id);
+	tunnel_table[tun->id] = tun;
+}
+
+/** unregister tunnel from the ID lookup table
+ * @param[in] tun established tunnel */
+static void tunnel_unregister(tunnel_t *tun)
+{
+	assert(tun && (tun->id != R2T_TID_NONE));
+
+	if (tunnel_table[tun->id] == tun) {
+		tunnel_table[tun->id] = NULL;
+		tid_mark_free(tun->id);
+	}
+}
+
 /** lookup rdp2tcp tunnel
  * @param[in] id rdp2tcp tunnel ID
  * @return NULL if tunnel is not found */
-tunnel_t *tunnel_lookup(unsigned char id)
+tunnel_t *tunnel_lookup(unsigned int id)
 {
-	tunnel_t *tun;
-
 	//trace_tun("id=0x%02x", id);
-	list_for_each(tun, &all_tunnels) {
-		if (tun->id == id)
-			return tun;
-	}
-
-	return NULL;
+	return (id < R2T_TID_NONE ? tunnel_table[id] : NULL);
 }
 
 static unsigned char wsa_to_r2t_error(int err)
@@ -61,23 +262,29 @@ static unsigned char wsa_to_r2t_error(int err)
 
 /**
  * generate a unused tunnel ID
- * @return 0xff on error (all tunnel ID are used)
+ * @return R2T_TID_NONE on error (all tunnel ID are used)
 	// in most cases tunnel IDs are generated by the client
 	// this is the single case where it is generated by the server
  */
-static unsigned char tunnel_generate_id(void)
+static unsigned int tunnel_generate_id(void)
 {
-	unsigned char tid;
-	static unsigned char last_tid = 0xff;
-
-	for (tid=last_tid+1; tid!=last_tid; ++tid) {
-		if (!tunnel_lookup(tid)) {
-			last_tid = tid;
-			return tid;
+	unsigned int i, n, bit, word;
+
+	// stick to single-byte identifiers until protocol v2 is negotiated
+	n = (r2t_tid16_out ? TID_WORDS : 8);
+
+	for (i=0; i<n; ++i) {
+		word = tid_bitmap[i];
+		if (!r2t_tid16_out && (i == 7))
+			word |= 0x80000000; // 0xff is invalid on a v1 wire
+		if (word != 0xffffffff) {
+			for (bit=0; word & 1; ++bit)
+				word >>= 1;
+			return (i << 5) + bit;
 		}
 	}
 
-	return 0xff;
+	return R2T_TID_NONE;
 }
 
 static unsigned int netaddr_to_connans(
@@ -87,18 +294,17 @@ static unsigned int netaddr_to_connans(
 	unsigned int msg_len;
 
 	memset(msg, 0, sizeof(*msg));
-	msg->err = R2TERR_SUCCESS;
 
 	if (netaddr_af(addr) == AF_INET) {
 		msg->af   = TUNAF_IPV4;
 		msg->port = addr->ip4.sin_port;
 		memcpy(&msg->addr, &addr->ip4.sin_addr, 4);
-		msg_len = 8;
+		msg_len = 7;
 	} else {
 		msg->af   = TUNAF_IPV6;
 		msg->port = addr->ip6.sin6_port;
 		memcpy(&msg->addr, &addr->ip6.sin6_addr, 16);
-		msg_len = 20;
+		msg_len = 19;
 	}
 
 	return msg_len;
@@ -116,8 +322,12 @@ static int tunnel_socksend_event(tunnel_t *tun)
 	if (ret < 0)
 		return error("%s", net_error(NETERR_SEND, ret));
 
-	if (w > 0)
+	if (w > 0) {
 		print_xfer("tcp", 'w', w);
+		channel_wndup_consumed(tun, w);
+		tun->stats.bytes_out += w;
+		tunnel_lat_drained(tun);
+	}
 
 	return 0;
 }
@@ -125,38 +335,44 @@ static int tunnel_socksend_event(tunnel_t *tun)
 static int tunnel_connect_event(tunnel_t *tun, int err)
 {
 	unsigned int ans_len;
-	r2tmsg_connans_t ans;
+	unsigned char ans[1+sizeof(r2tmsg_connans_t)];
 	char host[NETADDRSTR_MAXSIZE];
 
 	trace_tun("id=0x%02x, err=%i", tun->id, err);
 
-	memset(&ans, 0, sizeof(ans));
-	ans.err = R2TERR_GENERIC;
+	ans[0] = R2TERR_GENERIC;
 	ans_len = 1;
 
 	if (!err) {
 		tun->connected = 1;
+		tunnel_tune(tun);
+		if (tun->stats.t0)
+			tun->stats.connect_ms =
+					(unsigned int)(net_now_ms() - tun->stats.t0);
 		info(0, "tunnel 0x%02x connected to %s", tun->id,
             netaddr_print(&tun->addr, host));
 
 		if (!net_update_watch(&tun->sock, &tun->wio.buf)) {
 			if (iobuf_datalen(&tun->wio.buf) && (tunnel_socksend_event(tun) < 0))
 				err = 1;
-			if (!err)
-				ans_len = netaddr_to_connans(&tun->addr, &ans);
+			if (!err) {
+				ans[0] = R2TERR_SUCCESS;
+				ans_len = 1 + netaddr_to_connans(&tun->addr,
+										(r2tmsg_connans_t *)&ans[1]);
+			}
 		}
 
 	} else {
-		ans.err = wsa_to_r2t_error(err);
+		ans[0] = wsa_to_r2t_error(err);
 	}
 
-	if (ans.err != R2TERR_SUCCESS) {
+	if (ans[0] != R2TERR_SUCCESS) {
 		error("failed to connect tunnel 0x%02x (%i %s)", tun->id,
-				err, r2t_errors[ans.err]);
+				err, r2t_errors[ans[0]]);
 	}
 
-	if (channel_write(R2TCMD_CONN, tun->id, &ans.err, ans_len) >= 0) {
-		if (ans.err == R2TERR_SUCCESS)
+	if (channel_write(R2TCMD_CONN, tun->id, ans, ans_len) >= 0) {
+		if (ans[0] == R2TERR_SUCCESS)
 			return 0;
 	}
 
@@ -164,18 +380,15 @@ static int tunnel_connect_event(tunnel_t *tun, int err)
 }
 
 
-static int host_connect(
+static int host_connect_done(
 					tunnel_t *tun,
-					int pref_af,
+					int ret,
+					int err,
 					const char *host,
 					unsigned short port)
 {
-	int ret, err;
 	unsigned char msg;
 
-	ret = net_client(pref_af, host, port, &tun->sock, &tun->addr, &err);
-	debug(0, "net_client(%s, %hu) -> %i / %i", host, port, ret, err);
-
 	if (ret >= 0) {
 		info(0, "connect%s to %s:%hu", (ret > 0 ? "ing" : "ed"),
 			host, port);
@@ -199,38 +412,52 @@ static int host_connect(
 	return -1;
 }
 
-static int host_bind(
+static int host_connect(
+					tunnel_t *tun,
+					int pref_af,
+					const char *host,
+					unsigned short port)
+{
+	int ret, err;
+
+	tun->stats.t0 = net_now_ms();
+	ret = net_client(pref_af, host, port, &tun->sock, &tun->addr, &err);
+	debug(0, "net_client(%s, %hu) -> %i / %i", host, port, ret, err);
+
+	return host_connect_done(tun, ret, err, host, port);
+}
+
+static int host_bind_done(
 		tunnel_t *tun,
-		int pref_af,
+		int ret,
+		int err,
 		const char *host,
 		unsigned short port)
 {
-	int ret, err;
 	unsigned int ans_len;
-	r2tmsg_connans_t ans;
+	unsigned char ans[1+sizeof(r2tmsg_connans_t)];
 
-	memset(&ans, 0, sizeof(ans));
 	ans_len = 1;
 
-	ret = net_server(pref_af, host, port, &tun->sock, &tun->addr, &err);
 	debug(0, "bind %s:%hu ... %i/%i", host, port, ret, err);
 	if (!ret) {
 		info(0, "listening on %s:%hu", host, port);
-		ans_len = netaddr_to_connans(&tun->addr, &ans);
-		ans.err = 0;
+		ans_len = 1 + netaddr_to_connans(&tun->addr,
+								(r2tmsg_connans_t *)&ans[1]);
+		ans[0] = 0;
 		if (event_add_tunnel(tun->sock.evt, tun->id)) {
-			ans.err = R2TERR_GENERIC;
+			ans[0] = R2TERR_GENERIC;
 			net_close(&tun->sock);
 			ret = -1;
 		}
 
 	} else {
-		ans.err = wsa_to_r2t_error(err);
-		error("failed to bind %s:%hu (%i %s)", host, port, err, r2t_errors[ans.err]);
+		ans[0] = wsa_to_r2t_error(err);
+		error("failed to bind %s:%hu (%i %s)", host, port, err, r2t_errors[ans[0]]);
 	}
 
-	if (channel_write(R2TCMD_BIND, tun->id, &ans.err, ans_len) >= 0) {
-		if (!ans.err) {
+	if (channel_write(R2TCMD_BIND, tun->id, ans, ans_len) >= 0) {
+		if (!ans[0]) {
 			tun->connected = 1;
 			tun->server = 1;
 			return 0;
@@ -245,12 +472,33 @@ static int host_bind(
 	return -1;
 }
 
+static int host_bind(
+		tunnel_t *tun,
+		int pref_af,
+		const char *host,
+		unsigned short port)
+{
+	int ret, err;
+
+	ret = net_server(pref_af, host, port, &tun->sock, &tun->addr, &err);
+
+	return host_bind_done(tun, ret, err, host, port);
+}
+
 
-static tunnel_t *tunnel_alloc(unsigned char id)
+static tunnel_t *tunnel_alloc(unsigned int id)
 {
 	tunnel_t *tun;
 
-	tun = calloc(1, sizeof(*tun));
+	if (!list_empty(&free_tunnels)) {
+		tun = (tunnel_t *) free_tunnels.next;
+		list_del(&tun->list);
+		--free_tunnels_count;
+		memset(tun, 0, sizeof(*tun));
+	} else {
+		tun = calloc(1, sizeof(*tun));
+	}
+
 	if (tun) {
 		tun->id = id;
 	} else {
@@ -260,6 +508,509 @@ static tunnel_t *tunnel_alloc(unsigned char id)
 	return tun;
 }
 
+// blocking tunnel-setup work shipped to the worker pool
+#define TUNJOB_CONNECT  0
+#define TUNJOB_BIND     1
+#define TUNJOB_PROCESS  2
+#define TUNJOB_POOLFILL 3
+
+/** asynchronous tunnel setup state */
+typedef struct _tunjob {
+	job_t job;              /**< worker pool header */
+	tunnel_t *tun;          /**< tunnel being set up, not registered yet */
+	int kind;               /**< TUNJOB_xxx */
+	int ret;                /**< blocking-part return value */
+	int err;                /**< winsock error (connect/bind) */
+	unsigned char perr;     /**< rdp2tcp error (process) */
+	const char *sysfunc;    /**< failed win32 API (process) */
+	DWORD syserr;           /**< captured win32 error code (process) */
+	int pref_af;            /**< preferred address family */
+	unsigned short port;    /**< tcp port */
+	HANDLE pstd[2];         /**< child stdout/stdin pipe ends */
+	PROCESS_INFORMATION pi; /**< child process information */
+	char host[1];           /**< hostname or command line */
+} tunjob_t;
+
+/** blocking half of tunnel setup, runs on a worker thread */
+static void tunnel_setup_run(job_t *job)
+{
+	tunjob_t *tj = (tunjob_t *) job;
+	tunnel_t *tun = tj->tun;
+
+	switch (tj->kind) {
+
+		case TUNJOB_CONNECT:
+		case TUNJOB_POOLFILL:
+			tun->stats.t0 = net_now_ms();
+			tj->ret = net_client(tj->pref_af, tj->host, tj->port,
+										&tun->sock, &tun->addr, &tj->err);
+			break;
+
+		case TUNJOB_BIND:
+			tj->ret = net_server(tj->pref_af, tj->host, tj->port,
+										&tun->sock, &tun->addr, &tj->err);
+			break;
+
+		default:
+			tj->ret = process_spawn(tj->host, tj->pstd, &tj->pi, &tj->perr,
+											&tj->sysfunc, &tj->syserr);
+	}
+}
+
+static void tunnel_setup_complete(job_t *);
+static int tunnel_sockrecv_event(tunnel_t *);
+
+/** maximal number of tracked hot targets */
+#define POOL_TARGETS_MAX 8
+/** hostname size limit for a pooled target */
+#define POOL_HOST_MAX    64
+/** R2TCMD_CONN requests before a target is considered hot */
+#define POOL_HOT_SEEN    3
+/** default number of warm connections kept per hot target */
+#define POOL_DEPTH_DEFAULT 2
+
+/** warm-connection pool target */
+typedef struct _pooltarget {
+	char host[POOL_HOST_MAX]; /**< target hostname */
+	unsigned short port;      /**< target tcp port */
+	unsigned char hot;        /**< 1 once the target is being warmed */
+	unsigned char filling;    /**< pool-fill jobs in flight */
+	int pref_af;              /**< preferred address family */
+	unsigned int seen;        /**< R2TCMD_CONN requests observed */
+	unsigned int hits;        /**< tunnels bound to a warm connection */
+	unsigned int misses;      /**< hot-target connects the pool missed */
+	struct list_head conns;   /**< parked warm connections */
+	unsigned int nconns;      /**< parked warm connections count */
+} pooltarget_t;
+
+/** tracked forwarding targets, populated from R2TCMD_CONN history
+ * and RDP2TCP_POOL_TARGETS */
+static pooltarget_t pool_targets[POOL_TARGETS_MAX];
+static unsigned int pool_targets_count;
+
+static pooltarget_t *pool_target_add(
+					const char *host,
+					unsigned short port,
+					int pref_af)
+{
+	pooltarget_t *pt;
+
+	if ((pool_targets_count >= POOL_TARGETS_MAX)
+			|| (strlen(host) >= POOL_HOST_MAX))
+		return NULL;
+
+	pt = &pool_targets[pool_targets_count++];
+	strcpy(pt->host, host);
+	pt->port = port;
+	pt->pref_af = pref_af;
+	list_init(&pt->conns);
+
+	return pt;
+}
+
+static pooltarget_t *pool_target_find(const char *host, unsigned short port)
+{
+	unsigned int i;
+
+	for (i=0; i<pool_targets_count; ++i) {
+		if ((pool_targets[i].port == port)
+				&& !strcmp(pool_targets[i].host, host))
+			return &pool_targets[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * seed always-hot targets from RDP2TCP_POOL_TARGETS ("host:port,...")
+ */
+static void pool_seed_targets(void)
+{
+	pooltarget_t *pt;
+	const char *env, *sep;
+	unsigned int len;
+	int port;
+	char host[POOL_HOST_MAX];
+
+	env = getenv("RDP2TCP_POOL_TARGETS");
+	while (env && *env) {
+		sep = strchr(env, ':');
+		if (!sep)
+			break;
+		len = (unsigned int)(sep - env);
+		port = atoi(sep + 1);
+		if ((len > 0) && (len < POOL_HOST_MAX)
+				&& (port > 0) && (port < 0x10000)) {
+			memcpy(host, env, len);
+			host[len] = 0;
+			pt = pool_target_add(host, (unsigned short) port, AF_UNSPEC);
+			if (pt)
+				pt->hot = 1; // designated hot, no history needed
+		}
+		env = strchr(sep, ',');
+		if (env)
+			++env;
+	}
+}
+
+/** warm connections kept per hot target
+ * (-1 until RDP2TCP_POOL was read, 0 disables the pool) */
+static int pool_depth = -1;
+
+static unsigned int pool_config(void)
+{
+	const char *env;
+
+	if (pool_depth < 0) {
+		pool_depth = POOL_DEPTH_DEFAULT;
+		env = getenv("RDP2TCP_POOL");
+		if (env && (atoi(env) >= 0))
+			pool_depth = atoi(env);
+		if (pool_depth)
+			pool_seed_targets();
+	}
+
+	return (unsigned int) pool_depth;
+}
+
+/**
+ * generate an unused placeholder ID for a parked warm connection
+ * @return R2T_TID_NONE on error (all tunnel ID are used)
+ * @note parked connections are invisible to the client but live in the
+ *       ID table so the event loop can dispatch their events; placeholder
+ *       IDs come from the top of the space to stay clear of the bottom-up
+ *       client allocator
+ */
+static unsigned int pool_generate_id(void)
+{
+	unsigned int i, n, bit, word;
+
+	n = (r2t_tid16_out ? TID_WORDS : 8);
+
+	for (i=n; i>0; --i) {
+		word = tid_bitmap[i-1];
+		if (!r2t_tid16_out && (i == 8))
+			word |= 0x80000000; // 0xff is invalid on a v1 wire
+		if (word != 0xffffffff) {
+			for (bit=31; word & (1U << bit); --bit)
+				;
+			return ((i-1) << 5) + bit;
+		}
+	}
+
+	return R2T_TID_NONE;
+}
+
+/** unpark and close a warm connection
+ * @param[in] tun parked pool connection */
+static void pool_drop(tunnel_t *tun)
+{
+	assert(valid_tunnel(tun) && tun->pooled);
+	trace_tun("id=0x%02x", tun->id);
+
+	--tun->pool->nconns;
+	tun->pooled = 0;
+	tun->pool = NULL;
+	tunnel_close(tun);
+}
+
+/**
+ * evict a parked warm connection squatting a client-requested ID
+ * @param[in] id rdp2tcp tunnel ID requested by the client
+ * @return 0 if the ID was freed, -1 if a live tunnel owns it
+ */
+int tunnel_pool_evict(unsigned int id)
+{
+	tunnel_t *tun;
+
+	tun = tunnel_lookup(id);
+	if (!tun || !tun->pooled)
+		return -1;
+
+	pool_drop(tun);
+	return 0;
+}
+
+/** park a warmed connection, runs on the main loop */
+static void pool_fill_done(tunjob_t *tj)
+{
+	tunnel_t *tun = tj->tun;
+	pooltarget_t *pt = tun->pool;
+	unsigned int id;
+
+	--pt->filling;
+
+	id = (tj->ret >= 0 ? pool_generate_id() : R2T_TID_NONE);
+	if ((id == R2T_TID_NONE) || event_add_tunnel(tun->sock.evt, id)) {
+		if (tj->ret >= 0)
+			net_close(&tun->sock);
+		free(tun);
+		free(tj);
+		return;
+	}
+
+	tun->id = (unsigned short) id;
+	tun->connected = (tj->ret == 0);
+	if (tun->connected)
+		tunnel_tune(tun);
+	iobuf_init2(&tun->rio.buf, &tun->wio.buf, "pool");
+	list_add_tail(&tun->list, &pt->conns);
+	++pt->nconns;
+	tunnel_register(tun);
+	debug(0, "warmed connection 0x%02x to %s:%hu", id, pt->host, pt->port);
+	free(tj);
+}
+
+/**
+ * warm a hot target up to the configured pool depth
+ * @param[in] pt hot pool target
+ * @note warming is opportunistic: unlike tunnel_create there is no
+ *       synchronous fallback which would block the main loop
+ */
+static void pool_refill(pooltarget_t *pt)
+{
+	tunnel_t *tun;
+	tunjob_t *tj;
+
+	while (pt->nconns + pt->filling < pool_config()) {
+
+		tun = tunnel_alloc(R2T_TID_NONE);
+		if (!tun)
+			return;
+		tun->pooled = 1;
+		tun->pool = pt;
+
+		tj = calloc(1, sizeof(*tj) + strlen(pt->host));
+		if (!tj) {
+			free(tun);
+			return;
+		}
+		tj->job.run      = tunnel_setup_run;
+		tj->job.complete = tunnel_setup_complete;
+		tj->tun     = tun;
+		tj->kind    = TUNJOB_POOLFILL;
+		tj->pref_af = pt->pref_af;
+		tj->port    = pt->port;
+		strcpy(tj->host, pt->host);
+
+		if (worker_post(&tj->job)) {
+			free(tj);
+			free(tun);
+			return;
+		}
+		++pt->filling;
+	}
+}
+
+/**
+ * handle a network event on a parked warm connection
+ * @param[in] tun parked pool connection
+ * @return 0 on success
+ */
+static int tunnel_pool_event(tunnel_t *tun)
+{
+	int evt;
+	WSANETWORKEVENTS events;
+
+	assert(valid_tunnel(tun) && tun->pooled);
+
+	if (WSAEnumNetworkEvents(tun->sock.fd, tun->sock.evt, &events)) {
+		if (WSAGetLastError() != ERROR_IO_PENDING)
+			return wsaerror("WSAEnumNetworkEvents");
+		return 0;
+	}
+
+	evt = (int) events.lNetworkEvents;
+	trace_tun("id=0x%02x, close=%i, conn=%i", tun->id,
+				!!(evt & FD_CLOSE), !!(evt & FD_CONNECT));
+
+	if (evt & FD_CONNECT) {
+		if (events.iErrorCode[FD_CONNECT_BIT]) {
+			pool_drop(tun);
+			return 0;
+		}
+		tun->connected = 1;
+		tunnel_tune(tun);
+		// switch away from FD_CONNECT-only watching, or a parked
+		// connection would never report the peer hanging up
+		if (net_update_watch(&tun->sock, &tun->wio.buf))
+			return wsaerror("WSAEventSelect");
+	}
+
+	// the target dropped an idle warm connection: let it go and refill
+	// on demand instead of fighting the idle timeout
+	if (evt & FD_CLOSE)
+		pool_drop(tun);
+
+	return 0;
+}
+
+/**
+ * track R2TCMD_CONN history and try to bind a parked warm connection
+ * @param[in] id rdp2tcp tunnel ID requested by the client
+ * @param[in] pref_af preferred address family
+ * @param[in] host target hostname
+ * @param[in] port target tcp port
+ * @return 0 when the tunnel was bound to a warm connection
+ */
+static int tunnel_pool_bind(
+				unsigned int id,
+				int pref_af,
+				const char *host,
+				unsigned short port)
+{
+	pooltarget_t *pt;
+	tunnel_t *tun, *claimed;
+	unsigned int ans_len;
+	unsigned char ans[1+sizeof(r2tmsg_connans_t)];
+	char buf[NETADDRSTR_MAXSIZE];
+
+	pt = pool_target_find(host, port);
+	if (!pt) {
+		pt = pool_target_add(host, port, pref_af);
+		if (!pt)
+			return -1; // target table is full
+	}
+	++pt->seen;
+
+	if (!pt->hot) {
+		if (pt->seen < POOL_HOT_SEEN)
+			return -1;
+		pt->hot = 1;
+		info(0, "pool: %s:%hu is hot, warming %u connections",
+				pt->host, pt->port, pool_config());
+	}
+
+	claimed = NULL;
+	list_for_each(tun, &pt->conns) {
+		if (tun->connected) {
+			claimed = tun;
+			break;
+		}
+	}
+
+	if (!claimed) {
+		++pt->misses;
+		pool_refill(pt);
+		return -1; // fall back to a cold connect
+	}
+
+	list_del(&claimed->list);
+	--pt->nconns;
+
+	// re-key the parked connection to the client-requested ID
+	event_del_tunnel(claimed->id);
+	tunnel_unregister(claimed);
+	if (event_add_tunnel(claimed->sock.evt, id)) {
+		iobuf_kill2(&claimed->rio.buf, &claimed->wio.buf);
+		net_close(&claimed->sock);
+		free(claimed);
+		++pt->misses;
+		return -1;
+	}
+	claimed->id = (unsigned short) id;
+	claimed->pooled = 0;
+	claimed->pool = NULL;
+	memset(&claimed->stats, 0, sizeof(claimed->stats));
+	list_add_tail(&claimed->list, &all_tunnels);
+	tunnel_register(claimed);
+
+	++pt->hits;
+	info(0, "tunnel 0x%02x bound to warm connection %s "
+			"(pool: %u hits, %u misses)",
+			id, netaddr_print(&claimed->addr, buf), pt->hits, pt->misses);
+
+	ans[0] = R2TERR_SUCCESS;
+	ans_len = 1 + netaddr_to_connans(&claimed->addr,
+							(r2tmsg_connans_t *)&ans[1]);
+	if (channel_write(R2TCMD_CONN, id, ans, ans_len) < 0) {
+		tunnel_close(claimed);
+		return 0;
+	}
+
+	pool_refill(pt);
+
+	// deliver whatever the target sent while the connection was parked
+	if (tunnel_sockrecv_event(claimed) < 0)
+		tunnel_close(claimed);
+
+	return 0;
+}
+
+/** close all parked connections and log the per-target counters */
+static void pool_kill(void)
+{
+	pooltarget_t *pt;
+	tunnel_t *tun, *bak;
+	unsigned int i;
+
+	for (i=0; i<pool_targets_count; ++i) {
+		pt = &pool_targets[i];
+		list_for_each_safe(tun, bak, &pt->conns)
+			pool_drop(tun);
+		if (pt->seen)
+			info(0, "pool: %s:%hu %u hits, %u misses",
+					pt->host, pt->port, pt->hits, pt->misses);
+	}
+}
+
+/** event/channel half of tunnel setup, runs on the main loop */
+static void tunnel_setup_complete(job_t *job)
+{
+	tunjob_t *tj = (tunjob_t *) job;
+	tunnel_t *tun = tj->tun;
+	int ret;
+
+	if (tj->kind == TUNJOB_POOLFILL) {
+		pool_fill_done(tj);
+		return;
+	}
+
+	if (tunnel_lookup(tun->id)) {
+		// the ID was taken again while setup was in flight
+		error("tunnel 0x%02x reused during setup", tun->id);
+		if (tj->kind != TUNJOB_PROCESS) {
+			if (tj->ret >= 0)
+				net_close(&tun->sock);
+		} else if (!tj->ret) {
+			TerminateProcess(tj->pi.hProcess, 0);
+			CloseHandle(tj->pi.hProcess);
+			CloseHandle(tj->pstd[0]);
+			CloseHandle(tj->pstd[1]);
+		}
+		free(tun);
+		free(tj);
+		return;
+	}
+
+	switch (tj->kind) {
+
+		case TUNJOB_CONNECT:
+			ret = host_connect_done(tun, tj->ret, tj->err, tj->host, tj->port);
+			break;
+
+		case TUNJOB_BIND:
+			ret = host_bind_done(tun, tj->ret, tj->err, tj->host, tj->port);
+			break;
+
+		default:
+			ret = process_attach(tun, tj->host, tj->ret, tj->pstd,
+										&tj->pi, tj->perr, tj->sysfunc,
+										tj->syserr);
+	}
+
+	if (ret >= 0) {
+		list_add_tail(&tun->list, &all_tunnels);
+		tunnel_register(tun);
+		debug(0, "tunnel 0x%02x created", tun->id);
+	} else {
+		debug(0, "failed to create tunnel 0x%02x", tun->id);
+		free(tun);
+	}
+
+	free(tj);
+}
+
 /**
  * create rdp2tcp tunnel
  * @param[in] id rdp2tcp tunnel ID
@@ -267,24 +1018,51 @@ static tunnel_t *tunnel_alloc(unsigned char id)
  * @param[in] host tunnel hostname or command line
  * @param[in] port tcp tunnel port or 0 for process tunnel
  * @param[in] bind_socket 1 for reverse connect tunnel
+ * @note the blocking half (resolve/connect/CreateProcess) runs on the
+ *       worker pool, the tunnel is registered once setup completed
  */
 void tunnel_create(
-			unsigned char id,
+			unsigned int id,
 			int pref_af,
 			const char *host,
 			unsigned short port,
 			int bind_socket)
 {
 	tunnel_t *tun;
+	tunjob_t *tj;
 	int ret;
 
 	assert(host && *host);
 	trace_tun("id=0x%02x, pref_af=%i, host=%s, port=%hu", id, pref_af, host, port);
 
+	// a warm connection to a hot target short-circuits the whole setup
+	if ((port > 0) && !bind_socket && pool_config()
+			&& !tunnel_pool_bind(id, pref_af, host, port))
+		return;
+
 	tun = tunnel_alloc(id);
 	if (!tun)
 		return;
 
+	tj = calloc(1, sizeof(*tj) + strlen(host));
+	if (tj) {
+		tj->job.run      = tunnel_setup_run;
+		tj->job.complete = tunnel_setup_complete;
+		tj->tun     = tun;
+		tj->pref_af = pref_af;
+		tj->port    = port;
+		strcpy(tj->host, host);
+		if (port > 0)
+			tj->kind = (!bind_socket ? TUNJOB_CONNECT : TUNJOB_BIND);
+		else
+			tj->kind = TUNJOB_PROCESS;
+
+		if (!worker_post(&tj->job))
+			return;
+		free(tj);
+	}
+
+	// fallback: synchronous setup when the pool is not running
 	if (port > 0) {
 		// tcp tunnel
 		if (!bind_socket)
@@ -298,6 +1076,7 @@ void tunnel_create(
 
 	if (ret >= 0) {
 		list_add_tail(&tun->list, &all_tunnels);
+		tunnel_register(tun);
 		debug(0, "tunnel 0x%02x created", id);
 
 	} else {
@@ -306,6 +1085,69 @@ void tunnel_create(
 	}
 }
 
+/**
+ * create a UDP relay tunnel
+ * @param[in] id rdp2tcp tunnel ID
+ * @note setup is synchronous, binding a local datagram socket
+ *       does not block the main loop
+ */
+void tunnel_create_udp(unsigned int id)
+{
+	tunnel_t *tun;
+	int alen;
+	unsigned int ans_len;
+	unsigned char ans[1+sizeof(r2tmsg_connans_t)];
+	unsigned char err;
+
+	trace_tun("id=0x%02x", id);
+
+	tun = tunnel_alloc(id);
+	if (!tun)
+		return;
+
+	memset(&tun->addr, 0, sizeof(tun->addr));
+	tun->addr.ip4.sin_family = AF_INET;
+
+	tun->sock.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (tun->sock.fd != INVALID_SOCKET) {
+
+		tun->sock.evt = WSACreateEvent();
+		if (tun->sock.evt != WSA_INVALID_EVENT) {
+
+			alen = sizeof(tun->addr.ip4);
+			if (!bind(tun->sock.fd, (struct sockaddr *)&tun->addr, alen)
+					&& !getsockname(tun->sock.fd,
+										(struct sockaddr *)&tun->addr, &alen)
+					&& !WSAEventSelect(tun->sock.fd, tun->sock.evt, FD_READ)
+					&& !event_add_tunnel(tun->sock.evt, id)) {
+
+				iobuf_init2(&tun->rio.buf, &tun->wio.buf, "udp");
+				tun->udp       = 1;
+				tun->connected = 1;
+				list_add_tail(&tun->list, &all_tunnels);
+				tunnel_register(tun);
+
+				info(0, "UDP relay tunnel 0x%02x on port %hu",
+						id, ntohs(tun->addr.ip4.sin_port));
+
+				ans[0] = R2TERR_SUCCESS;
+				ans_len = 1 + netaddr_to_connans(&tun->addr,
+										(r2tmsg_connans_t *)&ans[1]);
+				if (channel_write(R2TCMD_CONN, id, ans, ans_len) < 0)
+					tunnel_close(tun);
+				return;
+			}
+			WSACloseEvent(tun->sock.evt);
+		}
+		closesocket(tun->sock.fd);
+	}
+
+	error("failed to create UDP relay tunnel 0x%02x", id);
+	err = R2TERR_GENERIC;
+	channel_write(R2TCMD_CONN, id, &err, 1);
+	free(tun);
+}
+
 /** close rdp2tcp tunnel
  * @param[in] tun established tunnel */
 void tunnel_close(tunnel_t *tun)
@@ -314,6 +1156,13 @@ void tunnel_close(tunnel_t *tun)
 	trace_tun("id=0x%02x", tun->id);
 
 	list_del(&tun->list);
+	tunnel_unregister(tun);
+	channel_fq_unlink(tun);
+
+	if (lat_tun == tun) {
+		lat_tun = NULL;
+		lat_mark_us = 0;
+	}
 
 	event_del_tunnel(tun->id);
 
@@ -328,7 +1177,17 @@ void tunnel_close(tunnel_t *tun)
 		process_stop(tun);
 	}
 
-	free(tun);
+	if (tun->rsm_on) {
+		iobuf_kill(&tun->rsm_buf);
+		tun->rsm_on = 0;
+	}
+
+	if (free_tunnels_count < TUNNEL_POOL_SIZE) {
+		list_add_tail(&tun->list, &free_tunnels);
+		++free_tunnels_count;
+	} else {
+		free(tun);
+	}
 }
 
 static int tunnel_sockrecv_event(tunnel_t *tun)
@@ -338,6 +1197,16 @@ static int tunnel_sockrecv_event(tunnel_t *tun)
 
 	assert(valid_tunnel(tun));
 
+	// stop reading until the client acknowledges in-flight data,
+	// the scheduler drains the staged payload or the tunnel is
+	// resynced after a channel blip
+	if (tun->rsm_wait
+			|| (iobuf_datalen(&tun->rio.buf) >= CHANNEL_TXQ_MAX)
+			|| (channel_wndup_active() && (tun->wnd_used >= channel_window))) {
+		tun->throttled = 1;
+		return 0;
+	}
+
 	ret = net_read(&tun->sock, &tun->rio.buf, 0, &tun->rio.min_io_size, &r);
 	trace_tun("id=0x%02x --> ret=%i, r=%u", tun->id, ret, r);
 	if (ret < 0)
@@ -355,6 +1224,123 @@ static int tunnel_sockrecv_event(tunnel_t *tun)
 	return 0;
 }
 
+/** batched datagram records pending on the virtual channel */
+static unsigned char udp_batch[NETBUF_MAX_SIZE];
+
+/**
+ * forward datagrams received by a UDP relay tunnel
+ * @param[in] tun established UDP tunnel
+ * @return 0 on success
+ * @note datagrams are batched into a single R2TCMD_UDATA message;
+ *       they are lossy traffic and bypass flow-control accounting
+ */
+static int tunnel_udprecv_event(tunnel_t *tun)
+{
+	int r, alen;
+	unsigned int used, rlen;
+	netaddr_t src;
+	unsigned char *rec;
+	char dgram[RDP2TCP_MAX_DGRAM];
+
+	assert(valid_tunnel(tun) && tun->udp);
+	trace_tun("id=0x%02x", tun->id);
+
+	used = 0;
+	for (;;) {
+
+		memset(&src, 0, sizeof(src));
+		alen = sizeof(src);
+		r = recvfrom(tun->sock.fd, dgram, sizeof(dgram), 0,
+						(struct sockaddr *)&src, &alen);
+		if (r < 0)
+			break; // WSAEWOULDBLOCK, flush what was batched
+
+		rlen = 5 + (netaddr_af(&src) == AF_INET ? 4 : 16) + (unsigned int) r;
+		if (used && (used + rlen > sizeof(udp_batch))) {
+			channel_write(R2TCMD_UDATA, tun->id, udp_batch, used);
+			++tun->stats.msgs_out;
+			used = 0;
+		}
+
+		rec = &udp_batch[used];
+		if (netaddr_af(&src) == AF_INET) {
+			rec[0] = TUNAF_IPV4;
+			memcpy(&rec[1], &src.ip4.sin_port, 2);
+			memcpy(&rec[5], &src.ip4.sin_addr, 4);
+			alen = 4;
+		} else {
+			rec[0] = TUNAF_IPV6;
+			memcpy(&rec[1], &src.ip6.sin6_port, 2);
+			memcpy(&rec[5], &src.ip6.sin6_addr, 16);
+			alen = 16;
+		}
+		rec[3] = (unsigned char)((unsigned int) r >> 8);
+		rec[4] = (unsigned char)(r & 0xff);
+		memcpy(&rec[5+alen], dgram, r);
+		used += 5 + alen + (unsigned int) r;
+
+		print_xfer("udp", 'r', (unsigned int) r);
+		tun->stats.bytes_in += (unsigned int) r;
+	}
+
+	if (used) {
+		if (channel_write(R2TCMD_UDATA, tun->id, udp_batch, used) < 0)
+			return -1;
+		++tun->stats.msgs_out;
+	}
+
+	return 0;
+}
+
+/**
+ * send datagrams received from the rdp2tcp client
+ * @param[in] tun established UDP tunnel
+ * @param[in] data R2TCMD_UDATA records
+ * @param[in] len total records size
+ * @return 0 on success
+ */
+int tunnel_udata_event(tunnel_t *tun, const void *data, unsigned int len)
+{
+	const unsigned char *rec;
+	unsigned int off, alen, plen;
+	netaddr_t dst;
+
+	assert(valid_tunnel(tun) && tun->udp && data);
+	trace_tun("id=0x%02x, len=%u", tun->id, len);
+
+	rec = data;
+	for (off = 0; off + 5 <= len; off += 5 + alen + plen) {
+
+		switch (rec[off]) {
+			case TUNAF_IPV4: alen = 4;  break;
+			case TUNAF_IPV6: alen = 16; break;
+			default:
+				return error("invalid UDP relay record");
+		}
+
+		plen = (((unsigned int)rec[off+3]) << 8) | rec[off+4];
+		if (off + 5 + alen + plen > len)
+			return error("truncated UDP relay record");
+
+		if (alen != 4)
+			continue; // the relay socket is IPv4-only
+
+		memset(&dst, 0, sizeof(dst));
+		dst.ip4.sin_family = AF_INET;
+		memcpy(&dst.ip4.sin_port, &rec[off+1], 2);
+		memcpy(&dst.ip4.sin_addr, &rec[off+5], 4);
+
+		// drop on error, datagrams are best-effort
+		sendto(tun->sock.fd, (const char *)&rec[off+5+alen], plen, 0,
+				 (const struct sockaddr *)&dst, sizeof(dst.ip4));
+		print_xfer("udp", 'w', plen);
+		tun->stats.bytes_out += plen;
+	}
+	++tun->stats.msgs_in;
+
+	return 0;
+}
+
 static int on_read_completed(iobuf_t *ibuf, tunnel_t *tun)
 {
 	assert(valid_iobuf(ibuf) && valid_tunnel(tun));
@@ -364,14 +1350,152 @@ static int on_read_completed(iobuf_t *ibuf, tunnel_t *tun)
 static int tunnel_fdread_event(tunnel_t *tun)
 {
 	assert(valid_tunnel(tun));
+
+	// stop reading until the client acknowledges in-flight data,
+	// the scheduler drains the staged payload or the tunnel is
+	// resynced after a channel blip
+	if (tun->rsm_wait
+			|| (iobuf_datalen(&tun->rio.buf) >= CHANNEL_TXQ_MAX)
+			|| (channel_wndup_active() && (tun->wnd_used >= channel_window))) {
+		tun->throttled = 1;
+		return 0;
+	}
+
 	return aio_read(&tun->rio, tun->rfd, "tun",
 							(aio_readcb_t)on_read_completed, tun);
 }
 
 static int tunnel_fdwrite_event(tunnel_t *tun)
 {
+	int ret;
+	unsigned int before;
+
 	assert(valid_tunnel(tun));
-	return aio_write(&tun->wio, tun->wfd, "tun");
+
+	before = iobuf_datalen(&tun->wio.buf);
+	ret = aio_write(&tun->wio, tun->wfd, "tun");
+	if (ret >= 0) {
+		channel_wndup_consumed(tun, before - iobuf_datalen(&tun->wio.buf));
+		tun->stats.bytes_out += before - iobuf_datalen(&tun->wio.buf);
+		tunnel_lat_drained(tun);
+	}
+
+	return ret;
+}
+
+/**
+ * handle a R2TCMD_WNDUP window update from the rdp2tcp client
+ * @param[in] tun established tunnel
+ * @param[in] acked acknowledged payload size
+ * @return 0 on success
+ */
+int tunnel_window_event(tunnel_t *tun, unsigned int acked)
+{
+	assert(valid_tunnel(tun));
+	trace_tun("id=0x%02x, acked=%u, used=%u", tun->id, acked, tun->wnd_used);
+
+	if (acked < tun->wnd_used)
+		tun->wnd_used -= acked;
+	else
+		tun->wnd_used = 0;
+
+	// resume reading if the tunnel was throttled
+	if (tun->throttled && (tun->wnd_used < channel_window)) {
+		tun->throttled = 0;
+		return (tun->proc
+					? tunnel_fdread_event(tun)
+					: tunnel_sockrecv_event(tun));
+	}
+
+	return 0;
+}
+
+/**
+ * resume reading a tunnel once the scheduler drained its staging
+ * @param[in] tun established tunnel
+ * @return 0 on success
+ */
+int tunnel_staging_event(tunnel_t *tun)
+{
+	assert(valid_tunnel(tun));
+
+	if (!tun->throttled || tun->rsm_wait
+			|| (iobuf_datalen(&tun->rio.buf) >= CHANNEL_TXQ_MAX)
+			|| (channel_wndup_active() && (tun->wnd_used >= channel_window)))
+		return 0;
+
+	tun->throttled = 0;
+	return (tun->proc
+				? tunnel_fdread_event(tun)
+				: tunnel_sockrecv_event(tun));
+}
+
+/**
+ * handle a R2TCMD_RESUME resync request from the rdp2tcp client
+ * @param[in] tid tunnel identifier
+ * @param[in] cli_seq payload bytes the client safely received
+ * @return -1 on channel error
+ */
+int tunnel_resume_event(unsigned int tid, unsigned long long cli_seq)
+{
+	tunnel_t *tun;
+	r2tmsg_resumeans_t ans;
+	char *ptr;
+	unsigned long long seq_out, seq_in;
+	unsigned int delta, avail, chunk;
+
+	tun = tunnel_lookup(tid);
+	seq_out = (tun ? tun->stats.bytes_in : 0);
+	avail = ((tun && (tun->rsm_on == 1)) ? iobuf_datalen(&tun->rsm_buf) : 0);
+
+	if (!tun || tun->udp || (cli_seq > seq_out)
+			|| (seq_out - cli_seq > avail)) {
+		ans.err = (tun ? R2TERR_GENERIC : R2TERR_NOTFOUND);
+		ans.seq_hi = 0;
+		ans.seq_lo = 0;
+		channel_write(R2TCMD_RESUME, tid, &ans, sizeof(ans));
+		if (tun && !tun->udp) {
+			error("cannot resync tunnel 0x%02x", tid);
+			tunnel_close(tun);
+		}
+		return 0;
+	}
+
+	// stale flow-control state, the client re-acknowledges
+	// replayed data
+	tun->wnd_used = 0;
+	tun->wnd_ack  = 0;
+	tun->rsm_wait = 0;
+
+	seq_in = tun->stats.bytes_out + iobuf_datalen(&tun->wio.buf);
+	ans.err = R2TERR_SUCCESS;
+	ans.seq_hi = htonl((unsigned int)(seq_in >> 32));
+	ans.seq_lo = htonl((unsigned int) seq_in);
+	if (channel_write(R2TCMD_RESUME, tid, &ans, sizeof(ans)) < 0)
+		return -1;
+
+	delta = (unsigned int)(seq_out - cli_seq);
+	info(0, "resumed tunnel 0x%02x, replaying %u bytes", tid, delta);
+
+	ptr = (char *) iobuf_dataptr(&tun->rsm_buf) + (avail - delta);
+	while (delta > 0) {
+		chunk = (delta > NETBUF_MAX_SIZE ? NETBUF_MAX_SIZE : delta);
+		if (channel_write(R2TCMD_DATA, tid, ptr, chunk) < 0)
+			return -1;
+		ptr += chunk;
+		delta -= chunk;
+	}
+
+	// kick the reader if it was parked waiting for the resync
+	if (tun->throttled
+			&& (!channel_wndup_active() || (tun->wnd_used < channel_window))) {
+		tun->throttled = 0;
+		return (tun->proc
+					? tunnel_fdread_event(tun)
+					: tunnel_sockrecv_event(tun));
+	}
+
+	return 0;
 }
 
 static int tunnel_accept_event(tunnel_t *tun)
@@ -379,10 +1503,9 @@ static int tunnel_accept_event(tunnel_t *tun)
 	tunnel_t *cli;
 	sock_t cli_sock;
 	int ret;
-	unsigned char tid;
-	unsigned int msg_len;
+	unsigned int tid, msg_len;
 	netaddr_t addr;
-	r2tmsg_rconnreq_t msg;
+	unsigned char msg[2+sizeof(r2tmsg_connans_t)];
 	char host[NETADDRSTR_MAXSIZE];
 
 	assert(valid_tunnel(tun));
@@ -393,7 +1516,7 @@ static int tunnel_accept_event(tunnel_t *tun)
 		return wsaerror("accept");
 
 	tid = tunnel_generate_id();
-	if (tid == 0xff) {
+	if (tid == R2T_TID_NONE) {
 		error("failed to generate tunnel identifier");
 		net_close(&cli_sock);
 		return 0;
@@ -417,14 +1540,24 @@ static int tunnel_accept_event(tunnel_t *tun)
 	cli->sock.fd   = cli_sock.fd;
 	cli->sock.evt  = cli_sock.evt;
 	cli->connected = 1;
+	tunnel_tune(cli);
 	cli->id        = tid;
 	iobuf_init2(&cli->rio.buf, &cli->wio.buf, "tcp");
 	list_add_tail(&cli->list, &all_tunnels);
+	tunnel_register(cli);
 
-	msg_len = netaddr_to_connans(&addr, (r2tmsg_connans_t *)&msg);
-	msg.rid = tid;
+	// the reverse-connect ID is as wide as the negotiated tunnel IDs
+	if (r2t_tid16_out) {
+		msg[0] = (unsigned char)(tid >> 8);
+		msg[1] = (unsigned char)(tid & 0xff);
+		msg_len = 2;
+	} else {
+		msg[0] = (unsigned char) tid;
+		msg_len = 1;
+	}
+	msg_len += netaddr_to_connans(&addr, (r2tmsg_connans_t *)&msg[msg_len]);
 
-	if (channel_write(R2TCMD_RCONN, tun->id, &msg.rid, msg_len) < 0)
+	if (channel_write(R2TCMD_RCONN, tun->id, msg, msg_len) < 0)
 		tunnel_close(tun);
 
 	return 0;
@@ -434,6 +1567,11 @@ static int tunnel_close_event(tunnel_t *tun)
 {
 	assert(valid_tunnel(tun));
 
+	// flush the staged tail so a graceful close right after a burst
+	// does not drop payload the peer already sent
+	if (iobuf_datalen(&tun->rio.buf))
+		channel_forward_flush(tun);
+
 	channel_write(R2TCMD_CLOSE, tun->id, NULL, 0);
 	tunnel_close(tun);
 
@@ -453,6 +1591,9 @@ int tunnel_event(tunnel_t *tun, HANDLE h)
 	assert(valid_tunnel(tun) && h);
 	trace_tun("id=0x%02x %s h=%x", tun->id, tun->proc ? "proc" : "tcp", h);
 
+	if (tun->pooled) // parked warm connection
+		return tunnel_pool_event(tun);
+
 	if (tun->proc) { // process tunnel
 
 		if (h == tun->proc) { // process is dead
@@ -501,7 +1642,9 @@ int tunnel_event(tunnel_t *tun, HANDLE h)
 
 			if ((ret >= 0) && (evt & FD_READ)) {
 				debug(0, "FD_READ");
-				ret = tunnel_sockrecv_event(tun);
+				ret = (tun->udp
+							? tunnel_udprecv_event(tun)
+							: tunnel_sockrecv_event(tun));
 			}
 
 			if (evt & FD_CLOSE) {
@@ -528,7 +1671,8 @@ int tunnel_event(tunnel_t *tun, HANDLE h)
  * @return 0 on success */
 int tunnel_write(tunnel_t *tun, const void *data, unsigned int len)
 {
-	unsigned int used;
+	unsigned int used, w;
+	int ret;
 	iobuf_t *obuf;
 
 	assert(valid_tunnel(tun) && data && len);
@@ -540,11 +1684,42 @@ int tunnel_write(tunnel_t *tun, const void *data, unsigned int len)
 	assert(valid_iobuf(obuf));
 
 	used = iobuf_datalen(obuf);
-	if (len > 0) {
-		if (!iobuf_append(obuf, data, len))
-			return error("failed to append %u bytes to tunnel buffer", len);
+
+	// zero-copy forward: a payload still sitting in the channel input
+	// buffer is sent straight to the socket, only the unsent tail is
+	// queued (overlapped process I/O needs a stable buffer and keeps
+	// the copy path)
+	if (!used && tun->connected && !tun->proc) {
+		tunnel_lat_enqueue(tun);
+		ret = net_write(&tun->sock, obuf, data, len, &w);
+		if (ret < 0)
+			return error("%s", net_error(NETERR_SEND, ret));
+
+		++tun->stats.msgs_in;
+		if (w > 0) {
+			print_xfer("tcp", 'w', w);
+			channel_wndup_consumed(tun, w);
+			tun->stats.bytes_out += w;
+		}
+		tunnel_lat_drained(tun);
+
+		if (iobuf_datalen(obuf)) {
+			if (iobuf_datalen(obuf) > tun->stats.obuf_hiwat)
+				tun->stats.obuf_hiwat = iobuf_datalen(obuf);
+			if (net_update_watch(&tun->sock, obuf))
+				return wsaerror("WSAEventSelect");
+		}
+
+		return 0;
 	}
 
+	if (!iobuf_append(obuf, data, len))
+		return error("failed to append %u bytes to tunnel buffer", len);
+	++tun->stats.msgs_in;
+	tunnel_lat_enqueue(tun);
+	if (iobuf_datalen(obuf) > tun->stats.obuf_hiwat)
+		tun->stats.obuf_hiwat = iobuf_datalen(obuf);
+
 	if ((used > 0) || !tun->connected)
 		return 0;
 
@@ -568,5 +1743,7 @@ void tunnels_kill(void)
 	list_for_each_safe(tun, bak, &all_tunnels) {
 		tunnel_close(tun);
 	}
+
+	pool_kill();
 }
 
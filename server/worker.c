@@ -0,0 +1,141 @@
+/**
+ * @file worker.c
+ * worker thread pool for blocking tunnel setup
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2twin.h"
+
+/*
+ * Blocking setup work (CreateProcess, hostname resolution, connect
+ * establishment) runs on a small thread pool so that a tunnel burst
+ * does not freeze the I/O of established tunnels. A job carries a
+ * run callback executed on a worker thread and a complete callback
+ * executed on the main loop once the job has been posted back
+ * through the completion port.
+ */
+
+/** number of worker threads */
+#define WORKER_POOL_SIZE 4
+
+static LIST_HEAD_INIT(job_queue);
+static CRITICAL_SECTION job_lock;
+static HANDLE job_sem;
+static HANDLE worker_threads[WORKER_POOL_SIZE];
+static int workers_running;
+
+static DWORD WINAPI worker_main(void *unused)
+{
+	job_t *job;
+
+	(void) unused;
+
+	for (;;) {
+		WaitForSingleObject(job_sem, INFINITE);
+		if (!workers_running)
+			break;
+
+		EnterCriticalSection(&job_lock);
+		job = NULL;
+		if (!list_empty(&job_queue)) {
+			job = (job_t *) job_queue.next;
+			list_del(&job->list);
+		}
+		LeaveCriticalSection(&job_lock);
+
+		if (job) {
+			job->run(job);
+			event_post_job(job);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * start the worker thread pool
+ * @return 0 on success
+ */
+int workers_init(void)
+{
+	unsigned int i;
+
+	InitializeCriticalSection(&job_lock);
+
+	job_sem = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+	if (!job_sem)
+		return syserror("CreateSemaphore");
+
+	workers_running = 1;
+	for (i=0; i<WORKER_POOL_SIZE; ++i) {
+		worker_threads[i] = CreateThread(NULL, 0, worker_main, NULL, 0, NULL);
+		if (!worker_threads[i]) {
+			workers_kill();
+			return syserror("CreateThread");
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * stop the worker thread pool
+ */
+void workers_kill(void)
+{
+	unsigned int i;
+
+	if (!workers_running)
+		return;
+
+	workers_running = 0;
+	ReleaseSemaphore(job_sem, WORKER_POOL_SIZE, NULL);
+
+	for (i=0; i<WORKER_POOL_SIZE; ++i) {
+		if (worker_threads[i]) {
+			WaitForSingleObject(worker_threads[i], 5000);
+			CloseHandle(worker_threads[i]);
+			worker_threads[i] = NULL;
+		}
+	}
+
+	CloseHandle(job_sem);
+	DeleteCriticalSection(&job_lock);
+}
+
+/**
+ * queue a job on the worker pool
+ * @param[in] job job with run/complete callbacks set
+ * @return 0 on success, -1 if the pool is not running
+ */
+int worker_post(job_t *job)
+{
+	assert(job && job->run && job->complete);
+
+	if (!workers_running)
+		return -1;
+
+	EnterCriticalSection(&job_lock);
+	list_add_tail(&job->list, &job_queue);
+	LeaveCriticalSection(&job_lock);
+
+	ReleaseSemaphore(job_sem, 1, NULL);
+
+	return 0;
+}
@@ -643,6 +643,17 @@ WTSVirtualChannelOpen(
     IN LPSTR pVirtualName   /* ascii name */
     );
 
+#define WTS_CHANNEL_OPTION_DYNAMIC 0x00000001
+
+/* Vista/2008 and later, resolved at runtime */
+HANDLE
+WINAPI
+WTSVirtualChannelOpenEx(
+    IN DWORD SessionId,
+    IN LPSTR pVirtualName,  /* ascii name */
+    IN DWORD flags
+    );
+
 BOOL
 WINAPI
 WTSVirtualChannelClose(